@@ -2,7 +2,7 @@
 
 // Aligns a pointer `addr` up to the closest address that is aligned with `align`, assuming of
 // course that `align` is a power of two.
-#define align_up(addr, align) ((addr) + ((align - 1)) & ~((align - 1)))
+#define align_up(addr, align) (((addr) + ((align)-1)) & ~((align)-1))
 
 #define ALLOC_DEBUG 0
 #define debug_alloc(fmt, ...)                                                                      \
@@ -12,20 +12,53 @@
         }                                                                                          \
     } while (0)
 
+// The most regions a thread keeps on its free list
+#define MAX_FREE_REGIONS 256
+
+// Retired regions, waiting to be reused by any arena on the same thread
+static _Thread_local region_t* free_regions = NULL;
+static _Thread_local arena_stats_t stats = { 0 };
+
 static region_t* region_create(size_t size)
 {
-    region_t* region = malloc(sizeof(region_t));
-    region->start = (uintptr_t)malloc(size);
-    region->len = size;
+    // Regions on the free list all come from arenas, which almost always share a region size
+    region_t* region = free_regions;
+    if (region && region->len == size) {
+        free_regions = region->next;
+        stats.free_regions--;
+    } else {
+        // The header and the memory it describes share an allocation
+        region = malloc(sizeof(region_t) + size);
+        region->start = (uintptr_t)(region + 1);
+        region->len = size;
+    }
+
     region->free_cursor = region->start;
     region->next = NULL;
     return region;
 }
 
+// Puts the regions of the list on the free list, or frees them once the free list is full
+static void region_retire(region_t* region, bool reusable)
+{
+    while (region != NULL) {
+        region_t* next = region->next;
+        if (reusable && stats.free_regions < MAX_FREE_REGIONS) {
+            region->next = free_regions;
+            free_regions = region;
+            stats.free_regions++;
+        } else {
+            free(region);
+        }
+        region = next;
+    }
+}
+
 arena_t* arena_create(size_t region_size)
 {
     region_t* initial_region = region_create(region_size);
     arena_t* arena = malloc(sizeof(arena_t));
+    bzero(arena, sizeof(arena_t));
 
     arena->region_size = region_size;
     arena->region_count = 1;
@@ -35,10 +68,24 @@ arena_t* arena_create(size_t region_size)
     return arena;
 }
 
+static void* alloc_oversized(arena_t* arena, size_t size, size_t align)
+{
+    region_t* region = region_create(size + align);
+    region->next = arena->oversized;
+    arena->oversized = region;
+    arena->region_count++;
+    arena->bytes_used += size;
+    stats.oversized++;
+
+    debug_alloc("allocating %zu bytes in a region of their own\n", size);
+    uintptr_t aligned = align_up(region->start, align);
+    region->free_cursor = aligned + size;
+    return (void*)aligned;
+}
+
 void* arena_alloc(arena_t* arena, size_t size, size_t align)
 {
-    // Check that the size is not zero & is not larger than a region
-    if (size == 0 || size > arena->region_size) {
+    if (size == 0) {
         return NULL;
     }
 
@@ -47,15 +94,23 @@ void* arena_alloc(arena_t* arena, size_t size, size_t align)
 
     // Calculate the amount of free space left in the current region
     size_t bytes_used = aligned_cursor - arena->current->start;
-    size_t current_free = arena->current->len - bytes_used;
+    size_t current_free = bytes_used < arena->current->len ? arena->current->len - bytes_used : 0;
 
     debug_alloc("allocating %zu bytes, current region bytes used = %zu, current free = %zu\n", size,
         bytes_used, current_free);
 
     // Check if we need to allocate a new region
     if (size > current_free) {
+        // Big allocations get a region of their own, which leaves the rest of the current region to
+        // smaller ones instead of wasting it
+        if (size + align > arena->region_size || size > arena->region_size / 4) {
+            return alloc_oversized(arena, size, align);
+        }
+
         debug_alloc("allocating new region because %zu requested is greater than %zu free space\n",
             size, current_free);
+        region_t* full = arena->current;
+        arena->bytes_wasted += full->len - (full->free_cursor - full->start);
         region_t* new_region = region_create(arena->region_size);
         arena->current->next = new_region;
         arena->current = new_region;
@@ -65,23 +120,52 @@ void* arena_alloc(arena_t* arena, size_t size, size_t align)
 
     // Allocate the memory
     uintptr_t new_cursor = aligned_cursor + size;
+    arena->bytes_used += new_cursor - arena->current->free_cursor;
     arena->current->free_cursor = new_cursor;
 
     return (void*)aligned_cursor;
 }
 
-void arena_release(arena_t* arena)
+// Folds the arena's usage since the last reset into the thread's stats
+static void record_stats(arena_t* arena)
 {
-    region_t* current = arena->head;
-    while (current != NULL) {
-        region_t* next = current->next;
-        free((void*)current->start);
-        free(current);
-        current = next;
+    if (arena->bytes_used > stats.high_water) {
+        stats.high_water = arena->bytes_used;
+    }
+    if (arena->region_count > stats.max_regions) {
+        stats.max_regions = arena->region_count;
     }
+    stats.bytes_wasted += arena->bytes_wasted;
+    stats.resets++;
+}
+
+void arena_reset(arena_t* arena)
+{
+    record_stats(arena);
+
+    region_retire(arena->head->next, true);
+    region_retire(arena->oversized, false);
+
+    arena->head->next = NULL;
+    arena->head->free_cursor = arena->head->start;
+    arena->current = arena->head;
+    arena->oversized = NULL;
+    arena->region_count = 1;
+    arena->bytes_used = 0;
+    arena->bytes_wasted = 0;
+}
+
+void arena_release(arena_t* arena)
+{
+    record_stats(arena);
+
+    region_retire(arena->head, true);
+    region_retire(arena->oversized, false);
     free(arena);
 }
 
+arena_stats_t arena_get_stats() { return stats; }
+
 /**
  ***************************************************************************************************
  * Tests
@@ -124,6 +208,60 @@ int test_arena_alloc()
     return 0;
 }
 
+int test_arena_reset()
+{
+    arena_stats_t before = arena_get_stats();
+    arena_t* arena = arena_create(64);
+    void* first = arena_alloc(arena, 56, 1);
+
+    // doesn't fit into the 8 bytes that are left, so those are wasted
+    arena_alloc(arena, 16, 1);
+    assert(arena->region_count == 2, "expected a second region");
+    region_t* second_region = arena->current;
+
+    arena_reset(arena);
+    assert(arena->region_count == 1, "expected only the first region to be kept");
+    assert(arena_alloc(arena, 8, 1) == first, "expected the first region to be reused");
+
+    arena_stats_t after = arena_get_stats();
+    assert(after.free_regions == before.free_regions + 1, "expected a region on the free list");
+    assert(after.bytes_wasted == before.bytes_wasted + 8, "expected 8 bytes to be wasted");
+    assert(after.high_water >= 72, "expected the high-water mark to cover the first request");
+
+    // another arena picks up the retired region instead of allocating one
+    arena_t* other = arena_create(64);
+    assert(other->head == second_region, "expected the region to come from the free list");
+
+    arena_release(other);
+    arena_release(arena);
+    return 0;
+}
+
+int test_arena_oversized()
+{
+    arena_t* arena = arena_create(64);
+    arena_stats_t before = arena_get_stats();
+    void* small = arena_alloc(arena, 8, 8);
+
+    void* big = arena_alloc(arena, 1000, 16);
+    assert(big != NULL, "expected an allocation bigger than a region to succeed");
+    assert((uintptr_t)big % 16 == 0, "expected the big allocation to be aligned");
+    memset(big, 0xff, 1000);
+
+    // the big allocation shouldn't have used up the current region
+    void* next = arena_alloc(arena, 8, 8);
+    assert((char*)next == (char*)small + 8, "expected small allocations to continue in place");
+    assert(arena_get_stats().oversized == before.oversized + 1, "expected an oversized alloc");
+
+    arena_reset(arena);
+    assert(arena->oversized == NULL, "expected the oversized region to be freed on reset");
+    assert(arena_get_stats().free_regions == before.free_regions,
+        "oversized regions should not go to the free list");
+
+    arena_release(arena);
+    return 0;
+}
+
 int arena_test_suite()
 {
     int r = 0;
@@ -133,5 +271,17 @@ int arena_test_suite()
     } else {
         printf("\t✅ test_arena_alloc\n");
     }
+    if (test_arena_reset() < 0) {
+        r = -1;
+        printf("\t❌ test_arena_reset\n");
+    } else {
+        printf("\t✅ test_arena_reset\n");
+    }
+    if (test_arena_oversized() < 0) {
+        r = -1;
+        printf("\t❌ test_arena_oversized\n");
+    } else {
+        printf("\t✅ test_arena_oversized\n");
+    }
     return r;
 }
@@ -1,17 +1,20 @@
 /*
 This module contains our basic memory allocation strategy for requests.  It works as follows:
 
-1) For request headers, we allocate a linked list of relatively small regions (1k or 4k bytes) to
-contain header data, request metadata, scratch memory, etc.
+1) For everything else a request needs, we allocate a linked list of relatively small regions (a
+few k bytes) to contain header data, request metadata, the response and its buffers, scratch
+memory, etc. Cleaning up after a request is a single `arena_reset`. Only the event loop's thread
+allocates from it, so that the thread's stats account for all of it.
 
-2) For the read buffer that we read from the client file descriptor, we use `malloc` to allocate
-(and potentially re-allocate as necessary) all the memory to hold the request. It's not so useful
-to use an arena allocator for this as we require a single continuous block, rather than a linked
-list of regions.
+2) The bytes we read from and write to the client file descriptor, and files read from disk,
+don't live in the arena, but in fixed-size segments from the buffer pool (see buffer.h). Those are
+handed back as soon as the connection is done with them, rather than staying around until the next
+request comes in.
 
-Note that we currently don't currently support any kind of streaming or chunked encoding where we
-re-use the same buffer for different parts of the request body (though we could add this in the
-future).
+Arenas are reset rather than released between requests. A reset keeps the first region, and
+hands the others to a free list that all arenas on the same thread share, so new regions rarely
+come from malloc. An allocation that is too big for a region (or for what's left of the current
+one, if it's bigger than a quarter of a region) gets a region of its own, which is freed on reset.
 */
 
 #pragma once
@@ -34,19 +37,48 @@ typedef struct arena_t {
     region_t* head;
     // The current region we are allocating from
     region_t* current;
+    // Regions holding a single allocation that didn't fit into a regular one
+    region_t* oversized;
     // The size of each region in bytes
     size_t region_size;
     // The number of regions we have allocated so far
     size_t region_count;
+    // Bytes handed out since the last reset, including alignment padding
+    size_t bytes_used;
+    // Bytes left over at the end of regions that we moved on from since the last reset
+    size_t bytes_wasted;
 } arena_t;
 
+// Usage of all arenas on the calling thread, collected whenever one of them is reset or released
+typedef struct arena_stats_t {
+    // The most bytes a single arena handed out between resets
+    size_t high_water;
+    // The most regions a single arena used between resets
+    size_t max_regions;
+    // Total bytes left over at the end of regions that filled up
+    size_t bytes_wasted;
+    // Number of allocations that needed a region of their own
+    size_t oversized;
+    // Number of times an arena was reset or released
+    size_t resets;
+    // Regions currently waiting on the free list
+    size_t free_regions;
+} arena_stats_t;
+
 // Allocates a new arena with a single region of the given size.
 arena_t* arena_create(size_t region_size);
 
-// Allocates a new chunk of memory in the arena's current region with the given size and alignment
+// Allocates a new chunk of memory in the arena with the given size and alignment
 void* arena_alloc(arena_t* arena, size_t size, size_t align);
 
+// Makes all of the arena's memory available for new allocations again. The first region is kept
+// for reuse, the others go to the free list.
+void arena_reset(arena_t* arena);
+
 // Releases all memory allocated by the arena, including the arena itself
 void arena_release(arena_t* arena);
 
+// Returns the usage stats of the arenas on the calling thread
+arena_stats_t arena_get_stats();
+
 int arena_test_suite();
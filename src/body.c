@@ -0,0 +1,206 @@
+#include "body.h"
+#include "uring.h"
+#include <errno.h>
+#include <limits.h>
+
+static size_t spool_threshold = BODY_SPOOL_THRESHOLD;
+static size_t max_size = BODY_MAX_SIZE;
+static const char* spool_dir = "/tmp";
+
+void body_configure(size_t threshold, size_t max, const char* dir)
+{
+    spool_threshold = threshold;
+    max_size = max;
+    spool_dir = dir;
+}
+
+size_t body_max_size() { return max_size; }
+
+void request_body_init(request_body_t* body) { *body = (request_body_t) { .spool_fd = -1 }; }
+
+void request_body_append(request_body_t* body, const char* data, size_t len)
+{
+    buffer_chain_append(&body->chain, data, len);
+    body->len += len;
+}
+
+// Creates a temp file without a name, so that it goes away as soon as it is closed
+static int create_spool_file()
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/c-http-body-XXXXXX", spool_dir);
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        return -1;
+    }
+    unlink(path);
+    return fd;
+}
+
+static void run_spool_job(work_item_t* item)
+{
+    body_spool_job_t* job = (body_spool_job_t*)item;
+    if (job->fd < 0 && (job->fd = create_spool_file()) < 0) {
+        job->failed = true;
+        return;
+    }
+
+    for (buffer_segment_t* segment = job->chain.head; segment; segment = segment->next) {
+        size_t written = 0;
+        while (written < segment->len) {
+            ssize_t n = write(job->fd, segment->data + written, segment->len - written);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                perror("write");
+                job->failed = true;
+                return;
+            }
+            written += n;
+        }
+    }
+}
+
+async_result_t poll_request_body_spool(request_body_t* body, int fd, bool finished)
+{
+    while (1) {
+        if (body->writing) {
+            if (!body->job.work.done) {
+                // the event loop polls us again when the job comes back from the worker pool, and
+                // starts reading from the connection again then
+                return (async_result_t) { .result = POLL_PENDING, .value = NULL };
+            }
+
+            // The segments go back to the pool on the event loop, whose pool they came from
+            body->writing = false;
+            body->spool_fd = body->job.fd;
+            buffer_chain_release(&body->job.chain);
+            if (body->job.failed) {
+                return (async_result_t) { .result = POLL_READY, .value = (void*)-1 };
+            }
+        }
+
+        if (body->len > spool_threshold) {
+            body->spooling = true;
+        }
+
+        // A spooled body is written out a segment's worth at a time, and whatever is left once it
+        // is complete
+        size_t pending = body->chain.len;
+        if (!body->spooling || pending == 0 || (!finished && pending < BUFFER_SEGMENT_CAP)) {
+            return (async_result_t) { .result = POLL_READY, .value = (void*)0 };
+        }
+
+        body->job = (body_spool_job_t) {
+            .work = { .run = run_spool_job, .fd = fd },
+            .fd = body->spool_fd,
+            .chain = body->chain,
+        };
+        body->chain = (buffer_chain_t) { 0 };
+        body->writing = true;
+        workers_submit(&body->job.work);
+        if (!body->job.work.done) {
+            io_suspend_reading(fd);
+        }
+    }
+}
+
+void request_body_release(request_body_t* body)
+{
+    buffer_chain_release(&body->chain);
+    if (body->spool_fd >= 0) {
+        close(body->spool_fd);
+    }
+    request_body_init(body);
+}
+
+/**
+ ***************************************************************************************************
+ * Tests
+ ***************************************************************************************************
+ */
+#define test_assert(cond, msg)                                                                     \
+    do {                                                                                           \
+        if (!(cond)) {                                                                             \
+            printf("Assertion failed: %s\n", msg);                                                 \
+            return -1;                                                                             \
+        }                                                                                          \
+    } while (0)
+
+static int test_small_body_in_memory()
+{
+    request_body_t body;
+    request_body_init(&body);
+    request_body_append(&body, "hello ", 6);
+    request_body_append(&body, "world", 5);
+
+    async_result_t r = poll_request_body_spool(&body, -1, true);
+    test_assert(r.result == POLL_READY && r.value == 0, "expected nothing to spool");
+    test_assert(!body.spooling && body.spool_fd == -1 && body.len == 11 && body.chain.len == 11
+            && memcmp(body.chain.head->data, "hello world", 11) == 0,
+        "expected a small body to stay in memory");
+
+    request_body_release(&body);
+    test_assert(body.chain.head == NULL && body.len == 0, "expected the body to be released");
+    return 0;
+}
+
+static int test_large_body_spooled()
+{
+    // There are no worker threads in the tests, so the writes run right away
+    body_configure(1000, BODY_MAX_SIZE, "/tmp");
+
+    request_body_t body;
+    request_body_init(&body);
+    char piece[777];
+    size_t total = 0;
+    size_t most_held = 0;
+    for (int i = 0; i < 100; i++) {
+        memset(piece, 'a' + i % 26, sizeof(piece));
+        request_body_append(&body, piece, sizeof(piece));
+        total += sizeof(piece);
+
+        async_result_t r = poll_request_body_spool(&body, -1, i == 99);
+        test_assert(r.result == POLL_READY && r.value == 0, "expected the spool write to succeed");
+        most_held = body.chain.len > most_held ? body.chain.len : most_held;
+    }
+
+    test_assert(body.spooling && body.spool_fd >= 0 && body.len == total && body.chain.len == 0,
+        "expected the whole body to be in the temp file");
+    test_assert(most_held < BUFFER_SEGMENT_CAP + sizeof(piece),
+        "expected no more than a segment's worth to be held in memory");
+
+    for (int i = 0; i < 100; i++) {
+        char read_back[sizeof(piece)];
+        test_assert(pread(body.spool_fd, read_back, sizeof(read_back), i * sizeof(piece))
+                == sizeof(read_back),
+            "failed to read the temp file");
+        memset(piece, 'a' + i % 26, sizeof(piece));
+        test_assert(memcmp(read_back, piece, sizeof(piece)) == 0, "expected the body in order");
+    }
+
+    request_body_release(&body);
+    test_assert(body.spool_fd == -1, "expected the temp file to be closed");
+    body_configure(BODY_SPOOL_THRESHOLD, BODY_MAX_SIZE, "/tmp");
+    return 0;
+}
+
+int body_test_suite()
+{
+    int r = 0;
+    if (test_small_body_in_memory() < 0) {
+        r = -1;
+        printf("\t❌ test_small_body_in_memory\n");
+    } else {
+        printf("\t✅ test_small_body_in_memory\n");
+    }
+    if (test_large_body_spooled() < 0) {
+        r = -1;
+        printf("\t❌ test_large_body_spooled\n");
+    } else {
+        printf("\t✅ test_large_body_spooled\n");
+    }
+    return r;
+}
@@ -0,0 +1,81 @@
+/**
+ * Where request bodies go as they arrive.
+ *
+ * The handler hands the body over a piece at a time, as it is read (and decoded, for a chunked
+ * body), and the read buffer is reused for the next piece, so the body never piles up there. A
+ * small body is kept in memory, in pooled segments. Once a body grows past the spool threshold it
+ * moves to a temp file instead, and every segment's worth after that is written out on the worker
+ * pool. The connection doesn't read any more of the body until the write has finished, which holds
+ * back a client that sends faster than we can write: its data waits in the socket buffers, and TCP
+ * flow control does the rest. However large the body, the connection holds on to no more than the
+ * threshold plus a couple of segments.
+ */
+
+#pragma once
+
+#include "buffer.h"
+#include "common.h"
+#include "workers.h"
+
+// Bodies up to this size are kept in memory by default
+#define BODY_SPOOL_THRESHOLD (64 * 1024)
+// Requests with a larger body are turned away by default
+#define BODY_MAX_SIZE (1024L * 1024 * 1024)
+
+// Writes the segments of a body to its temp file on the worker pool
+typedef struct body_spool_job_t {
+    work_item_t work;
+    // The temp file, which the job creates if it is -1
+    int fd;
+    buffer_chain_t chain;
+    // Set by the job if the file couldn't be created or written
+    bool failed;
+} body_spool_job_t;
+
+typedef struct request_body_t {
+    // The body, while it is kept in memory. Once it is spooled, the part that hasn't been written
+    // to the temp file yet.
+    buffer_chain_t chain;
+    // Length of the whole body so far
+    size_t len;
+    // The temp file the body is spooled to, -1 while it is kept in memory
+    int spool_fd;
+    // Whether the body is spooled, and whether a write is in flight
+    bool spooling;
+    bool writing;
+    body_spool_job_t job;
+} request_body_t;
+
+/**
+ * Sets the size above which bodies are spooled, the size above which requests are turned away, and
+ * the directory the temp files are created in. Must be called before any event loop starts.
+ */
+void body_configure(size_t spool_threshold, size_t max_size, const char* spool_dir);
+
+/**
+ * The largest body a request can have, see `body_configure`
+ */
+size_t body_max_size();
+
+void request_body_init(request_body_t* body);
+
+/**
+ * Adds the next `len` bytes of the body.
+ */
+void request_body_append(request_body_t* body, const char* data, size_t len);
+
+/**
+ * Moves the body on to its temp file where it is large enough to, on behalf of connection `fd`.
+ * Returns POLL_PENDING while a write is in flight, after which the event loop polls the connection
+ * again, and -1 if the body couldn't be spooled. `finished` says that the body is complete, which
+ * writes whatever is left of a spooled body.
+ */
+async_result_t poll_request_body_spool(request_body_t* body, int fd, bool finished);
+
+/**
+ * Returns the segments of the body to the pool and closes its temp file. The write must not be in
+ * flight.
+ */
+void request_body_release(request_body_t* body);
+
+int body_test_suite();
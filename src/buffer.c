@@ -0,0 +1,268 @@
+#include "buffer.h"
+
+// The most segments a thread keeps on its free list (4MB worth of them)
+#define MAX_FREE_SEGMENTS 256
+
+// Segments given back by connections, waiting to be reused by any connection on the same thread
+static _Thread_local buffer_segment_t* free_segments = NULL;
+static _Thread_local buffer_stats_t stats = { 0 };
+
+buffer_segment_t* buffer_segment_get()
+{
+    buffer_segment_t* segment = free_segments;
+    if (segment) {
+        free_segments = segment->next;
+        stats.free_segments--;
+    } else {
+        segment = malloc(BUFFER_SEGMENT_SIZE);
+        stats.allocated++;
+    }
+
+    segment->next = NULL;
+    segment->len = 0;
+
+    stats.in_use++;
+    if (stats.in_use > stats.max_in_use) {
+        stats.max_in_use = stats.in_use;
+    }
+    return segment;
+}
+
+void buffer_segment_put(buffer_segment_t* segment)
+{
+    stats.in_use--;
+    if (stats.free_segments >= MAX_FREE_SEGMENTS) {
+        free(segment);
+        return;
+    }
+
+    segment->next = free_segments;
+    free_segments = segment;
+    stats.free_segments++;
+}
+
+buffer_segment_t* buffer_chain_extend(buffer_chain_t* chain)
+{
+    buffer_segment_t* segment = buffer_segment_get();
+    if (chain->tail) {
+        chain->tail->next = segment;
+    } else {
+        chain->head = segment;
+    }
+    chain->tail = segment;
+    return segment;
+}
+
+void buffer_chain_append(buffer_chain_t* chain, const char* data, size_t len)
+{
+    while (len > 0) {
+        buffer_segment_t* segment = chain->tail;
+        if (!segment || segment->len == BUFFER_SEGMENT_CAP) {
+            segment = buffer_chain_extend(chain);
+        }
+
+        size_t n = BUFFER_SEGMENT_CAP - segment->len;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(segment->data + segment->len, data, n);
+        segment->len += n;
+        chain->len += n;
+        data += n;
+        len -= n;
+    }
+}
+
+buffer_segment_t* buffer_chain_pop(buffer_chain_t* chain)
+{
+    buffer_segment_t* segment = chain->head;
+    if (!segment) {
+        return NULL;
+    }
+
+    chain->head = segment->next;
+    if (!chain->head) {
+        chain->tail = NULL;
+    }
+    chain->len -= segment->len;
+    segment->next = NULL;
+    return segment;
+}
+
+void buffer_chain_consume(buffer_chain_t* chain, size_t len)
+{
+    while (chain->head && len >= chain->head->len) {
+        len -= chain->head->len;
+        buffer_segment_put(buffer_chain_pop(chain));
+    }
+    if (!chain->head || len == 0) {
+        return;
+    }
+
+    buffer_segment_t* head = chain->head;
+    if (head == chain->tail) {
+        memmove(head->data, head->data + len, head->len - len);
+        head->len -= len;
+        chain->len -= len;
+        return;
+    }
+
+    // The rest spans several segments, which have to be packed into new ones so that every one
+    // but the last is full again
+    buffer_chain_t rest = { 0 };
+    size_t offset = len;
+    for (buffer_segment_t* segment = head; segment; segment = segment->next) {
+        buffer_chain_append(&rest, segment->data + offset, segment->len - offset);
+        offset = 0;
+    }
+    buffer_chain_release(chain);
+    *chain = rest;
+}
+
+void buffer_chain_release(buffer_chain_t* chain)
+{
+    buffer_segment_t* segment = chain->head;
+    while (segment) {
+        buffer_segment_t* next = segment->next;
+        buffer_segment_put(segment);
+        segment = next;
+    }
+
+    chain->head = NULL;
+    chain->tail = NULL;
+    chain->len = 0;
+}
+
+buffer_stats_t buffer_get_stats() { return stats; }
+
+/**
+ ***************************************************************************************************
+ * Tests
+ ***************************************************************************************************
+ */
+#define test_assert(cond, msg)                                                                     \
+    do {                                                                                           \
+        if (!(cond)) {                                                                             \
+            printf("Assertion failed: %s\n", msg);                                                 \
+            return -1;                                                                             \
+        }                                                                                          \
+    } while (0)
+
+static int test_segment_reuse()
+{
+    buffer_segment_t* first = buffer_segment_get();
+    first->len = 100;
+    buffer_segment_put(first);
+
+    buffer_stats_t before = buffer_get_stats();
+    buffer_segment_t* second = buffer_segment_get();
+    test_assert(second == first, "expected the segment to come from the free list");
+    test_assert(second->len == 0 && second->next == NULL, "expected a reused segment to be empty");
+    test_assert(buffer_get_stats().allocated == before.allocated, "expected no new allocation");
+    test_assert(buffer_get_stats().in_use == before.in_use + 1, "expected the segment in use");
+
+    buffer_segment_put(second);
+    return 0;
+}
+
+static int test_chain_append()
+{
+    // Append in odd-sized pieces, so that most of them straddle two segments
+    size_t total = BUFFER_SEGMENT_CAP * 2 + 1000;
+    char piece[777];
+    buffer_chain_t chain = { 0 };
+    for (size_t written = 0; written < total;) {
+        size_t n = total - written < sizeof(piece) ? total - written : sizeof(piece);
+        for (size_t i = 0; i < n; i++) {
+            piece[i] = (char)((written + i) % 251);
+        }
+        buffer_segment_t* head = chain.head;
+        buffer_chain_append(&chain, piece, n);
+        test_assert(!head || chain.head == head, "appending should never move data");
+        written += n;
+    }
+
+    test_assert(chain.len == total, "expected the chain to hold everything appended");
+    size_t offset = 0;
+    size_t segments = 0;
+    for (buffer_segment_t* segment = chain.head; segment; segment = segment->next) {
+        test_assert(segment->next == NULL || segment->len == BUFFER_SEGMENT_CAP,
+            "expected every segment but the last to be full");
+        for (size_t i = 0; i < segment->len; i++) {
+            test_assert(segment->data[i] == (char)((offset + i) % 251), "data got mangled");
+        }
+        offset += segment->len;
+        segments++;
+    }
+    test_assert(segments == 3 && chain.tail->len == 1000, "expected three segments");
+
+    size_t in_use = buffer_get_stats().in_use;
+    buffer_chain_release(&chain);
+    test_assert(chain.head == NULL && chain.tail == NULL && chain.len == 0,
+        "expected the chain to be empty after release");
+    test_assert(buffer_get_stats().in_use == in_use - 3, "expected the segments back in the pool");
+
+    return 0;
+}
+
+static int test_chain_consume()
+{
+    char data[BUFFER_SEGMENT_CAP + 100];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (char)(i % 251);
+    }
+
+    // Within the one segment, the rest moves to its front
+    buffer_chain_t chain = { 0 };
+    buffer_chain_append(&chain, data, 1000);
+    buffer_segment_t* head = chain.head;
+    buffer_chain_consume(&chain, 400);
+    test_assert(chain.head == head && chain.len == 600 && head->len == 600
+            && memcmp(head->data, data + 400, 600) == 0,
+        "expected the rest to move to the front of the segment");
+
+    // Everything
+    buffer_chain_consume(&chain, 600);
+    test_assert(chain.head == NULL && chain.tail == NULL && chain.len == 0,
+        "expected consuming everything to leave the chain empty");
+
+    // Across segments, the rest is packed into one
+    size_t in_use = buffer_get_stats().in_use;
+    buffer_chain_append(&chain, data, sizeof(data));
+    buffer_chain_consume(&chain, BUFFER_SEGMENT_CAP - 50);
+    test_assert(chain.head == chain.tail && chain.len == 150
+            && memcmp(chain.head->data, data + BUFFER_SEGMENT_CAP - 50, 150) == 0,
+        "expected the rest to be packed into a single segment");
+    test_assert(buffer_get_stats().in_use == in_use + 1, "expected the other segments back");
+
+    buffer_segment_t* popped = buffer_chain_pop(&chain);
+    test_assert(popped && popped->len == 150 && chain.head == NULL && chain.len == 0,
+        "expected pop to take the only segment");
+    buffer_segment_put(popped);
+    test_assert(buffer_chain_pop(&chain) == NULL, "expected nothing to pop from an empty chain");
+    return 0;
+}
+
+int buffer_test_suite()
+{
+    int r = 0;
+    if (test_segment_reuse() < 0) {
+        r = -1;
+        printf("\t❌ test_segment_reuse\n");
+    } else {
+        printf("\t✅ test_segment_reuse\n");
+    }
+    if (test_chain_append() < 0) {
+        r = -1;
+        printf("\t❌ test_chain_append\n");
+    } else {
+        printf("\t✅ test_chain_append\n");
+    }
+    if (test_chain_consume() < 0) {
+        r = -1;
+        printf("\t❌ test_chain_consume\n");
+    } else {
+        printf("\t✅ test_chain_consume\n");
+    }
+    return r;
+}
@@ -0,0 +1,92 @@
+/**
+ * Pool of fixed-size I/O buffers.
+ *
+ * Everything we read from and write to clients goes through segments of BUFFER_SEGMENT_SIZE
+ * bytes. Data that doesn't fit into one segment continues in the next one of a chain, so a buffer
+ * never has to be grown, and bytes never move once they have been written into a segment until
+ * they are consumed (which keeps string views into them valid).
+ *
+ * Connections hand their segments back as soon as they are done with them. Each thread keeps the
+ * segments it got back on a free list for the next connection that needs one, so segments rarely
+ * come from malloc, and an idle connection costs no buffer memory at all.
+ */
+
+#pragma once
+
+#include "common.h"
+
+// Size of a segment, including its header
+#define BUFFER_SEGMENT_SIZE (16 * 1024)
+
+typedef struct buffer_segment_t {
+    // The next segment of the chain
+    struct buffer_segment_t* next;
+    // How many bytes of `data` are in use
+    size_t len;
+    char data[];
+} buffer_segment_t;
+
+// How many bytes of data a segment holds
+#define BUFFER_SEGMENT_CAP (BUFFER_SEGMENT_SIZE - sizeof(buffer_segment_t))
+
+typedef struct buffer_chain_t {
+    buffer_segment_t* head;
+    // The segment that new data is appended to
+    buffer_segment_t* tail;
+    // Total number of bytes in use over all segments
+    size_t len;
+} buffer_chain_t;
+
+// Usage of the segments on the calling thread
+typedef struct buffer_stats_t {
+    // Segments currently held by connections
+    size_t in_use;
+    // The most segments held by connections at once
+    size_t max_in_use;
+    // Segments currently waiting on the free list
+    size_t free_segments;
+    // Number of segments that had to come from malloc
+    size_t allocated;
+} buffer_stats_t;
+
+/**
+ * Returns an empty segment, from the calling thread's free list if it has one.
+ */
+buffer_segment_t* buffer_segment_get();
+
+/**
+ * Returns the segment to the calling thread's free list, or frees it if the list is full.
+ */
+void buffer_segment_put(buffer_segment_t* segment);
+
+/**
+ * Adds an empty segment to the end of the chain and returns it.
+ */
+buffer_segment_t* buffer_chain_extend(buffer_chain_t* chain);
+
+/**
+ * Copies `len` bytes to the end of the chain, filling up the last segment before adding new ones.
+ */
+void buffer_chain_append(buffer_chain_t* chain, const char* data, size_t len);
+
+/**
+ * Drops the first `len` bytes of the chain, returning the segments they filled to the pool. What is
+ * left moves to the front of the first segment, so that it can keep filling up. Drops everything if
+ * the chain holds fewer than `len` bytes.
+ */
+void buffer_chain_consume(buffer_chain_t* chain, size_t len);
+
+/**
+ * Takes the first segment off the chain and returns it, or NULL if the chain is empty.
+ */
+buffer_segment_t* buffer_chain_pop(buffer_chain_t* chain);
+
+/**
+ * Returns every segment of the chain to the pool, leaving it empty.
+ */
+void buffer_chain_release(buffer_chain_t* chain);
+
+// Returns the segment usage on the calling thread
+buffer_stats_t buffer_get_stats();
+
+int buffer_test_suite();
@@ -0,0 +1,306 @@
+#include "chunked.h"
+
+void chunked_init(chunked_decoder_t* self)
+{
+    *self = (chunked_decoder_t) { .state = CHUNKED_SIZE };
+}
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+chunked_result_t chunked_decode(
+    chunked_decoder_t* self, const char** p, const char* end, const char** data, size_t* len)
+{
+    *data = NULL;
+    *len = 0;
+
+    const char* cursor = *p;
+    chunked_result_t result = CHUNKED_MORE;
+    while (cursor < end && result == CHUNKED_MORE) {
+        char c = *cursor;
+
+        // The framing lines may only get so long, since a client could otherwise keep us busy
+        // with a single one forever
+        if (self->state != CHUNKED_DATA && ++self->line_len > CHUNKED_MAX_LINE) {
+            result = CHUNKED_ERROR;
+            break;
+        }
+
+        switch (self->state) {
+        case CHUNKED_SIZE: {
+            int digit = hex_value(c);
+            if (digit >= 0) {
+                if (self->remaining > (UINT64_MAX >> 4)) {
+                    result = CHUNKED_ERROR;
+                    break;
+                }
+                self->remaining = self->remaining << 4 | digit;
+                self->digits++;
+            } else if (self->digits == 0) {
+                result = CHUNKED_ERROR;
+            } else if (c == ';' || c == ' ' || c == '\t') {
+                self->state = CHUNKED_EXTENSION;
+            } else if (c == '\r') {
+                self->state = CHUNKED_SIZE_LF;
+            } else {
+                result = CHUNKED_ERROR;
+            }
+            cursor++;
+            break;
+        }
+        case CHUNKED_EXTENSION: {
+            if (c == '\r') {
+                self->state = CHUNKED_SIZE_LF;
+            } else if (c == '\n') {
+                result = CHUNKED_ERROR;
+            }
+            cursor++;
+            break;
+        }
+        case CHUNKED_SIZE_LF: {
+            if (c != '\n') {
+                result = CHUNKED_ERROR;
+                break;
+            }
+            // The last chunk has no data, and it is followed by the trailers
+            self->state = self->remaining ? CHUNKED_DATA : CHUNKED_TRAILER;
+            self->line_len = 0;
+            cursor++;
+            break;
+        }
+        case CHUNKED_DATA: {
+            // Hand out as much of the chunk as we have in one slice
+            size_t n = end - cursor;
+            if (n > self->remaining) {
+                n = self->remaining;
+            }
+            *data = cursor;
+            *len = n;
+            cursor += n;
+            self->remaining -= n;
+            if (self->remaining == 0) {
+                self->state = CHUNKED_DATA_CR;
+            }
+            *p = cursor;
+            return CHUNKED_MORE;
+        }
+        case CHUNKED_DATA_CR: {
+            if (c != '\r') {
+                result = CHUNKED_ERROR;
+                break;
+            }
+            self->state = CHUNKED_DATA_LF;
+            cursor++;
+            break;
+        }
+        case CHUNKED_DATA_LF: {
+            if (c != '\n') {
+                result = CHUNKED_ERROR;
+                break;
+            }
+            self->state = CHUNKED_SIZE;
+            self->digits = 0;
+            self->line_len = 0;
+            cursor++;
+            break;
+        }
+        case CHUNKED_TRAILER:
+        case CHUNKED_TRAILER_LINE: {
+            if (++self->trailers_len > CHUNKED_MAX_TRAILERS || c == '\n') {
+                result = CHUNKED_ERROR;
+                break;
+            }
+            // A CR right at the start of a line is the empty one that ends the body
+            if (c == '\r') {
+                self->state = self->state == CHUNKED_TRAILER ? CHUNKED_END_LF : CHUNKED_TRAILER_LF;
+            } else {
+                self->state = CHUNKED_TRAILER_LINE;
+            }
+            cursor++;
+            break;
+        }
+        case CHUNKED_TRAILER_LF: {
+            if (c != '\n') {
+                result = CHUNKED_ERROR;
+                break;
+            }
+            self->state = CHUNKED_TRAILER;
+            self->line_len = 0;
+            cursor++;
+            break;
+        }
+        case CHUNKED_END_LF: {
+            if (c != '\n') {
+                result = CHUNKED_ERROR;
+                break;
+            }
+            self->state = CHUNKED_FINISHED;
+            result = CHUNKED_DONE;
+            cursor++;
+            break;
+        }
+        case CHUNKED_FINISHED: {
+            result = CHUNKED_DONE;
+            break;
+        }
+        }
+    }
+
+    *p = cursor;
+    if (self->state == CHUNKED_FINISHED) {
+        return CHUNKED_DONE;
+    }
+    return result;
+}
+
+/**
+ ***************************************************************************************************
+ * Tests
+ ***************************************************************************************************
+ */
+#define test_assert(cond, msg)                                                                     \
+    do {                                                                                           \
+        if (!(cond)) {                                                                             \
+            printf("Assertion failed: %s\n", msg);                                                 \
+            return -1;                                                                             \
+        }                                                                                          \
+    } while (0)
+
+// Decodes `body` fed in pieces of `piece` bytes into `out`. Returns the result of the last call,
+// and sets `used` to how much of the body the decoder took.
+static chunked_result_t decode_in_pieces(
+    const char* body, size_t piece, char* out, size_t* out_len, size_t* used)
+{
+    chunked_decoder_t decoder;
+    chunked_init(&decoder);
+    *out_len = 0;
+
+    size_t body_len = strlen(body);
+    const char* p = body;
+    chunked_result_t result = CHUNKED_MORE;
+    while (result == CHUNKED_MORE && p < body + body_len) {
+        const char* end = p + piece < body + body_len ? p + piece : body + body_len;
+        while (result == CHUNKED_MORE && p < end) {
+            const char* data;
+            size_t len;
+            result = chunked_decode(&decoder, &p, end, &data, &len);
+            if (len > 0) {
+                memcpy(out + *out_len, data, len);
+                *out_len += len;
+            }
+        }
+    }
+    *used = p - body;
+    return result;
+}
+
+static int test_decodes_in_any_pieces()
+{
+    const char* body = "4\r\nWiki\r\n"
+                       "5;name=value;other\r\npedia\r\n"
+                       "E\r\n in\r\n\r\nchunks.\r\n"
+                       "0\r\n"
+                       "Expires: never\r\n"
+                       "\r\n"
+                       "GET /next";
+    const char* expected = "Wikipedia in\r\n\r\nchunks.";
+    size_t body_len = strlen(body) - strlen("GET /next");
+
+    // Every piece size, down to a byte at a time, which splits the body everywhere
+    for (size_t piece = 1; piece <= strlen(body); piece++) {
+        char out[64];
+        size_t out_len;
+        size_t used;
+        chunked_result_t result = decode_in_pieces(body, piece, out, &out_len, &used);
+        if (result != CHUNKED_DONE || out_len != strlen(expected)
+            || memcmp(out, expected, out_len) != 0 || used != body_len) {
+            printf("pieces of %zu bytes\n", piece);
+            test_assert(false, "expected the body to decode the same whatever the pieces");
+        }
+    }
+    return 0;
+}
+
+static int test_rejects_malformed()
+{
+    const char* bodies[] = {
+        // no size
+        "\r\nabc\r\n0\r\n\r\n",
+        // not hex
+        "g\r\nabc\r\n0\r\n\r\n",
+        // more data than the size says
+        "2\r\nabc\r\n0\r\n\r\n",
+        // bare LFs
+        "3\nabc\n0\n\n",
+        // too large for 64 bits
+        "10000000000000000\r\n",
+        // a trailer line that ends in a bare LF
+        "0\r\nExpires: never\n\r\n",
+    };
+    char out[64];
+    size_t out_len;
+    size_t used;
+    for (size_t i = 0; i < sizeof(bodies) / sizeof(bodies[0]); i++) {
+        if (decode_in_pieces(bodies[i], 7, out, &out_len, &used) != CHUNKED_ERROR) {
+            printf("body %zu\n", i);
+            test_assert(false, "expected a malformed body to be rejected");
+        }
+    }
+
+    // A size line that never ends
+    char line[CHUNKED_MAX_LINE + 16];
+    memset(line, 'x', sizeof(line) - 1);
+    memcpy(line, "1;", 2);
+    line[sizeof(line) - 1] = '\0';
+    test_assert(decode_in_pieces(line, 100, out, &out_len, &used) == CHUNKED_ERROR,
+        "expected a size line over the limit to be rejected");
+    return 0;
+}
+
+static int test_incomplete_body()
+{
+    char out[16];
+    size_t out_len;
+    size_t used;
+    test_assert(decode_in_pieces("5\r\nhel", 100, out, &out_len, &used) == CHUNKED_MORE
+            && out_len == 3 && used == 6,
+        "expected the data so far, and to wait for the rest");
+    test_assert(decode_in_pieces("0\r\n\r", 100, out, &out_len, &used) == CHUNKED_MORE,
+        "expected to wait for the end of the trailers");
+    return 0;
+}
+
+int chunked_test_suite()
+{
+    int r = 0;
+    if (test_decodes_in_any_pieces() < 0) {
+        r = -1;
+        printf("\t❌ test_decodes_in_any_pieces\n");
+    } else {
+        printf("\t✅ test_decodes_in_any_pieces\n");
+    }
+    if (test_rejects_malformed() < 0) {
+        r = -1;
+        printf("\t❌ test_rejects_malformed\n");
+    } else {
+        printf("\t✅ test_rejects_malformed\n");
+    }
+    if (test_incomplete_body() < 0) {
+        r = -1;
+        printf("\t❌ test_incomplete_body\n");
+    } else {
+        printf("\t✅ test_incomplete_body\n");
+    }
+    return r;
+}
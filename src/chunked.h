@@ -0,0 +1,71 @@
+/**
+ * Incremental decoder for `Transfer-Encoding: chunked` request bodies.
+ *
+ * The decoder is a byte-at-a-time state machine, so a body can arrive in pieces of any size, split
+ * anywhere, and nothing has to be kept around between them: the data of each chunk is handed out
+ * as slices of the caller's buffer, and the framing around it (sizes, extensions, trailers) is
+ * skipped as it goes by. Decoding a body of any size takes the few bytes of the decoder itself.
+ */
+
+#pragma once
+
+#include "common.h"
+
+// The longest chunk size line (with its extensions) and trailer line we accept
+#define CHUNKED_MAX_LINE 4096
+// The most trailer bytes we accept, over all the trailer lines
+#define CHUNKED_MAX_TRAILERS 8192
+
+typedef enum chunked_state_t {
+    // The hex digits of the chunk size
+    CHUNKED_SIZE,
+    // Extensions after the chunk size, which we ignore
+    CHUNKED_EXTENSION,
+    CHUNKED_SIZE_LF,
+    CHUNKED_DATA,
+    // The CRLF after the chunk data
+    CHUNKED_DATA_CR,
+    CHUNKED_DATA_LF,
+    // The start of a trailer line, or of the empty line that ends the body
+    CHUNKED_TRAILER,
+    // A trailer line, which we ignore
+    CHUNKED_TRAILER_LINE,
+    CHUNKED_TRAILER_LF,
+    CHUNKED_END_LF,
+    CHUNKED_FINISHED,
+} chunked_state_t;
+
+typedef struct chunked_decoder_t {
+    chunked_state_t state;
+    // The chunk size as far as we've read it, then how much of the chunk data is left
+    uint64_t remaining;
+    // Digits of the chunk size so far, and bytes of the current line and of all the trailers
+    size_t digits;
+    size_t line_len;
+    size_t trailers_len;
+} chunked_decoder_t;
+
+typedef enum chunked_result_t {
+    // The body goes on past the end of the input
+    CHUNKED_MORE,
+    // The body is complete
+    CHUNKED_DONE,
+    // The body is malformed, or goes past one of our limits
+    CHUNKED_ERROR,
+} chunked_result_t;
+
+/**
+ * Gets the decoder ready for a new body.
+ */
+void chunked_init(chunked_decoder_t* self);
+
+/**
+ * Decodes the input in [*p, end) up to the next chunk data, and sets `data` and `len` to the data,
+ * as much of it as the input holds (`len` is 0 when there is none). Advances `*p` past everything
+ * it has decoded, so that calling it again carries on from there. Once the body is done, `*p`
+ * points at the byte right after it.
+ */
+chunked_result_t chunked_decode(
+    chunked_decoder_t* self, const char** p, const char* end, const char** data, size_t* len);
+
+int chunked_test_suite();
@@ -0,0 +1,154 @@
+#include "clock.h"
+#include "common.h"
+#include <pthread.h>
+
+typedef struct server_clock_t {
+    // Whether the clock only moves on `clock_update`
+    bool cached;
+    uint64_t monotonic_ms;
+    // The second the strings were formatted for
+    time_t second;
+    char http_date[CLOCK_HTTP_DATE_LEN + 1];
+    char log_time[CLOCK_LOG_TIME_LEN + 1];
+} server_clock_t;
+
+static _Thread_local server_clock_t thread_clock = { .second = -1 };
+
+static void format_time(server_clock_t* clock, time_t second)
+{
+    // Nothing calls setlocale, so the day and month names are the English ones the header needs
+    struct tm tm;
+    gmtime_r(&second, &tm);
+    strftime(clock->http_date, sizeof(clock->http_date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    localtime_r(&second, &tm);
+    strftime(clock->log_time, sizeof(clock->log_time), "%Y-%m-%d %H:%M:%S", &tm);
+    clock->second = second;
+}
+
+static void read_clocks(server_clock_t* clock)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    clock->monotonic_ms = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+    time_t second = time(NULL);
+    if (second != clock->second) {
+        format_time(clock, second);
+    }
+}
+
+// The calling thread's clock, read just now unless it is a cached one
+static server_clock_t* current()
+{
+    if (!thread_clock.cached) {
+        read_clocks(&thread_clock);
+    }
+    return &thread_clock;
+}
+
+void clock_update()
+{
+    thread_clock.cached = true;
+    read_clocks(&thread_clock);
+}
+
+uint64_t clock_monotonic_ms() { return current()->monotonic_ms; }
+
+const char* clock_http_date() { return current()->http_date; }
+
+const char* clock_log_time() { return current()->log_time; }
+
+void clock_set(time_t now, uint64_t monotonic_ms)
+{
+    thread_clock.cached = true;
+    thread_clock.monotonic_ms = monotonic_ms;
+    format_time(&thread_clock, now);
+}
+
+/**
+ ***************************************************************************************************
+ * Tests
+ ***************************************************************************************************
+ */
+#define test_assert(cond, msg)                                                                     \
+    do {                                                                                           \
+        if (!(cond)) {                                                                             \
+            printf("Assertion failed: %s\n", msg);                                                 \
+            return -1;                                                                             \
+        }                                                                                          \
+    } while (0)
+
+static int test_http_date()
+{
+    // The example from RFC 7231
+    clock_set(784111777, 42);
+    test_assert(strcmp(clock_http_date(), "Sun, 06 Nov 1994 08:49:37 GMT") == 0,
+        "expected the date in IMF-fixdate format");
+    test_assert(strlen(clock_http_date()) == CLOCK_HTTP_DATE_LEN, "expected a fixed length date");
+    test_assert(strlen(clock_log_time()) == CLOCK_LOG_TIME_LEN, "expected a fixed length time");
+    test_assert(clock_monotonic_ms() == 42, "expected the monotonic time it was set to");
+
+    clock_set(951782400, 0);
+    test_assert(strcmp(clock_http_date(), "Tue, 29 Feb 2000 00:00:00 GMT") == 0,
+        "expected a leap day");
+    return 0;
+}
+
+static int test_cached_until_update()
+{
+    clock_update();
+    uint64_t before = clock_monotonic_ms();
+    const char* date = clock_http_date();
+    usleep(20 * 1000);
+    test_assert(clock_monotonic_ms() == before && clock_http_date() == date,
+        "expected the clock to stand still between updates");
+
+    clock_update();
+    test_assert(clock_monotonic_ms() >= before + 20, "expected the clock to move on");
+    return 0;
+}
+
+static void* read_uncached(void* arg)
+{
+    uint64_t* elapsed = arg;
+    uint64_t before = clock_monotonic_ms();
+    usleep(20 * 1000);
+    *elapsed = clock_monotonic_ms() - before;
+    return NULL;
+}
+
+static int test_uncached_thread()
+{
+    // A thread that never updates its clock reads the time on every call
+    uint64_t elapsed = 0;
+    pthread_t thread;
+    test_assert(pthread_create(&thread, NULL, read_uncached, &elapsed) == 0
+            && pthread_join(thread, NULL) == 0,
+        "failed to run the thread");
+    test_assert(elapsed >= 20, "expected the clock of a thread without a loop to keep up");
+    return 0;
+}
+
+int clock_test_suite()
+{
+    int r = 0;
+    if (test_http_date() < 0) {
+        r = -1;
+        printf("\t❌ test_http_date\n");
+    } else {
+        printf("\t✅ test_http_date\n");
+    }
+    if (test_cached_until_update() < 0) {
+        r = -1;
+        printf("\t❌ test_cached_until_update\n");
+    } else {
+        printf("\t✅ test_cached_until_update\n");
+    }
+    if (test_uncached_thread() < 0) {
+        r = -1;
+        printf("\t❌ test_uncached_thread\n");
+    } else {
+        printf("\t✅ test_uncached_thread\n");
+    }
+    return r;
+}
@@ -0,0 +1,48 @@
+/**
+ * The time, as the server sees it.
+ *
+ * Reading the clocks and formatting the time is too much work to do for every response, log line
+ * and deadline. An event loop reads the clocks once per iteration instead, right after it wakes up,
+ * and everything it does until it waits again sees that time. The formatted strings (the `Date`
+ * header and the log timestamp) are only redone when the second has changed. Each thread has a
+ * clock of its own, so nothing is shared between loops. A thread that doesn't run a loop, like a
+ * worker, reads the clocks on every call instead.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+// Length of an HTTP date, like "Sun, 06 Nov 1994 08:49:37 GMT"
+#define CLOCK_HTTP_DATE_LEN 29
+// Length of a log timestamp, like "1994-11-06 09:49:37"
+#define CLOCK_LOG_TIME_LEN 19
+
+/**
+ * Reads the clocks. Once a thread has called it, its clock only moves on when it calls it again.
+ */
+void clock_update();
+
+/**
+ * Milliseconds on the monotonic clock.
+ */
+uint64_t clock_monotonic_ms();
+
+/**
+ * The time in the format of the `Date` header (RFC 7231's IMF-fixdate), always in GMT.
+ */
+const char* clock_http_date();
+
+/**
+ * The local time, for log lines.
+ */
+const char* clock_log_time();
+
+/**
+ * Sets the calling thread's clock to `now` and `monotonic_ms`, where it stays until the next
+ * `clock_update`. For the tests.
+ */
+void clock_set(time_t now, uint64_t monotonic_ms);
+
+int clock_test_suite();
@@ -4,7 +4,9 @@
 
 #pragma once
 
+#include "clock.h"
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -19,10 +21,8 @@
 #define println(fmt, ...)                                                                          \
     do {                                                                                           \
         if (DEBUG_LOG) {                                                                           \
-            time_t now = time(NULL);                                                               \
-            char time_buf[20];                                                                     \
-            strftime(time_buf, sizeof(time_buf), "%Y-%m-%d %H:%M:%S", localtime(&now));            \
-            fprintf(stderr, "%s: %s:%d: " fmt "\n", time_buf, __FILE__, __LINE__, ##__VA_ARGS__);  \
+            fprintf(stderr, "%s: %s:%d: " fmt "\n", clock_log_time(), __FILE__, __LINE__,          \
+                ##__VA_ARGS__);                                                                    \
         }                                                                                          \
     } while (0)
 
@@ -32,6 +32,19 @@
         exit(1);                                                                                   \
     } while (0)
 
+// A string view represents a pointer into the read buffer owned by the HTTP request handler. During
+// parsing, we simply identify the starting index and length of the string we're interested in, and
+// then we can use this view to access the string without copying it.
+typedef struct string_view_t {
+    char* data;
+    size_t len;
+} string_view_t;
+
+static inline bool string_view_equals(string_view_t a, string_view_t b)
+{
+    return a.len == b.len && strncmp(a.data, b.data, a.len) == 0;
+}
+
 // Async helpers:
 typedef enum {
     POLL_PENDING,
@@ -4,78 +4,79 @@
 conn_map_t* conn_map_new(size_t capacity)
 {
     conn_map_t* self = malloc(sizeof(conn_map_t));
-    self->cap = capacity;
-    self->buckets = malloc(sizeof(conn_map_entry_t*) * capacity);
-    for (size_t i = 0; i < capacity; i++) {
-        self->buckets[i] = NULL;
-    }
+    self->cap = capacity > 0 ? capacity : 1;
+    self->slots = calloc(self->cap, sizeof(conn_slot_t));
+    self->count = 0;
     return self;
 }
 
-void conn_map_insert(conn_map_t* self, int fd, handler_future_t* future)
+static conn_slot_t* get_slot(conn_map_t* self, int fd)
 {
-    size_t index = fd % self->cap;
-    conn_map_entry_t* prev = NULL;
-    conn_map_entry_t* existing = self->buckets[index];
-
-    // If there is already an entry in the bucket, update the future
-    while (existing != NULL) {
-        if (existing->fd == fd) {
-            free_handler_future(existing->future);
-            existing->future = future;
-            return;
+    if ((size_t)fd >= self->cap) {
+        size_t new_cap = self->cap;
+        while (new_cap <= (size_t)fd) {
+            new_cap *= 2;
         }
-        prev = existing;
-        existing = existing->next;
+
+        self->slots = realloc(self->slots, new_cap * sizeof(conn_slot_t));
+        memset(self->slots + self->cap, 0, (new_cap - self->cap) * sizeof(conn_slot_t));
+        self->cap = new_cap;
     }
 
-    // at this point, either prev will point to the last entry in the bucket that we should attach
-    // to, or it will be null because the bucket was empty
-    if (prev == NULL) {
-        self->buckets[index] = malloc(sizeof(conn_map_entry_t));
-        self->buckets[index]->fd = fd;
-        self->buckets[index]->future = future;
-        self->buckets[index]->next = NULL;
+    return &self->slots[fd];
+}
+
+uint32_t conn_map_insert(conn_map_t* self, int fd, handler_future_t* future)
+{
+    conn_slot_t* slot = get_slot(self, fd);
+    if (slot->future) {
+        free_handler_future(slot->future);
+        slot->generation++;
     } else {
-        prev->next = malloc(sizeof(conn_map_entry_t));
-        prev->next->fd = fd;
-        prev->next->future = future;
-        prev->next->next = NULL;
+        self->count++;
     }
+
+    slot->future = future;
+    return slot->generation;
 }
 
 handler_future_t* conn_map_get(conn_map_t* self, int fd)
 {
-    size_t index = fd % self->cap;
-    conn_map_entry_t* existing = self->buckets[index];
-    while (existing != NULL) {
-        if (existing->fd == fd) {
-            return existing->future;
-        }
-        existing = existing->next;
+    if (fd < 0 || (size_t)fd >= self->cap) {
+        return NULL;
+    }
+    return self->slots[fd].future;
+}
+
+handler_future_t* conn_map_lookup(conn_map_t* self, int fd, uint32_t generation)
+{
+    handler_future_t* future = conn_map_get(self, fd);
+    if (future == NULL || self->slots[fd].generation != generation) {
+        return NULL;
     }
-    return NULL;
+    return future;
 }
 
 void conn_map_remove(conn_map_t* self, int fd)
 {
-    size_t index = fd % self->cap;
-    conn_map_entry_t* prev = NULL;
-    conn_map_entry_t* existing = self->buckets[index];
-    while (existing != NULL) {
-        if (existing->fd == fd) {
-            // we found the entry, now we need to remove it
-            if (prev == NULL) {
-                self->buckets[index] = existing->next;
-            } else {
-                prev->next = existing->next;
-            }
-            free_handler_future(existing->future);
-            free(existing);
-            return;
+    if (conn_map_get(self, fd) == NULL) {
+        return;
+    }
+
+    conn_slot_t* slot = &self->slots[fd];
+    free_handler_future(slot->future);
+    slot->future = NULL;
+    slot->generation++;
+    self->count--;
+}
+
+void conn_map_for_each(
+    conn_map_t* self, void (*fn)(int fd, handler_future_t* future, void* ctx), void* ctx)
+{
+    for (size_t fd = 0; fd < self->cap; fd++) {
+        if (self->slots[fd].future) {
+            fn(fd, self->slots[fd].future, ctx);
         }
-        prev = existing;
-        existing = existing->next;
     }
 }
 
@@ -116,6 +117,64 @@ int test_conn_map_insert_get_remove()
     return 0;
 }
 
+int test_conn_map_generations()
+{
+    conn_map_t* map = conn_map_new(2);
+    handler_future_t* first = new_handler_future(5);
+    uint32_t first_generation = conn_map_insert(map, 5, first);
+    assert(map->cap > 5, "expected the map to grow to fit the fd");
+    assert(conn_map_lookup(map, 5, first_generation) == first, "expected the current connection");
+
+    // the fd gets reused by a new connection, so events for the old one are stale
+    conn_map_remove(map, 5);
+    assert(conn_map_lookup(map, 5, first_generation) == NULL, "removed connection still found");
+    handler_future_t* second = new_handler_future(5);
+    uint32_t second_generation = conn_map_insert(map, 5, second);
+    assert(second_generation != first_generation, "expected a new generation for the new conn");
+    assert(conn_map_lookup(map, 5, first_generation) == NULL, "stale generation should not match");
+    assert(conn_map_lookup(map, 5, second_generation) == second, "expected the new connection");
+    assert(map->count == 1, "expected one connection in the map");
+
+    return 0;
+}
+
+static void remove_odd_fds(int fd, handler_future_t* future, void* ctx)
+{
+    (void)future;
+    conn_map_t* map = ctx;
+    if (fd % 2 == 1) {
+        conn_map_remove(map, fd);
+    }
+}
+
+static void count_fds(int fd, handler_future_t* future, void* ctx)
+{
+    (void)fd;
+    (void)future;
+    (*(int*)ctx)++;
+}
+
+int test_conn_map_for_each()
+{
+    // Room for fewer fds than we insert, so the iteration has to cover the slots the slab grew by
+    conn_map_t* map = conn_map_new(4);
+    for (int fd = 0; fd < 10; fd++) {
+        conn_map_insert(map, fd, new_handler_future(fd));
+    }
+    assert(map->cap >= 10, "expected the map to grow to fit every fd");
+
+    conn_map_for_each(map, remove_odd_fds, map);
+
+    int count = 0;
+    conn_map_for_each(map, count_fds, &count);
+    assert(count == 5, "expected only the even fds to be left");
+    for (int fd = 0; fd < 10; fd++) {
+        assert((conn_map_get(map, fd) != NULL) == (fd % 2 == 0), "wrong fd removed");
+    }
+
+    return 0;
+}
+
 int conn_test_suite()
 {
     int r = 0;
@@ -125,5 +184,17 @@ int conn_test_suite()
     } else {
         printf("\t✅ test_conn_map_insert_get_remove\n");
     }
+    if (test_conn_map_generations() < 0) {
+        r = -1;
+        printf("\t❌ test_conn_map_generations\n");
+    } else {
+        printf("\t✅ test_conn_map_generations\n");
+    }
+    if (test_conn_map_for_each() < 0) {
+        r = -1;
+        printf("\t❌ test_conn_map_for_each\n");
+    } else {
+        printf("\t✅ test_conn_map_for_each\n");
+    }
     return r;
 }
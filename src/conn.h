@@ -7,35 +7,57 @@
 #include "common.h"
 #include "handler.h"
 
-typedef struct conn_map_entry_t {
-    int fd;
+// Connections are stored in a slab indexed directly by fd, which the kernel hands out densely from
+// the lowest free number, so lookups are a single array access no matter how many connections
+// there are.
+typedef struct conn_slot_t {
+    // NULL if the slot is free
     handler_future_t* future;
-    struct conn_map_entry_t* next;
-} conn_map_entry_t;
+    // Bumped whenever the slot is freed, so that it tells apart the connections that have had the
+    // same fd number over time
+    uint32_t generation;
+} conn_slot_t;
 
 typedef struct conn_map_t {
+    // Indexed by fd, grown to fit the highest fd inserted so far
+    conn_slot_t* slots;
     size_t cap;
-    conn_map_entry_t** buckets;
+    // Number of occupied slots
+    size_t count;
 } conn_map_t;
 
 /**
- * Creates a new connection map with the given capacity.
+ * Creates a new connection map with room for fds below `capacity` to begin with.
  */
 conn_map_t* conn_map_new(size_t capacity);
 
 /**
- * Inserts a new connection into the map.
+ * Inserts a new connection into the map, replacing (and freeing) whatever was there. Returns the
+ * generation of the connection, for `conn_map_lookup`.
  */
-void conn_map_insert(conn_map_t* self, int fd, handler_future_t* future);
+uint32_t conn_map_insert(conn_map_t* self, int fd, handler_future_t* future);
 
 /**
  * Retrieves the connection from the map.
  */
 handler_future_t* conn_map_get(conn_map_t* self, int fd);
 
+/**
+ * Like `conn_map_get`, but returns NULL if the connection of that generation has since been
+ * removed, even if a new connection has taken over its fd.
+ */
+handler_future_t* conn_map_lookup(conn_map_t* self, int fd, uint32_t generation);
+
 /**
  * Removes the connection from the map.
  */
 void conn_map_remove(conn_map_t* self, int fd);
 
+/**
+ * Calls `fn` for every connection in the map. `fn` may remove the connection it is called for, but
+ * no other.
+ */
+void conn_map_for_each(
+    conn_map_t* self, void (*fn)(int fd, handler_future_t* future, void* ctx), void* ctx);
+
 int conn_test_suite();
@@ -0,0 +1,512 @@
+#include "kqueue.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+The kqueue backend registers every event with EV_ONESHOT, so callers re-register themselves each
+time they want to hear about a descriptor again. Emulating that with EPOLLONESHOT would cost one
+`epoll_ctl` per event, which is exactly what epoll lets us avoid: an epoll registration is
+persistent, and only has to change when the *kind* of readiness we care about changes.
+
+So instead we keep a table of the interest mask currently installed for each fd. A call to
+`register_read_event` for an fd that is already registered for reads is a no-op, and switching a
+connection between reading and writing is a single EPOLL_CTL_MOD. Registrations are level
+triggered, so a handler that doesn't drain the socket in one go will simply be woken up again.
+
+epoll has no way to submit changes together with the wait like kevent does, but we still defer
+them until `block_until_events`. That way an fd that flips between reading and writing within one
+loop iteration only costs the `epoll_ctl` for where it ends up.
+
+In edge-triggered mode (see `enable_edge_triggered`) every fd is added once with both EPOLLIN and
+EPOLLOUT and never modified again, so even the read/write switch disappears. The price is that
+nobody tells us again about data that was already there, which is what the `readable` flag is for.
+*/
+
+static _Thread_local int queue_fd;
+
+typedef struct fd_interest_t {
+    // Interest mask currently installed in the epoll set. Zero means the fd is not in the set.
+    uint32_t installed;
+    // Interest mask requested since the last wait
+    uint32_t wanted;
+    // Whether the fd is in the `dirty` list
+    bool dirty;
+    // Edge-triggered mode only: an edge was reported and the fd hasn't been drained since
+    bool readable;
+    // Reported back with every event for the fd, see `set_event_generation`
+    uint32_t generation;
+} fd_interest_t;
+
+// Indexed by fd
+static _Thread_local fd_interest_t* interest = NULL;
+static _Thread_local size_t interest_cap = 0;
+
+// fds whose `wanted` mask may differ from the installed one
+static _Thread_local int* dirty = NULL;
+static _Thread_local size_t dirty_len = 0;
+static _Thread_local size_t dirty_cap = 0;
+
+// Stats for the registrations queued since the last wait, and for the ones flushed by it
+static _Thread_local event_stats_t pending_stats = { 0 };
+static _Thread_local event_stats_t last_stats = { 0 };
+
+#define EDGE_TRIGGERED_EVENTS (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET)
+static _Thread_local bool edge_triggered = false;
+
+void kqueue_init()
+{
+    int r = epoll_create1(EPOLL_CLOEXEC);
+    if (r == -1) {
+        perror("epoll_create1");
+        exit(1);
+    }
+
+    queue_fd = r;
+    edge_triggered = false;
+}
+
+void enable_edge_triggered() { edge_triggered = true; }
+
+bool is_edge_triggered() { return edge_triggered; }
+
+static void ensure_interest_cap(int fd)
+{
+    if ((size_t)fd < interest_cap) {
+        return;
+    }
+
+    size_t new_cap = interest_cap ? interest_cap : 1024;
+    while (new_cap <= (size_t)fd) {
+        new_cap *= 2;
+    }
+
+    interest = realloc(interest, new_cap * sizeof(fd_interest_t));
+    memset(interest + interest_cap, 0, (new_cap - interest_cap) * sizeof(fd_interest_t));
+    interest_cap = new_cap;
+}
+
+static int set_interest(int fd, uint32_t events)
+{
+    ensure_interest_cap(fd);
+    pending_stats.registrations++;
+
+    fd_interest_t* entry = &interest[fd];
+
+    // Every fd gets the same persistent registration, so this will only reach the kernel the first
+    // time around. A read registration still tells us the caller has drained the fd.
+    if (edge_triggered) {
+        if (events & EPOLLIN) {
+            entry->readable = false;
+        }
+        events = EDGE_TRIGGERED_EVENTS;
+    }
+
+    entry->wanted = events;
+    if (entry->dirty) {
+        return 0;
+    }
+
+    // The registration from last time is still armed, so there's nothing to tell the kernel.
+    if (entry->installed == events) {
+        return 0;
+    }
+
+    if (dirty_len == dirty_cap) {
+        dirty_cap = dirty_cap ? dirty_cap * 2 : 256;
+        dirty = realloc(dirty, dirty_cap * sizeof(int));
+    }
+    dirty[dirty_len++] = fd;
+    entry->dirty = true;
+
+    return 0;
+}
+
+int register_read_event(int fd) { return set_interest(fd, EPOLLIN | EPOLLRDHUP); }
+
+void set_event_generation(int fd, uint32_t generation)
+{
+    ensure_interest_cap(fd);
+    interest[fd].generation = generation;
+}
+
+int register_write_event(int fd) { return set_interest(fd, EPOLLOUT); }
+
+void suspend_events(int fd)
+{
+    // An edge is only reported once, so there is nothing to keep from coming back
+    if (!edge_triggered) {
+        set_interest(fd, 0);
+    }
+}
+
+void deregister_events(int fd)
+{
+    // Closing the descriptor removes it from the epoll set for us, we just need to make sure that
+    // a new connection that gets the same fd number isn't mistaken for an existing registration.
+    // If the fd is still in the dirty list, clearing `wanted` turns that entry into a no-op.
+    if ((size_t)fd < interest_cap) {
+        interest[fd].installed = 0;
+        interest[fd].wanted = 0;
+        interest[fd].readable = false;
+        interest[fd].generation = 0;
+    }
+}
+
+void remove_events(int fd)
+{
+    // epoll tracks the open file description rather than the fd, so closing one of several
+    // descriptors for it leaves the registration in place
+    if ((size_t)fd < interest_cap && interest[fd].installed
+        && epoll_ctl(queue_fd, EPOLL_CTL_DEL, fd, NULL) == -1) {
+        println("epoll_ctl: failed to remove fd %d: %s", fd, strerror(errno));
+    }
+    deregister_events(fd);
+}
+
+bool is_readable(int fd)
+{
+    return edge_triggered && (size_t)fd < interest_cap && interest[fd].readable;
+}
+
+void mark_read_drained(int fd)
+{
+    if ((size_t)fd < interest_cap) {
+        interest[fd].readable = false;
+    }
+}
+
+static void flush_interest()
+{
+    size_t syscalls = 0;
+    for (size_t i = 0; i < dirty_len; i++) {
+        int fd = dirty[i];
+        fd_interest_t* entry = &interest[fd];
+        entry->dirty = false;
+
+        if (entry->wanted == entry->installed) {
+            continue;
+        }
+
+        // Suspended (a closed fd has nothing installed, so it never gets here)
+        if (entry->wanted == 0) {
+            syscalls++;
+            if (epoll_ctl(queue_fd, EPOLL_CTL_DEL, fd, NULL) == -1) {
+                println("epoll_ctl: failed to remove fd %d: %s", fd, strerror(errno));
+                continue;
+            }
+            entry->installed = 0;
+            continue;
+        }
+
+        struct epoll_event event = {
+            .events = entry->wanted,
+            .data.u64 = (uint64_t)entry->generation << 32 | (uint32_t)fd,
+        };
+        int op = entry->installed ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+        syscalls++;
+
+        if (epoll_ctl(queue_fd, op, fd, &event) == -1) {
+            println("epoll_ctl: failed to register fd %d: %s", fd, strerror(errno));
+            continue;
+        }
+
+        entry->installed = entry->wanted;
+    }
+    dirty_len = 0;
+
+    pending_stats.syscalls_saved = pending_stats.registrations - syscalls;
+}
+
+// Note that this effectively places an upper bound on the number of incoming client handlers we can
+// have in a "ready" state at any one time
+#define EPOLL_MAX_EVENTS 1024
+static _Thread_local struct epoll_event eventlist[EPOLL_MAX_EVENTS];
+static _Thread_local size_t last_event_len = 0;
+
+int block_until_events(int timeout_ms)
+{
+    flush_interest();
+    last_stats = pending_stats;
+    pending_stats = (event_stats_t) { 0 };
+
+    int event_count = epoll_wait(queue_fd, eventlist, EPOLL_MAX_EVENTS, timeout_ms);
+    if (event_count == -1) {
+        last_event_len = 0;
+        if (errno != EINTR) {
+            perror("epoll_wait");
+        }
+        return -1;
+    }
+
+    last_event_len = event_count;
+
+    return event_count;
+}
+
+event_stats_t get_event_stats() { return last_stats; }
+
+eventlist_iter_t get_eventlist_iter() { return (eventlist_iter_t) { 0 }; }
+
+event_t* get_next_event(eventlist_iter_t* iter)
+{
+    if (iter->index >= last_event_len) {
+        return NULL;
+    }
+
+    struct epoll_event* event = &eventlist[iter->index++];
+    if (edge_triggered && (event->events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+        interest[event_fd(event)].readable = true;
+    }
+
+    return event;
+}
+
+/**
+ ***************************************************************************************************
+ * Tests
+ ***************************************************************************************************
+ */
+#define LOG_IN_TEST_SUITE 0
+#define test_log(fmt, ...)                                                                         \
+    do {                                                                                           \
+        if (LOG_IN_TEST_SUITE) {                                                                   \
+            printf(fmt, ##__VA_ARGS__);                                                            \
+        }                                                                                          \
+    } while (0)
+
+#define assert(cond, msg)                                                                          \
+    do {                                                                                           \
+        if (!(cond)) {                                                                             \
+            printf("Assertion failed: %s\n", msg);                                                 \
+            return -1;                                                                             \
+        }                                                                                          \
+    } while (0)
+
+static void* server_thread(void* message)
+{
+    char* msg = (char*)message;
+    // create a socket that sends <message> to any client that connects
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr;
+    strcpy(addr.sun_path, "./test.sock");
+    unlink(addr.sun_path);
+    addr.sun_family = AF_UNIX;
+
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        return (void*)-1;
+    }
+
+    if (listen(sock, 5) < 0) {
+        perror("listen");
+        return (void*)-1;
+    }
+
+    test_log("[server]: waiting for client connection\n");
+    int client_sock = accept(sock, NULL, NULL);
+    test_log("[server]: accepted client connection\n");
+    if (client_sock < 0) {
+        perror("accept");
+        return (void*)-1;
+    }
+
+    if (write(client_sock, msg, strlen(msg)) < 0) {
+        perror("write");
+        return (void*)-1;
+    }
+
+    close(client_sock);
+    close(sock);
+    return (void*)0;
+}
+
+static int test_epoll_register_read_event()
+{
+    kqueue_init();
+
+    const char* message = "Hello, world!";
+
+    pthread_t server_thread_id;
+    if (pthread_create(&server_thread_id, NULL, server_thread, (void*)message) < 0) {
+        perror("pthread_create");
+        return -1;
+    }
+
+    // This is a bit hacky but we need to wait for the server thread to start and create the socket:
+    nanosleep(&(struct timespec) { .tv_nsec = 1000000 }, NULL);
+
+    int client_sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr;
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, "./test.sock");
+
+    if (connect(client_sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        return -1;
+    }
+
+    set_event_generation(client_sock, 7);
+    if (register_read_event(client_sock) < 0) {
+        return -1;
+    }
+
+    // Registering the same interest again must not fail with EEXIST
+    if (register_read_event(client_sock) < 0) {
+        return -1;
+    }
+
+    test_log("[client]: blocking until read events available\n");
+    block_until_events(-1);
+
+    event_stats_t stats = get_event_stats();
+    assert(stats.registrations == 2, "both registrations should be counted");
+    assert(stats.syscalls_saved == 1, "the duplicate registration should not cost a syscall");
+
+    eventlist_iter_t iter = get_eventlist_iter();
+    event_t* event = get_next_event(&iter);
+    assert(event != NULL, "expected at least one event");
+    assert(event_fd(event) == client_sock, "client socket not in event list");
+    assert(event_generation(event) == 7, "expected the event to carry the generation");
+
+    char buffer[1024];
+    ssize_t bytes_read = read(client_sock, buffer, sizeof(buffer));
+    if (bytes_read < 0) {
+        perror("read");
+        return -1;
+    }
+    buffer[bytes_read] = '\0';
+    test_log("[client]: read message: %s\n", buffer);
+    assert(strcmp(buffer, message) == 0, "message read from server does not match");
+
+    void* retval;
+    if (pthread_join(server_thread_id, &retval) < 0) {
+        perror("pthread_join");
+        return -1;
+    }
+
+    if (retval != (void*)0) {
+        printf("ERROR: server_thread returned with: %ld\n", (long)retval);
+        return -1;
+    }
+
+    deregister_events(client_sock);
+    close(client_sock);
+    unlink("./test.sock");
+
+    return 0;
+}
+
+static int test_epoll_edge_triggered()
+{
+    kqueue_init();
+    enable_edge_triggered();
+
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        perror("socketpair");
+        return -1;
+    }
+
+    if (register_read_event(fds[0]) < 0) {
+        return -1;
+    }
+    assert(!is_readable(fds[0]), "nothing has been reported for the fd yet");
+
+    if (write(fds[1], "ping", 4) < 0) {
+        perror("write");
+        return -1;
+    }
+
+    block_until_events(-1);
+    eventlist_iter_t iter = get_eventlist_iter();
+    event_t* event = get_next_event(&iter);
+    assert(event != NULL && event_fd(event) == fds[0], "expected an event for the fd");
+    assert(is_readable(fds[0]), "the edge should mark the fd as readable");
+
+    // Draining the fd and registering again must not touch the kernel
+    mark_read_drained(fds[0]);
+    assert(!is_readable(fds[0]), "the fd should no longer be readable once drained");
+    register_read_event(fds[0]);
+    register_write_event(fds[0]);
+
+    if (write(fds[1], "pong", 4) < 0) {
+        perror("write");
+        return -1;
+    }
+
+    block_until_events(-1);
+    event_stats_t stats = get_event_stats();
+    assert(stats.registrations == 2 && stats.syscalls_saved == 2,
+        "registrations after the first one should be free");
+
+    iter = get_eventlist_iter();
+    event = get_next_event(&iter);
+    assert(event != NULL && event_fd(event) == fds[0], "new data should produce a new edge");
+    assert(is_readable(fds[0]), "the new edge should mark the fd as readable");
+
+    deregister_events(fds[0]);
+    close(fds[0]);
+    close(fds[1]);
+    return 0;
+}
+
+static int test_epoll_suspend_events()
+{
+    kqueue_init();
+
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        perror("socketpair");
+        return -1;
+    }
+
+    register_read_event(fds[0]);
+    if (write(fds[1], "ping", 4) < 0) {
+        perror("write");
+        return -1;
+    }
+    assert(block_until_events(0) == 1, "expected the unread data to be reported");
+
+    // The data is still there, but nobody is asking about it anymore
+    suspend_events(fds[0]);
+    assert(block_until_events(0) == 0, "a suspended fd should not be reported");
+    assert(block_until_events(0) == 0, "a suspended fd should stay quiet");
+
+    register_read_event(fds[0]);
+    assert(block_until_events(0) == 1, "registering again should report the data again");
+
+    deregister_events(fds[0]);
+    close(fds[0]);
+    close(fds[1]);
+    return 0;
+}
+
+int kqueue_test_suite()
+{
+    int r = 0;
+    if (test_epoll_register_read_event() < 0) {
+        r = -1;
+        printf("\t❌ test_epoll_register_read_event\n");
+    } else {
+        printf("\t✅ test_epoll_register_read_event\n");
+    }
+    if (test_epoll_edge_triggered() < 0) {
+        r = -1;
+        printf("\t❌ test_epoll_edge_triggered\n");
+    } else {
+        printf("\t✅ test_epoll_edge_triggered\n");
+    }
+    if (test_epoll_suspend_events() < 0) {
+        r = -1;
+        printf("\t❌ test_epoll_suspend_events\n");
+    } else {
+        printf("\t✅ test_epoll_suspend_events\n");
+    }
+    return r;
+}
@@ -1,28 +1,14 @@
 #include "fs.h"
+#include "uring.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdalign.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
-#define READ_CHUNK_SIZE 1024
-
-static fs_read_result_t* new_read_result()
-{
-    fs_read_result_t* result = malloc(sizeof(fs_read_result_t));
-    bzero(result, sizeof(fs_read_result_t));
-
-    result->buffer_len = READ_CHUNK_SIZE;
-    result->buffer = malloc(result->buffer_len);
-
-    return result;
-}
-
-void free_read_result(fs_read_result_t* result)
-{
-    free(result->buffer);
-    free(result);
-}
-
 const char* get_content_type(char* path)
 {
     // FIXME: should actually just check the extension instead of full substring match
@@ -40,55 +26,91 @@ const char* get_content_type(char* path)
 // directory that we store our static assets in relative to CWD (without the ./)
 #define DATA_DIR "/data"
 
-fs_read_result_t* fs_read(char* path, size_t path_len)
+bool fs_read(const char* full_path, fs_read_result_t* result)
 {
-    char path_str[path_len + 1];
-    memcpy(path_str, path, path_len);
-    path_str[path_len] = 0;
+    int fd = open(full_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
 
-    fs_read_result_t* result = new_read_result();
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return false;
+    }
 
-    char* cwd = getcwd(NULL, 0);
-    size_t cwd_len = strlen(cwd);
+    result->content_type = get_content_type((char*)full_path);
+    if ((size_t)st.st_size > FS_READ_MAX) {
+        result->content_length = st.st_size;
+        result->fd = fd;
+        return true;
+    }
 
-    // FIXME: should probably use realpath() and resolve ../../ or whatever
-    size_t data_dir_len = strlen(DATA_DIR);
+    result->fd = -1;
+    buffer_segment_t* segment = result->segment;
+    while (segment->len < (size_t)st.st_size) {
+        ssize_t bytes_read = read(fd, segment->data + segment->len, st.st_size - segment->len);
+        if (bytes_read < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("read");
+            close(fd);
+            return false;
+        }
 
-    char full_path[cwd_len + path_len + data_dir_len + 1];
-    snprintf(full_path, sizeof(full_path), "%s%s%s", cwd, DATA_DIR, path);
+        // the file got shorter since we looked at it
+        if (bytes_read == 0) {
+            break;
+        }
 
-    FILE* file = fopen(full_path, "r");
-    if (!file) {
-        free(result);
-        free(cwd);
-        return NULL;
+        segment->len += bytes_read;
     }
+    result->content_length = segment->len;
 
-    size_t bytes_read = 1;
-    while (bytes_read > 0) {
-        if (result->content_length + READ_CHUNK_SIZE > result->buffer_len) {
-            result->buffer_len *= 2;
-            result->buffer = realloc(result->buffer, result->buffer_len);
-        }
+    close(fd);
+    return true;
+}
 
-        bytes_read = fread(result->buffer + result->content_length, 1, READ_CHUNK_SIZE, file);
+static void run_read_job(work_item_t* item)
+{
+    fs_read_job_t* job = (fs_read_job_t*)item;
+    job->found = fs_read(job->full_path, &job->result);
+}
 
-        if (bytes_read < 0) {
-            perror("read");
-            free(result);
-            free(cwd);
-            fclose(file);
-            return NULL;
-        }
+fs_read_job_t* fs_read_submit(arena_t* arena, const char* path, size_t path_len, int fd)
+{
+    fs_read_job_t* job = arena_alloc(arena, sizeof(fs_read_job_t), alignof(fs_read_job_t));
+    bzero(job, sizeof(fs_read_job_t));
+    job->work.run = run_read_job;
+    job->work.fd = fd;
 
-        result->content_length += bytes_read;
+    // A path relative to the CWD saves us from asking for the CWD first
+    // FIXME: should probably use realpath() and resolve ../../ or whatever
+    size_t full_path_len = 1 + strlen(DATA_DIR) + path_len + 1;
+    job->full_path = arena_alloc(arena, full_path_len, 1);
+    snprintf(job->full_path, full_path_len, ".%s%.*s", DATA_DIR, (int)path_len, path);
+    job->result.segment = buffer_segment_get();
+
+    workers_submit(&job->work);
+    if (!job->work.done) {
+        io_suspend_reading(fd);
     }
+    return job;
+}
 
-    fclose(file);
-    free(cwd);
-
-    // Determine content-type:
-    result->content_type = get_content_type(path_str);
+async_result_t poll_fs_read(fs_read_job_t* job)
+{
+    if (!job->work.done) {
+        // the event loop polls us again when the job comes back from the worker pool, and
+        // starts reading from the connection again then
+        return (async_result_t) { .result = POLL_PENDING, .value = NULL };
+    }
 
-    return result;
+    // Back on the thread whose pool the segment came from
+    if (job->result.segment && (!job->found || job->result.fd >= 0)) {
+        buffer_segment_put(job->result.segment);
+        job->result.segment = NULL;
+    }
+    return (async_result_t) { .result = POLL_READY, .value = job->found ? &job->result : NULL };
 }
@@ -1,16 +1,45 @@
 #pragma once
 
+#include "arena.h"
+#include "buffer.h"
 #include "common.h"
+#include "workers.h"
+
+// Files larger than this aren't read into memory, see `fs_read`. Smaller ones fit into a single
+// pooled segment.
+#define FS_READ_MAX BUFFER_SEGMENT_CAP
 
 typedef struct fs_read_result_t {
-    char* buffer;
-    size_t buffer_len;
+    // The contents of a file that has been read. Whoever gets the result owns the segment, and has
+    // to return it to the pool of the thread that started the read.
+    buffer_segment_t* segment;
     size_t content_length;
     const char* content_type;
+    // The open file, for a file that is larger than FS_READ_MAX. -1 when the file has been read.
+    int fd;
 } fs_read_result_t;
 
-// After the handler is finished transmitting the result, it should free the memory
-void free_read_result(fs_read_result_t* result);
+// Reads the file at `full_path` (relative to the CWD) into `result->segment`, and fills in the rest
+// of the result. A file larger than FS_READ_MAX is left open in the result instead, for the
+// response to send straight from the file, and whoever gets the result has to close it. Returns
+// false if there is no such file. Everything it needs is allocated up front by the caller, so that
+// it can run on any thread.
+bool fs_read(const char* full_path, fs_read_result_t* result);
+
+typedef struct fs_read_job_t {
+    work_item_t work;
+    // The file's path under the data directory
+    char* full_path;
+    fs_read_result_t result;
+    bool found;
+} fs_read_job_t;
+
+// Starts an `fs_read` of `path` in the data directory on the worker pool, on behalf of the
+// connection `fd`, which the event loop polls again once the read has finished, and doesn't read
+// from until then. The job, the path, and the segment the file is read into are all allocated right
+// away, from `arena` and the calling thread's buffer pool, so that the worker doesn't need either.
+fs_read_job_t* fs_read_submit(arena_t* arena, const char* path, size_t path_len, int fd);
 
-// Allocate a new read result and fill it with the file contents at <path>
-fs_read_result_t* fs_read(char* path, size_t path_len);
+// Returns POLL_PENDING until the job has finished, and then the result, or NULL if there is no
+// such file.
+async_result_t poll_fs_read(fs_read_job_t* job);
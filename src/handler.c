@@ -1,104 +1,142 @@
 #include "arena.h"
+#include "buffer.h"
 #include "common.h"
 #include "fs.h"
 #include "handler.h"
 #include "kqueue.h"
 #include "response.h"
+#include "scan.h"
+#include "uring.h"
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdalign.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
-#define HEADERS_ARENA_SIZE 4096
+// Region size of the request arena, which holds the parsed headers, the response and the file read.
+// 8k fits all of that for a small file in a single region.
+#define REQUEST_ARENA_SIZE 8192
 
-bool string_view_equals(string_view_t a, string_view_t b)
-{
-    if (a.len != b.len) {
-        return false;
-    }
-    return strncmp(a.data, b.data, a.len) == 0;
-}
+// How much output we hold back for the responses to pipelined requests to join. Beyond that it goes
+// out right away.
+#define MAX_HELD_OUTPUT (4 * BUFFER_SEGMENT_CAP)
+
+// The routes of every connection, shared by all the event loops, see `handler_set_router`
+static const router_t* router = NULL;
+
+void handler_set_router(const router_t* routes) { router = routes; }
 
-static void init_handler_future(handler_future_t* self, int fd)
+// How many futures each thread keeps around for new connections
+#define MAX_FREE_FUTURES 1024
+
+// Futures of closed connections, ready to be handed to new ones. Each event loop thread has its
+// own, so they need no locking.
+static _Thread_local handler_future_t* free_futures = NULL;
+static _Thread_local size_t free_future_count = 0;
+
+// Gets the future ready for the next request on its connection. Everything the request allocated
+// lives in the arena, so a single rewind cleans it all up, and the next request reuses the memory.
+static void reset_handler_future(handler_future_t* self)
 {
-    self->fd = fd;
-    self->state = HANDLER_READING_HEADERS;
+    // Whatever the client has sent past the end of this request is the start of the next one, so
+    // it moves to the front of the stream. The next request gets fresh segments when nothing has.
+    read_stream_t* stream = &self->read_stream;
+    buffer_chain_consume(&stream->chain, stream->body_end_idx);
+    stream->data = stream->chain.head ? stream->chain.head->data : NULL;
+    stream->scanned = 0;
+    stream->body_start_idx = 0;
+    stream->body_end_idx = 0;
+    stream->body_remaining = 0;
+    stream->body_len = 0;
+    stream->decoded = 0;
+    stream->discarded = 0;
+    request_body_release(&self->body);
 
-    if (self->arena) {
-        arena_release(self->arena);
-    }
-    self->arena = arena_create(HEADERS_ARENA_SIZE);
+    self->state = HANDLER_READING_HEADERS;
+    response_release(self->response);
+    arena_reset(self->arena);
+    self->response = response_new(self->arena, &self->output);
 
     self->request = (request_t) {
         .method = { .data = NULL, .len = 0 },
         .path = { .data = NULL, .len = 0 },
         .version = { .data = NULL, .len = 0 },
         .content_length = 0,
-        .headers = NULL,
-    };
-
-    if (self->read_stream.data) {
-        free(self->read_stream.data);
-    }
-
-    self->read_stream = (read_stream_t) {
-        .data = malloc(1024),
-        .len = 1024,
-        .write_cursor = 0,
-        .read_cursor = 0,
-        .body_start_idx = 0,
     };
-    bzero(self->read_stream.data, 1024);
-
-    if (self->response) {
-        response_free(self->response);
-    }
-
-    if (self->read_result) {
-        free_read_result(self->read_result);
-    }
 
-    self->read_result = NULL;
-    self->response = response_new();
+    self->route_handler = NULL;
+    self->route = (route_context_t) { 0 };
+    self->streaming_body = false;
+    self->waiting_for_body = false;
+    self->body_too_large = false;
 }
 
 handler_future_t* new_handler_future(int fd)
 {
-    handler_future_t* self = malloc(sizeof(handler_future_t));
-    bzero(self, sizeof(handler_future_t));
-    init_handler_future(self, fd);
+    handler_future_t* self = free_futures;
+    if (self) {
+        free_futures = self->next_free;
+        free_future_count--;
+    } else {
+        self = malloc(sizeof(handler_future_t));
+        bzero(self, sizeof(handler_future_t));
+        self->arena = arena_create(REQUEST_ARENA_SIZE);
+        self->response = response_new(self->arena, &self->output);
+        request_body_init(&self->body);
+    }
+
+    self->fd = fd;
+    self->requests_served = 0;
+    self->timer = (timer_entry_t) { 0 };
+    self->next_free = NULL;
     return self;
 }
 
 void free_handler_future(handler_future_t* self)
 {
+    buffer_chain_release(&self->read_stream.chain);
+    response_output_release(&self->output);
+    self->output.bytes_written = 0;
+    reset_handler_future(self);
+
+    if (free_future_count < MAX_FREE_FUTURES) {
+        self->next_free = free_futures;
+        free_futures = self;
+        free_future_count++;
+        return;
+    }
+
     arena_release(self->arena);
-    free(self->read_stream.data);
     free(self);
 }
 
-#define READ_CHUNK_SIZE 1024
-#define maybe_realloc(buf, len, cursor, size)                                                      \
-    if (cursor + size > len) {                                                                     \
-        len *= 2;                                                                                  \
-        buf = realloc(buf, len);                                                                   \
-    }
-
 static async_result_t poll_read(int fd, read_stream_t* stream)
 {
-    // check if we have enough space in the buffer:
-    maybe_realloc(stream->data, stream->len, stream->write_cursor, READ_CHUNK_SIZE);
+    // Fill up the last segment before starting a new one
+    buffer_segment_t* segment = stream->chain.tail;
+    if (!segment || segment->len == BUFFER_SEGMENT_CAP) {
+        segment = buffer_chain_extend(&stream->chain);
+        stream->data = stream->chain.head->data;
+    }
 
     // read from the socket:
-    int bytes_read = read(fd, stream->data + stream->write_cursor, READ_CHUNK_SIZE);
+    int bytes_read = io_read(fd, segment->data + segment->len, BUFFER_SEGMENT_CAP - segment->len);
     println("poll_read: bytes_read = %d", bytes_read);
     if (bytes_read == -1) {
         // 1) we errored because it would block, so we just need to re-register
         // ourselves for the next read
         if (errno == EAGAIN || errno == EWOULDBLOCK) {
-            register_read_event(fd);
+            // Nothing of the request has arrived yet, so there is no need to hold on to a segment
+            // while we wait for it
+            if (stream->chain.len == 0) {
+                buffer_chain_release(&stream->chain);
+                stream->data = NULL;
+            }
+            io_wait_readable(fd);
             async_result_t res = { .result = POLL_PENDING, .value = NULL };
             return res;
         }
@@ -119,84 +157,76 @@ static async_result_t poll_read(int fd, read_stream_t* stream)
 
     // otherwise we read some bytes:
     println("read %d bytes from client connection", bytes_read);
-    stream->write_cursor += bytes_read;
+    segment->len += bytes_read;
+    stream->chain.len += bytes_read;
     return (async_result_t) { .result = POLL_READY, .value = (void*)(size_t)bytes_read };
 }
 
-static int max(int a, int b) { return a > b ? a : b; }
-
-static int boyer_moore_search(char* haystack, char* needle)
+// Reads more of the request. Responses that were held back for this one to join them go out first,
+// since the client may be waiting for them before it sends the rest.
+static async_result_t poll_read_more(handler_future_t* self)
 {
-    int m = strlen(needle);
-    int n = strlen(haystack);
-
-    int bad_char[256];
-    for (int i = 0; i < 256; i++) {
-        bad_char[i] = -1;
-    }
-
-    for (int i = 0; i < m; i++) {
-        bad_char[(int)needle[i]] = i;
-    }
-
-    int s = 0;
-    while (s <= n - m) {
-        int j = m - 1;
-        while (j >= 0 && needle[j] == haystack[s + j]) {
-            j--;
-        }
-
-        if (j < 0) {
-            return s;
+    if (self->output.chain.len > 0) {
+        void* r;
+        ready(poll_response_output_flush(&self->output, self->fd), r);
+        if ((long)r < 0) {
+            return (async_result_t) { .result = POLL_READY, .value = (void*)-1 };
         }
-
-        s += max(1, j - bad_char[(int)haystack[s + j]]);
     }
-
-    return -1;
+    return poll_read(self->fd, &self->read_stream);
 }
 
+// What `poll_read_headers` is ready with when the headers don't fit (-1 is for a failed read)
+#define HEADERS_TOO_LARGE 1
+
 static async_result_t poll_read_headers(handler_future_t* self)
 {
-    char* haystack = self->read_stream.data + self->read_stream.read_cursor;
-    char* needle = "\r\n\r\n";
-
-    int found = boyer_moore_search(haystack, needle);
+    read_stream_t* stream = &self->read_stream;
+    size_t headers_end;
+
+    // The request line and headers have to fit into the first segment, so that's all we look at,
+    // even when a pipelining client has sent more than that already
+    while (!(headers_end = scan_headers_end(stream->data,
+                 stream->chain.head ? stream->chain.head->len : 0, &stream->scanned))) {
+        if (stream->chain.head && stream->chain.head->len == BUFFER_SEGMENT_CAP) {
+            println("request headers from client %d are too large", self->fd);
+            return (async_result_t) { .result = POLL_READY, .value = (void*)HEADERS_TOO_LARGE };
+        }
 
-    while (found == -1) {
-        // we haven't found them, so forward the cursor and poll for more data
-        self->read_stream.read_cursor = self->read_stream.write_cursor;
+        // we haven't found them, so poll for more data
         void* r;
-        ready(poll_read(self->fd, &self->read_stream), r);
+        ready(poll_read_more(self), r);
 
         // if we errored, return the error
         long return_val = (long)r;
         if (return_val == -1) {
             return (async_result_t) { .result = POLL_READY, .value = (void*)-1 };
         }
-
-        // otherwise, we have read some bytes, so we should search again
-        found = boyer_moore_search(haystack, needle);
     }
 
     // We found it
-    self->read_stream.body_start_idx = found + 4;
-    println("read to end of headers, body starts at %ld", self->read_stream.body_start_idx);
-    // Reset our read_cursor so our parser can read from the beginning
-    self->read_stream.read_cursor = 0;
+    stream->body_start_idx = headers_end;
+    println("read to end of headers, body starts at %ld", stream->body_start_idx);
     return (async_result_t) { .result = POLL_READY, .value = (void*)0 };
 }
 
-static header_t* get_header(request_t* request, char* key)
+// Initial capacity of the array of unknown headers
+#define OTHER_HEADERS_SIZE 16
+
+header_t* request_header(request_t* request, const char* name)
 {
-    header_t* current = request->headers;
-    while (current) {
-        if (strncmp(current->key.data, key, current->key.len) == 0) {
-            return current;
-        }
-        current = current->next;
+    size_t len = strlen(name);
+    known_header_t known = known_header(name, len);
+    if (known != HEADER_UNKNOWN) {
+        return request->known[known];
     }
 
+    for (size_t i = 0; i < request->other_count; i++) {
+        header_t* header = &request->other[i];
+        if (header->key.len == len && equals_ignore_case(header->key.data, name, len)) {
+            return header;
+        }
+    }
     return NULL;
 }
 
@@ -208,153 +238,159 @@ static long get_content_length(request_t* request)
         return request->content_length;
     }
 
-    header_t* header = get_header(request, "Content-Length");
+    header_t* header = request->known[HEADER_CONTENT_LENGTH];
     if (!header) {
         return 0;
     }
 
-    assert(header->value.next == NULL && "multiple Content-Length header values are invalid");
-
-    // enough space for a cstr of the value
-    char str_buf[header->value.name.len + 1];
-    memcpy(str_buf, header->value.name.data, header->value.name.len);
-    str_buf[header->value.name.len] = '\0';
-
-    long r;
-    if ((r = strtol(str_buf, NULL, 10)) == 0) {
-        perror("strtol: unable to parse Content-Length header value");
+    // Conflicting lengths would leave us guessing where the body ends
+    if (header->next || header->value.len == 0) {
+        println("invalid Content-Length header");
         return -1;
     }
 
+    long r = 0;
+    for (size_t i = 0; i < header->value.len; i++) {
+        char c = header->value.data[i];
+        if (c < '0' || c > '9' || r > (LONG_MAX - 9) / 10) {
+            println("unable to parse Content-Length header value");
+            return -1;
+        }
+        r = r * 10 + (c - '0');
+    }
+
     request->content_length = r;
 
     return r;
 }
 
-static void insert_header(request_t* request, header_t* header)
+// Finds out whether the body comes in chunks. Returns false if the request asks for a transfer
+// coding we don't support, or sends a Content-Length along with it, which would leave it up to us
+// to guess where the body ends.
+static bool get_transfer_encoding(request_t* request)
 {
-    if (!request->headers) {
-        request->headers = header;
-        return;
+    header_t* header = request->known[HEADER_TRANSFER_ENCODING];
+    if (!header) {
+        return true;
     }
 
-    header_t* current = request->headers;
-    header_t* tail = NULL;
-    while (current) {
-        if (string_view_equals(current->key, header->key)) {
-            // TODO: look up what the expected behavior is supposed to be if we encounter the same
-            // value as well...probably just a no-op? Either way this is bad behavior on the part of
-            // the client if that happens.
+    bool chunked = header->value.len == 7 && equals_ignore_case(header->value.data, "chunked", 7);
+    if (!chunked || header->next || request->known[HEADER_CONTENT_LENGTH]) {
+        println("unsupported Transfer-Encoding header");
+        return false;
+    }
 
-            // forward down the linked list of values until we get to the end:
-            header_value_t* value = &current->value;
-            while (value->next) {
-                value = value->next;
-            }
+    request->chunked = true;
+    return true;
+}
 
-            value->next = &header->value;
-            return;
+// Files the header under its slot if we know it, or at the end of the other headers if we don't
+static void add_header(arena_t* arena, request_t* request, string_view_t key, string_view_t value)
+{
+    known_header_t known = known_header(key.data, key.len);
+    if (known != HEADER_UNKNOWN) {
+        header_t* header = arena_alloc(arena, sizeof(header_t), alignof(header_t));
+        *header = (header_t) { .key = key, .value = value, .next = NULL };
+
+        // Repeats are rare, so the list is almost always empty
+        header_t** tail = &request->known[known];
+        while (*tail) {
+            tail = &(*tail)->next;
         }
-        tail = current;
-        current = current->next;
+        *tail = header;
+        return;
     }
 
-    tail->next = header;
+    if (request->other_count == request->other_cap) {
+        size_t cap = request->other_cap ? request->other_cap * 2 : OTHER_HEADERS_SIZE;
+        header_t* other = arena_alloc(arena, cap * sizeof(header_t), alignof(header_t));
+        if (request->other_count > 0) {
+            memcpy(other, request->other, request->other_count * sizeof(header_t));
+        }
+        request->other = other;
+        request->other_cap = cap;
+    }
+    request->other[request->other_count++]
+        = (header_t) { .key = key, .value = value, .next = NULL };
 }
 
-// At this point we know know that everything up to the body has been read, so
-// we can parse the request line and headers into the request struct that we
-// own.
-static void parse_request(handler_future_t* self)
+// Whether `p` points at a CRLF before `end`
+static bool at_crlf(const char* p, const char* end)
 {
-    request_t* request = &self->request;
-    read_stream_t* stream = &self->read_stream;
-    assert(stream->body_start_idx && "parse_request called before headers were read");
+    return p + 1 < end && p[0] == '\r' && p[1] == '\n';
+}
+
+bool parse_request_head(arena_t* arena, char* data, size_t len, request_t* request)
+{
+    char* p = data;
+    char* end = data + len;
 
     // request-line: method SP request-target SP HTTP-version CRLF
-    request->method.data = stream->data;
-    for (size_t i = 0; i < stream->body_start_idx; i++) {
-        if (stream->data[stream->read_cursor] == ' ') {
-            request->method.len = i;
-            stream->read_cursor++;
-            break;
-        }
-        stream->read_cursor++;
+    char* sp = (char*)scan_find2(p, end, ' ', '\r');
+    if (sp == end || *sp != ' ') {
+        return false;
     }
+    request->method = (string_view_t) { .data = p, .len = sp - p };
+    p = sp + 1;
 
-    request->path.data = stream->data + stream->read_cursor;
-    for (size_t i = 0; i < stream->body_start_idx; i++) {
-        if (stream->data[stream->read_cursor] == ' ') {
-            request->path.len = i;
-            stream->read_cursor++;
-            break;
-        }
-
-        stream->read_cursor++;
+    sp = (char*)scan_find2(p, end, ' ', '\r');
+    if (sp == end || *sp != ' ') {
+        return false;
     }
+    request->path = (string_view_t) { .data = p, .len = sp - p };
+    p = sp + 1;
 
-    request->version.data = stream->data + stream->read_cursor;
-    for (size_t i = 0; i < stream->body_start_idx; i++) {
-        if (stream->data[stream->read_cursor] == '\r') {
-            request->version.len = i;
-            stream->read_cursor++;
-            break;
-        }
-        stream->read_cursor++;
+    char* cr = (char*)scan_find2(p, end, '\r', '\r');
+    if (!at_crlf(cr, end)) {
+        return false;
     }
-
-    // skip the last \n of the CRLF
-    stream->read_cursor++;
-
-    // TODO: what if we have no headers at all?
-    while (stream->read_cursor < stream->body_start_idx) {
-        header_t* current_header = arena_alloc(self->arena, sizeof(header_t), alignof(header_t));
-        bzero(current_header, sizeof(header_t));
-
-        // Parse the header key
-        current_header->key.data = stream->data + stream->read_cursor;
-        for (size_t i = 0; i < stream->body_start_idx; i++) {
-            if (stream->data[stream->read_cursor] == ':') {
-                current_header->key.len = i;
-                stream->read_cursor++;
-                break;
-            }
-            stream->read_cursor++;
+    request->version = (string_view_t) { .data = p, .len = cr - p };
+    p = cr + 2;
+
+    // header-field: field-name ":" OWS field-value OWS CRLF, up to the empty line
+    while (p < end && *p != '\r') {
+        char* colon = (char*)scan_find2(p, end, ':', '\r');
+        if (colon == end || *colon != ':' || colon == p) {
+            return false;
         }
+        string_view_t key = { .data = p, .len = colon - p };
 
-        // Skip the optional whitespace after the header
-        if (stream->data[stream->read_cursor] == ' ') {
-            stream->read_cursor++;
+        p = colon + 1;
+        while (p < end && (*p == ' ' || *p == '\t')) {
+            p++;
         }
-
-        // Parse the header value
-        current_header->value.name.data = stream->data + stream->read_cursor;
-        for (size_t i = 0; i < stream->body_start_idx; i++) {
-            if (stream->data[stream->read_cursor] == '\r') {
-                current_header->value.name.len = i;
-                stream->read_cursor++;
-                break;
-            }
-            stream->read_cursor++;
+        cr = (char*)scan_find2(p, end, '\r', '\r');
+        if (!at_crlf(cr, end)) {
+            return false;
+        }
+        char* value_end = cr;
+        while (value_end > p && (value_end[-1] == ' ' || value_end[-1] == '\t')) {
+            value_end--;
         }
+        string_view_t value = { .data = p, .len = value_end - p };
 
-        // Insert the header into the request
-        insert_header(request, current_header);
+        add_header(arena, request, key, value);
+        p = cr + 2;
+    }
 
-        // skip the CRLF:
-        stream->read_cursor++;
+    return at_crlf(p, end);
+}
 
-        // Check if there are more headers to read:
-        if (stream->data[stream->read_cursor] == '\r') {
-            stream->read_cursor += 2;
-            break;
-        }
-    }
+// At this point we know know that everything up to the body has been read, so we can parse the
+// request line and headers into the request struct that we own. Returns false if they are
+// malformed.
+static bool parse_request(handler_future_t* self)
+{
+    read_stream_t* stream = &self->read_stream;
+    assert(stream->body_start_idx && "parse_request called before headers were read");
+    return parse_request_head(self->arena, stream->data, stream->body_start_idx, &self->request);
 }
 
 static void pretty_print_request(handler_future_t* self)
 {
     request_t* request = &self->request;
+    // keep the output from several event loop threads from interleaving
+    flockfile(stdout);
     printf("method=");
     fwrite(request->method.data, 1, request->method.len, stdout);
 
@@ -367,68 +403,323 @@ static void pretty_print_request(handler_future_t* self)
     printf(" headers=");
 
     printf("{");
-    header_t* curr = request->headers;
-    while (curr) {
-        printf("\"");
-        fwrite(curr->key.data, 1, curr->key.len, stdout);
+    bool first = true;
+    for (int known = 0; known < KNOWN_HEADER_COUNT; known++) {
+        header_t* header = request->known[known];
+        if (!header) {
+            continue;
+        }
+        printf(first ? "\"" : ", \"");
+        first = false;
+        fwrite(header->key.data, 1, header->key.len, stdout);
         printf("\": \"");
-        // Iterate over the value linked list and print as comma-separated values:
-        header_value_t* value = &curr->value;
-        while (value) {
-            fwrite(value->name.data, 1, value->name.len, stdout);
-            value = value->next;
-            if (value) {
+        // print repeated headers as comma-separated values:
+        for (; header; header = header->next) {
+            fwrite(header->value.data, 1, header->value.len, stdout);
+            if (header->next) {
                 printf(", ");
             }
         }
         printf("\"");
-        curr = curr->next;
+    }
+    for (size_t i = 0; i < request->other_count; i++) {
+        header_t* header = &request->other[i];
+        printf(first ? "\"" : ", \"");
+        first = false;
+        fwrite(header->key.data, 1, header->key.len, stdout);
+        printf("\": \"");
+        fwrite(header->value.data, 1, header->value.len, stdout);
+        printf("\"");
+    }
+    if (self->body.spooling) {
+        printf("} body=(%zu bytes spooled to disk)\n", self->body.len);
+        funlockfile(stdout);
+        return;
+    }
+
+    printf("} body=\"");
+    for (buffer_segment_t* segment = self->body.chain.head; segment; segment = segment->next) {
+        fwrite(segment->data, 1, segment->len, stdout);
+    }
+    printf("\"\n");
+    funlockfile(stdout);
+}
+
+// What reading the body returns once it goes past `body_max_size`
+#define BODY_TOO_LARGE 2
 
-        if (curr) {
-            printf(", ");
+// Takes the next piece of the body from [*p, end), up to the end of the body, and sets `data` and
+// `len` to it. Advances `*p` past the piece, and past the framing around it for a chunked body.
+// Returns 1 once the body is complete, 0 if there is more of it, -1 if it is malformed, and
+// BODY_TOO_LARGE once a chunked body is larger than we accept.
+static int next_body_slice(
+    handler_future_t* self, const char** p, const char* end, const char** data, size_t* len)
+{
+    read_stream_t* stream = &self->read_stream;
+    if (!self->request.chunked) {
+        *data = *p;
+        *len = end - *p;
+        if (*len > stream->body_remaining) {
+            *len = stream->body_remaining;
         }
+        *p += *len;
+        stream->body_remaining -= *len;
+        stream->body_len += *len;
+        return stream->body_remaining == 0;
     }
-    printf("} body=\"");
 
-    if (request->content_length > 0) {
-        fwrite(self->read_stream.data + self->read_stream.body_start_idx, 1,
-            request->content_length, stdout);
+    chunked_result_t result = chunked_decode(&self->chunked, p, end, data, len);
+    // Only the chunks tell how long the body is, so the limit applies as they arrive
+    if (stream->body_len + *len > body_max_size()) {
+        return BODY_TOO_LARGE;
+    }
+    stream->body_len += *len;
+    if (result == CHUNKED_ERROR) {
+        println("malformed chunked body from client %d", self->fd);
+        return -1;
+    }
+    return result == CHUNKED_DONE;
+}
+
+// Hands the body in [*p, end) over to the request body, up to the end of the body, and advances
+// `*p` past what it took. Returns what `next_body_slice` does, with 0 meaning that the body goes on
+// past `end`.
+static int take_body(handler_future_t* self, const char** p, const char* end)
+{
+    int taken;
+    do {
+        const char* data;
+        size_t len;
+        taken = next_body_slice(self, p, end, &data, &len);
+        if (taken < 0 || taken == BODY_TOO_LARGE) {
+            return taken;
+        }
+        if (len > 0) {
+            request_body_append(&self->body, data, len);
+        }
+    } while (!taken && *p < end);
+    return taken;
+}
+
+// Gets ready to read the body that follows the headers. Returns the status to turn the request away
+// with if its length is malformed or larger than we accept, and STATUS_OK otherwise.
+static http_status_t start_body(handler_future_t* self)
+{
+    read_stream_t* stream = &self->read_stream;
+    stream->decoded = stream->body_start_idx;
+    if (self->request.chunked) {
+        chunked_init(&self->chunked);
+        return STATUS_OK;
     }
 
-    printf("\"\n");
+    long content_length = get_content_length(&self->request);
+    if (content_length < 0) {
+        return STATUS_BAD_REQUEST;
+    }
+    if ((size_t)content_length > body_max_size()) {
+        return STATUS_CONTENT_TOO_LARGE;
+    }
+    stream->body_remaining = content_length;
+    return STATUS_OK;
 }
 
+// Reads the body, handing it over to the request body (see body.h) as it arrives. Once a segment
+// after the first has been handed over, it is reused for the next read, so the body never takes
+// more than that one segment of the read stream, however large it is. Returns BODY_TOO_LARGE for a
+// chunked body that goes past the limit, without reading the rest of it.
 async_result_t poll_read_body(handler_future_t* self)
 {
-    size_t body_start = self->read_stream.body_start_idx;
-    long content_length = get_content_length(&self->request);
+    read_stream_t* stream = &self->read_stream;
+    void* _r;
+    while (!stream->body_end_idx) {
+        // Whatever has arrived since the last time is in the last segment, since everything before
+        // it has been handed over already
+        buffer_segment_t* segment = stream->chain.tail;
+        size_t segment_start = stream->chain.len - segment->len;
+        const char* p = segment->data + (stream->decoded - segment_start);
+        int taken = take_body(self, &p, segment->data + segment->len);
+        if (taken < 0 || taken == BODY_TOO_LARGE) {
+            return (async_result_t) { .result = POLL_READY, .value = (void*)(long)taken };
+        }
+        if (taken > 0) {
+            stream->body_end_idx = segment_start + (p - segment->data);
+            break;
+        }
+        stream->decoded = stream->chain.len;
+
+        // The first segment holds the headers, which have to stay where they are
+        if (segment != stream->chain.head) {
+            stream->chain.len -= segment->len;
+            stream->decoded -= segment->len;
+            stream->discarded += segment->len;
+            segment->len = 0;
+        }
 
-    if (content_length == -1) {
-        return (async_result_t) { .result = POLL_READY, .value = (void*)-1 };
+        // We don't read any more of a spooled body until what we have is written out, which is
+        // what holds back a client that sends it faster than that
+        ready(poll_request_body_spool(&self->body, self->fd, false), _r);
+        if ((long)_r < 0) {
+            return (async_result_t) { .result = POLL_READY, .value = (void*)-1 };
+        }
+
+        ready(poll_read_more(self), _r);
+        if ((long)_r < 0) {
+            return (async_result_t) { .result = POLL_READY, .value = (void*)-1 };
+        }
     }
 
-    if (content_length == 0) {
-        return (async_result_t) { .result = POLL_READY, .value = (void*)0 };
+    // The rest of a spooled body
+    ready(poll_request_body_spool(&self->body, self->fd, true), _r);
+    if ((long)_r < 0) {
+        return (async_result_t) { .result = POLL_READY, .value = (void*)-1 };
     }
+    return (async_result_t) { .result = POLL_READY, .value = (void*)0 };
+}
+
+async_result_t poll_route_body(route_context_t* ctx, string_view_t* slice)
+{
+    handler_future_t* self = ctx->future;
+    read_stream_t* stream = &self->read_stream;
+    assert(self->streaming_body && "poll_route_body called for a route that doesn't stream");
+    self->waiting_for_body = false;
+
+    void* _r;
+    while (!stream->body_end_idx) {
+        // Same as `poll_read_body`, except that the pieces go to the handler one at a time
+        buffer_segment_t* segment = stream->chain.tail;
+        size_t segment_start = stream->chain.len - segment->len;
+        const char* p = segment->data + (stream->decoded - segment_start);
+        const char* data;
+        size_t len;
+        int taken = next_body_slice(self, &p, segment->data + segment->len, &data, &len);
+        if (taken < 0 || taken == BODY_TOO_LARGE) {
+            self->body_too_large = taken == BODY_TOO_LARGE;
+            return (async_result_t) { .result = POLL_READY, .value = (void*)-1 };
+        }
+        stream->decoded = segment_start + (p - segment->data);
+        if (taken > 0) {
+            stream->body_end_idx = stream->decoded;
+        }
+        if (len > 0) {
+            *slice = (string_view_t) { .data = (char*)data, .len = len };
+            return (async_result_t) { .result = POLL_READY, .value = (void*)0 };
+        }
+        if (taken > 0) {
+            break;
+        }
 
-    // How far we need to read the write_cursor up to ensure that the whole body is in
-    // our buffer:
-    size_t read_up_to = body_start + content_length;
+        // The handler is done with every piece of the segment, so it can take the next read
+        if (segment != stream->chain.head) {
+            stream->chain.len -= segment->len;
+            stream->decoded -= segment->len;
+            stream->discarded += segment->len;
+            segment->len = 0;
+        }
 
-    while (self->read_stream.write_cursor < read_up_to) {
-        void* _r;
-        ready(poll_read(self->fd, &self->read_stream), _r);
-        long ret_val = (long)_r;
-        if (ret_val < 0) {
+        self->waiting_for_body = true;
+        ready(poll_read_more(self), _r);
+        self->waiting_for_body = false;
+        if ((long)_r < 0) {
             return (async_result_t) { .result = POLL_READY, .value = (void*)-1 };
         }
-        self->read_stream.write_cursor += ret_val;
     }
 
-    // At this point the whole body is buffered in our read stream:
+    *slice = (string_view_t) { .data = NULL, .len = 0 };
+    return (async_result_t) { .result = POLL_READY, .value = (void*)0 };
+}
+
+static async_result_t not_found(route_context_t* ctx)
+{
+    response_write_canned(ctx->response, STATUS_NOT_FOUND);
     return (async_result_t) { .result = POLL_READY, .value = (void*)0 };
 }
 
+static async_result_t method_not_allowed(route_context_t* ctx)
+{
+    response_write_canned(ctx->response, STATUS_METHOD_NOT_ALLOWED);
+    return (async_result_t) { .result = POLL_READY, .value = (void*)0 };
+}
+
+async_result_t serve_files(route_context_t* ctx)
+{
+    if (!ctx->state) {
+        // The wildcard starts after the slash in front of it, which the file path needs back
+        string_view_t param = route_param(&ctx->match, "path");
+        if (!param.data) {
+            return not_found(ctx);
+        }
+        char* path = arena_alloc(ctx->arena, param.len + 1, 1);
+        path[0] = '/';
+        memcpy(path + 1, param.data, param.len);
+        ctx->state = fs_read_submit(ctx->arena, path, param.len + 1, ctx->fd);
+    }
+
+    fs_read_result_t* read_result;
+    ready(poll_fs_read(ctx->state), read_result);
+    if (!read_result) {
+        return not_found(ctx);
+    }
+
+    ctx->response->status = STATUS_OK;
+    response_write_header_str(ctx->response, "Content-Type", read_result->content_type);
+    response_write_header_int(ctx->response, "Content-Length", read_result->content_length);
+    if (read_result->fd >= 0) {
+        response_write_file(ctx->response, read_result->fd, read_result->content_length);
+    } else {
+        response_write_segment(ctx->response, read_result->segment);
+    }
+    return (async_result_t) { .result = POLL_READY, .value = (void*)0 };
+}
+
+// Picks the handler for the request, which is one that answers with an error when no route fits.
+// Only needs the headers, so that a route that streams its body can be polled before it arrives.
+static void route_request(handler_future_t* self)
+{
+    self->route = (route_context_t) {
+        .fd = self->fd,
+        .future = self,
+        .arena = self->arena,
+        .request = &self->request,
+        .body = &self->body,
+        .response = self->response,
+    };
+
+    router_result_t result = ROUTE_NOT_FOUND;
+    if (router) {
+        result = router_match(router, self->request.method, self->request.path, &self->route.match);
+    }
+    switch (result) {
+    case ROUTE_FOUND:
+        self->route_handler = self->route.match.route->handler;
+        self->streaming_body = self->route.match.route->stream_body;
+        break;
+    case ROUTE_METHOD_NOT_ALLOWED:
+        self->route_handler = method_not_allowed;
+        break;
+    case ROUTE_NOT_FOUND:
+        self->route_handler = not_found;
+        break;
+    }
+}
+
+// Answers the request with a canned error instead of serving it. The requests before it still get
+// their answers first, and the connection closes once it is written.
+static void reject_request(handler_future_t* self, http_status_t status)
+{
+    println("rejecting request from client %d with %d", self->fd, http_status_code(status));
+    response_write_canned(self->response, status);
+    self->state = HANDLER_WRITING;
+}
+
+// Whether to hold the response back for the next one to join it, which is worth it when the client
+// has sent some of the next request already. If the rest of it is slow to arrive, the response goes
+// out before we wait for it.
+static bool hold_output(handler_future_t* self)
+{
+    return self->read_stream.chain.len > self->read_stream.body_end_idx
+        && self->output.chain.len < MAX_HELD_OUTPUT;
+}
+
 async_result_t poll_handler_future(handler_future_t* self)
 {
     while (1) { // will be broken by the return statements in each state
@@ -440,7 +731,26 @@ async_result_t poll_handler_future(handler_future_t* self)
             if (ret_val < 0) {
                 return (async_result_t) { .result = POLL_READY, .value = (void*)-1 };
             }
-            parse_request(self);
+            if (ret_val == HEADERS_TOO_LARGE) {
+                reject_request(self, STATUS_HEADERS_TOO_LARGE);
+                break;
+            }
+            if (!parse_request(self) || !get_transfer_encoding(&self->request)) {
+                println("malformed request from client %d", self->fd);
+                reject_request(self, STATUS_BAD_REQUEST);
+                break;
+            }
+            http_status_t status = start_body(self);
+            if (status != STATUS_OK) {
+                reject_request(self, status);
+                break;
+            }
+            route_request(self);
+            if (self->streaming_body) {
+                pretty_print_request(self);
+                self->state = HANDLER_RUNNING_ROUTE;
+                break;
+            }
             self->state = HANDLER_READING_BODY;
             break;
         }
@@ -451,58 +761,51 @@ async_result_t poll_handler_future(handler_future_t* self)
             if (ret_val < 0) {
                 return (async_result_t) { .result = POLL_READY, .value = (void*)-1 };
             }
+            if (ret_val == BODY_TOO_LARGE) {
+                reject_request(self, STATUS_CONTENT_TOO_LARGE);
+                break;
+            }
             pretty_print_request(self);
-            fs_read_result_t* read_result
-                = fs_read(self->request.path.data, self->request.path.len);
-
-            self->read_result = read_result;
+            self->state = HANDLER_RUNNING_ROUTE;
+            break;
+        }
+        case HANDLER_RUNNING_ROUTE: {
+            void* _r;
+            ready(self->route_handler(&self->route), _r);
+            long ret_val = (long)_r;
+            if (ret_val < 0 && self->body_too_large) {
+                reject_request(self, STATUS_CONTENT_TOO_LARGE);
+                break;
+            }
+            if (ret_val < 0) {
+                return (async_result_t) { .result = POLL_READY, .value = (void*)-1 };
+            }
+            // The part of a streamed body that the handler didn't read is in the way of the next
+            // request
+            if (self->streaming_body && !self->read_stream.body_end_idx) {
+                response_write_header_str(self->response, "Connection", "close");
+                self->response->close = true;
+            }
             self->state = HANDLER_WRITING;
             break;
         }
         case HANDLER_WRITING: {
-            fs_read_result_t* read_result = self->read_result;
-            // TODO: return an actual error to the client (e.g. a 404)
-            if (!read_result) {
-                self->response->status_code = "404";
-                self->response->status_text = "Not Found";
-                response_write_header_str(self->response, "Content-Length", "0");
-                void* _r;
-                ready(poll_response_write_buffer(self->response, self->fd), _r);
-                long ret_val = (long)_r;
-
-                if (ret_val < 0) {
-                    return (async_result_t) { .result = POLL_READY, .value = (void*)-1 };
-                }
-            } else {
-                self->response->status_code = "200";
-                self->response->status_text = "OK";
-
-                response_write_header_str(
-                    self->response, "Content-Type", read_result->content_type);
-                response_write_header_int(
-                    self->response, "Content-Length", read_result->content_length);
-                response_write_body(
-                    self->response, read_result->buffer, read_result->content_length);
-
-                void* _r;
-                ready(poll_response_write_buffer(self->response, self->fd), _r);
-                long ret_val = (long)_r;
-
-                if (ret_val < 0) {
-                    return (async_result_t) { .result = POLL_READY, .value = (void*)-1 };
-                }
+            void* _r;
+            ready(poll_response_write_buffer(self->response, self->fd, hold_output(self)), _r);
+            long ret_val = (long)_r;
+            if (ret_val < 0) {
+                return (async_result_t) { .result = POLL_READY, .value = (void*)-1 };
             }
-
             self->state = HANDLER_DONE;
             break;
         }
         case HANDLER_DONE: {
+            handler_return_t next = self->response->close ? HANDLER_CLOSE : HANDLER_KEEPALIVE;
             // Now that we are done, we need to reset our state so that we can
             // handle the next request on the connection (if there is one):
-            // TODO: I think this is probably kinda sloppy, and we should probably be re-using the
-            // buffers, but for now I think it's easiest to just reset everything for each handler.
-            init_handler_future(self, self->fd);
-            return (async_result_t) { .result = POLL_READY, .value = (void*)HANDLER_KEEPALIVE };
+            reset_handler_future(self);
+            self->requests_served++;
+            return (async_result_t) { .result = POLL_READY, .value = (void*)next };
         }
         default: {
             assert(0 && "unreachable");
@@ -511,6 +814,46 @@ async_result_t poll_handler_future(handler_future_t* self)
     }
 }
 
+handler_timeout_t handler_timeout(handler_future_t* self, size_t* progress)
+{
+    *progress = 0;
+
+    switch (self->state) {
+    case HANDLER_READING_HEADERS:
+        *progress = self->read_stream.chain.len;
+        // A keepalive connection is idle until the first byte of the next request shows up. A new
+        // connection has to start sending its headers right away.
+        if (self->read_stream.chain.len == 0 && self->requests_served > 0) {
+            return TIMEOUT_IDLE;
+        }
+        return TIMEOUT_HEADERS;
+    case HANDLER_READING_BODY:
+        // While a write to the spool file is in flight the worker pool holds on to the body, like
+        // it does to a file read
+        if (self->body.writing) {
+            return TIMEOUT_NONE;
+        }
+        *progress = self->read_stream.chain.len + self->read_stream.discarded;
+        return TIMEOUT_BODY;
+    case HANDLER_WRITING:
+        *progress = self->output.bytes_written;
+        return TIMEOUT_WRITE;
+    case HANDLER_RUNNING_ROUTE:
+        // A handler that streams the body waits on the client for the rest of it like we do
+        if (self->waiting_for_body) {
+            *progress = self->read_stream.chain.len + self->read_stream.discarded;
+            return TIMEOUT_BODY;
+        }
+        return TIMEOUT_NONE;
+    default:
+        // While a route's handler runs, the worker pool may be holding on to it (for a file read,
+        // say), so the connection can't be closed under it. The work itself can't take forever.
+        return TIMEOUT_NONE;
+    }
+}
+
+bool handler_has_input(handler_future_t* self) { return self->read_stream.chain.len > 0; }
+
 /**
  ***************************************************************************************************
  * Tests
@@ -532,93 +875,965 @@ async_result_t poll_handler_future(handler_future_t* self)
         }                                                                                          \
     } while (0)
 
-static int test_header_insertion()
+// Responses are dated, so the tests pin the clock to a known time, see `handler_test_suite`
+#define TEST_NOW 784111777
+#define TEST_DATE "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+
+static int test_header_slots()
+{
+    request_t request = { 0 };
+    arena_t* arena = arena_create(1024);
+
+    char* buf = "content-LENGTH: 42";
+    add_header(arena, &request, (string_view_t) { buf, 14 }, (string_view_t) { buf + 16, 2 });
+    test_assert(request.known[HEADER_CONTENT_LENGTH] && request.other_count == 0,
+        "expected a known header to go into its slot");
+    test_assert(request_header(&request, "Content-Length") == request.known[HEADER_CONTENT_LENGTH],
+        "expected to find a known header whatever its case");
+    test_assert(get_content_length(&request) == 42, "expected the content length");
+
+    // Repeats of a known header are linked, in order
+    char* buf2 = "Accept: text/html";
+    char* buf3 = "ACCEPT: */*";
+    add_header(arena, &request, (string_view_t) { buf2, 6 }, (string_view_t) { buf2 + 8, 9 });
+    add_header(arena, &request, (string_view_t) { buf3, 6 }, (string_view_t) { buf3 + 8, 3 });
+    header_t* accept = request.known[HEADER_ACCEPT];
+    test_assert(accept && accept->value.data == buf2 + 8 && accept->next
+            && accept->next->value.data == buf3 + 8 && !accept->next->next,
+        "expected repeated headers to be linked in order");
+
+    // Unknown headers go into the array, which grows as needed
+    char* buf4 = "X-Custom-Header: yes";
+    for (int i = 0; i < OTHER_HEADERS_SIZE + 1; i++) {
+        add_header(arena, &request, (string_view_t) { buf4, 15 }, (string_view_t) { buf4 + 17, 3 });
+    }
+    test_assert(request.other_count == OTHER_HEADERS_SIZE + 1, "expected every unknown header");
+    test_assert(request_header(&request, "x-custom-header") == &request.other[0],
+        "expected to find an unknown header whatever its case");
+    test_assert(request_header(&request, "X-Custom") == NULL, "expected a prefix not to match");
+    test_assert(request_header(&request, "Host") == NULL, "expected a missing header to be NULL");
+
+    arena_release(arena);
+    return 0;
+}
+
+static int test_content_length()
+{
+    request_t request = { 0 };
+    arena_t* arena = arena_create(1024);
+    char* key = "Content-Length";
+    char* values[] = { "0", "abc", "12x", "" };
+    long expected[] = { 0, -1, -1, -1 };
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+        bzero(&request, sizeof(request));
+        add_header(arena, &request, (string_view_t) { key, 14 },
+            (string_view_t) { values[i], strlen(values[i]) });
+        test_assert(get_content_length(&request) == expected[i], "unexpected content length");
+    }
+
+    // Two lengths are one too many
+    add_header(arena, &request, (string_view_t) { key, 14 }, (string_view_t) { "5", 1 });
+    add_header(arena, &request, (string_view_t) { key, 14 }, (string_view_t) { "5", 1 });
+    request.content_length = 0;
+    test_assert(get_content_length(&request) == -1, "expected repeated lengths to be rejected");
+
+    arena_release(arena);
+    return 0;
+}
+
+static int test_headers_in_pieces()
+{
+    int fds[2];
+    test_assert(pipe(fds) == 0 && fcntl(fds[0], F_SETFL, O_NONBLOCK) == 0,
+        "failed to create a pipe");
+    handler_future_t* future = new_handler_future(fds[0]);
+
+    // The empty line is split between the two writes
+    char* first = "GET / HTTP/1.1\r\nHost: x\r\n\r";
+    char* second = "\nbody";
+    test_assert(write(fds[1], first, strlen(first)) == (ssize_t)strlen(first),
+        "failed to write the first piece");
+    test_assert(poll_read_headers(future).result == POLL_PENDING,
+        "expected to wait for the rest of the headers");
+    test_assert(future->read_stream.scanned == strlen(first),
+        "expected the scan to remember how far it got");
+
+    test_assert(write(fds[1], second, strlen(second)) == (ssize_t)strlen(second),
+        "failed to write the second piece");
+    async_result_t r = poll_read_headers(future);
+    test_assert(r.result == POLL_READY && r.value == 0, "expected the headers to be read");
+    test_assert(future->read_stream.body_start_idx == strlen(first) + 1,
+        "expected the body to start right after the empty line");
+
+    free_handler_future(future);
+    close(fds[0]);
+    close(fds[1]);
+    return 0;
+}
+
+static bool parses(char* head, request_t* request)
+{
+    bzero(request, sizeof(request_t));
+    arena_t* arena = arena_create(1024);
+    bool ok = parse_request_head(arena, head, strlen(head), request);
+    arena_release(arena);
+    return ok;
+}
+
+static int test_parse_request_head()
 {
-    // Scenario 1: inserting a header into an empty request
-    char* buf = "Accept: text/html";
     request_t request;
-    request.headers = NULL;
-    header_t header;
-    bzero(&header, sizeof(header_t));
-
-    header.key.data = buf;
-    header.key.len = 6;
-
-    header.value.name.data = buf + 8;
-    header.value.name.len = 9;
-
-    insert_header(&request, &header);
-    test_assert(strncmp(request.headers->key.data, "Accept", request.headers->key.len) == 0,
-        "header key should be Accept");
-    test_assert(get_header(&request, "Accept") == &header,
-        "expected get_header to return pointer to original header");
-
-    // Scenario 2: inserting another header into the request
-    char* buf2 = "Content-Type: text/plain";
-    header_t header2;
-    bzero(&header2, sizeof(header_t));
-    header2.key.data = buf2;
-    header2.key.len = 12;
-
-    header2.value.name.data = buf2 + 14;
-    header2.value.name.len = 10;
-
-    insert_header(&request, &header2);
-    test_assert(get_header(&request, "Content-Type") == &header2,
-        "expected get_header to return pointer to original header");
-
-    // Scenario 3: inserting a header that already exists (array of values)
-    char* buf3 = "Content-Type: something-else";
-    header_t header3;
-    bzero(&header3, sizeof(header_t));
-    header3.key.data = buf3;
-    header3.key.len = 12;
-
-    header3.value.name.data = buf2 + 14;
-    header3.value.name.len = 14;
-
-    insert_header(&request, &header3);
-    test_assert(get_header(&request, "Content-Type") == &header2,
-        "expected get_header to return pointer to original header");
-    test_assert(header2.value.next == &header3.value,
-        "expected insert_header to place additonal values in header2 linked list");
+    test_assert(parses("GET /index.html HTTP/1.1\r\n"
+                       "Host: localhost:8080\r\n"
+                       "Accept:text/html \r\n"
+                       "Accept: */*\r\n"
+                       "\r\n",
+                    &request),
+        "expected a valid request to parse");
+    test_assert(string_view_equals(request.method, (string_view_t) { "GET", 3 })
+            && string_view_equals(request.path, (string_view_t) { "/index.html", 11 })
+            && string_view_equals(request.version, (string_view_t) { "HTTP/1.1", 8 }),
+        "expected the request line to be split at its spaces");
+
+    header_t* host = request.known[HEADER_HOST];
+    test_assert(host && string_view_equals(host->value, (string_view_t) { "localhost:8080", 14 }),
+        "expected only the first colon to end the header name");
+    header_t* accept = request.known[HEADER_ACCEPT];
+    test_assert(accept && string_view_equals(accept->value, (string_view_t) { "text/html", 9 })
+            && accept->next
+            && string_view_equals(accept->next->value, (string_view_t) { "*/*", 3 }),
+        "expected optional whitespace to be trimmed and repeated headers to be linked");
+
+    test_assert(parses("GET / HTTP/1.0\r\n\r\n", &request) && request.known[HEADER_HOST] == NULL
+            && request.other_count == 0,
+        "expected a request without headers to parse");
+
+    test_assert(!parses("GET /\r\n\r\n", &request), "expected a missing version to fail");
+    test_assert(!parses("GET / HTTP/1.1\r\nHost\r\n\r\n", &request),
+        "expected a header without a colon to fail");
+    test_assert(!parses("GET / HTTP/1.1\r\n: nameless\r\n\r\n", &request),
+        "expected a header without a name to fail");
+    test_assert(!parses("GET / HTTP/1.1\r\nHost: x\r\n", &request),
+        "expected a request without the empty line to fail");
+    return 0;
+}
+
+static int test_future_pool()
+{
+    handler_future_t* first = new_handler_future(10);
+    arena_t* arena = first->arena;
+
+    // leave some state behind, like a finished request would
+    first->state = HANDLER_DONE;
+    first->requests_served = 3;
+    buffer_chain_append(&first->read_stream.chain, "GET / HTTP/1.1\r\n", 16);
+    first->read_stream.data = first->read_stream.chain.head->data;
+    arena_alloc(first->arena, 64, 8);
+    size_t segments_in_use = buffer_get_stats().in_use;
+
+    free_handler_future(first);
+    handler_future_t* second = new_handler_future(11);
+    test_assert(second == first, "expected the freed future to be reused");
+    test_assert(second->fd == 11, "expected the reused future to have the new fd");
+    test_assert(second->arena == arena, "expected the arena to be reused");
+    test_assert(second->read_stream.chain.head == NULL && second->read_stream.data == NULL
+            && buffer_get_stats().in_use == segments_in_use - 1,
+        "expected the read buffer to go back to the pool");
+    test_assert(second->state == HANDLER_READING_HEADERS && second->requests_served == 0
+            && second->read_stream.chain.len == 0,
+        "expected the reused future to be reset");
+
+    free_handler_future(second);
+    return 0;
+}
+
+static int test_body_across_segments()
+{
+    int fds[2];
+    test_assert(pipe(fds) == 0, "failed to create a pipe");
+
+    // A body that needs several segments, written in one go so that every read finds data
+    char* headers = "POST /upload HTTP/1.1\r\nContent-Length: 40000\r\n\r\n";
+    size_t body_len = 40000;
+    char* body = malloc(body_len);
+    for (size_t i = 0; i < body_len; i++) {
+        body[i] = 'a' + i % 26;
+    }
+    test_assert(write(fds[1], headers, strlen(headers)) == (ssize_t)strlen(headers)
+            && write(fds[1], body, body_len) == (ssize_t)body_len,
+        "failed to write the request");
+
+    handler_future_t* future = new_handler_future(fds[0]);
+    async_result_t r = poll_read_headers(future);
+    test_assert(r.result == POLL_READY && r.value == 0, "expected the headers to be read");
+    test_assert(parse_request(future) && start_body(future) == STATUS_OK,
+        "expected the request to parse");
+    r = poll_read_body(future);
+    test_assert(r.result == POLL_READY && r.value == 0, "expected the body to be read");
+
+    // The body went through a single segment after the one with the headers
+    read_stream_t* stream = &future->read_stream;
+    test_assert(stream->chain.head->next == stream->chain.tail && stream->discarded > 0,
+        "expected the read buffer to be reused for the body");
+    test_assert(string_view_equals(future->request.path, (string_view_t) { "/upload", 7 }),
+        "expected views into the headers to survive reading the body");
+
+    test_assert(!future->body.spooling && future->body.len == body_len,
+        "expected the whole body, in memory");
+    size_t checked = 0;
+    for (buffer_segment_t* segment = future->body.chain.head; segment; segment = segment->next) {
+        test_assert(memcmp(segment->data, body + checked, segment->len) == 0, "body got mangled");
+        checked += segment->len;
+    }
+    test_assert(checked == body_len, "expected the whole body");
 
+    free_handler_future(future);
+    free(body);
+    close(fds[0]);
+    close(fds[1]);
     return 0;
 }
 
-static int test_string_search()
+static int test_pipelined_requests()
 {
-    char* haystack = "hello world";
-    char* needle = "world";
+    int fds[2];
+    test_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0
+            && fcntl(fds[0], F_SETFL, O_NONBLOCK) == 0,
+        "failed to create a socket pair");
+
+    // Both requests arrive in one go, the second one with a body
+    char* requests = "GET /first HTTP/1.1\r\n\r\n"
+                     "POST /second HTTP/1.1\r\nContent-Length: 4\r\n\r\nbody";
+    test_assert(write(fds[1], requests, strlen(requests)) == (ssize_t)strlen(requests),
+        "failed to write the requests");
+
+    handler_future_t* future = new_handler_future(fds[0]);
+    async_result_t r = poll_read_headers(future);
+    test_assert(r.result == POLL_READY && r.value == 0 && parse_request(future),
+        "expected the first request to be read");
+    test_assert(string_view_equals(future->request.path, (string_view_t) { "/first", 6 }),
+        "expected the first request first");
+    test_assert(start_body(future) == STATUS_OK, "expected the first request to have no body");
+    r = poll_read_body(future);
     test_assert(
-        boyer_moore_search(haystack, needle) == 6, "boyer_moore_search(haystack, needle) == 6");
+        r.result == POLL_READY && r.value == 0, "expected the first request to have no body");
+    test_assert(hold_output(future), "expected to hold the response for the second request");
+
+    // The first response is held back, and goes out along with the second one
+    response_write_header_str(future->response, "Content-Length", "0");
+    future->response->status = STATUS_NO_CONTENT;
+    r = poll_response_write_buffer(future->response, fds[0], true);
+    test_assert(r.result == POLL_READY && future->output.bytes_written == 0,
+        "expected the held response not to be written");
+
+    // The second request is already here, with nothing left to read from the socket
+    reset_handler_future(future);
+    test_assert(handler_has_input(future), "expected the second request to be buffered");
+    r = poll_read_headers(future);
+    test_assert(r.result == POLL_READY && r.value == 0 && parse_request(future),
+        "expected the second request to be read without waiting");
+    test_assert(string_view_equals(future->request.path, (string_view_t) { "/second", 7 }),
+        "expected the second request second");
+    test_assert(start_body(future) == STATUS_OK, "expected the second request to have a body");
+    r = poll_read_body(future);
+    test_assert(r.result == POLL_READY && r.value == 0 && !hold_output(future),
+        "expected the body to be buffered, and nothing after it");
+
+    response_write_header_str(future->response, "Content-Length", "0");
+    future->response->status = STATUS_CREATED;
+    r = poll_response_write_buffer(future->response, fds[0], false);
+    test_assert(r.result == POLL_READY && r.value == 0, "expected the responses to be written");
+
+    char buf[256];
+    char* expected = "HTTP/1.1 204 No Content\r\n" TEST_DATE "Content-Length: 0\r\n\r\n"
+                     "HTTP/1.1 201 Created\r\n" TEST_DATE "Content-Length: 0\r\n\r\n";
+    ssize_t n = read(fds[1], buf, sizeof(buf));
+    test_assert(n == (ssize_t)strlen(expected) && memcmp(buf, expected, n) == 0,
+        "expected both responses in a single write");
+
+    reset_handler_future(future);
+    test_assert(!handler_has_input(future) && future->read_stream.chain.head == NULL,
+        "expected nothing to be left over after the last request");
+
+    free_handler_future(future);
+    close(fds[0]);
+    close(fds[1]);
+    return 0;
+}
+
+static int test_response_body_not_copied()
+{
+    int fds[2];
+    test_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0
+            && fcntl(fds[0], F_SETFL, O_NONBLOCK) == 0,
+        "failed to create a socket pair");
+
+    // More than the socket takes in one go, so the write has to pick up where it left off
+    size_t body_len = 1024 * 1024;
+    char* body = malloc(body_len);
+    for (size_t i = 0; i < body_len; i++) {
+        body[i] = 'a' + i % 26;
+    }
 
-    haystack = "hello world";
-    needle = "hello";
+    handler_future_t* future = new_handler_future(fds[0]);
+    future->response->status = STATUS_OK;
+    response_write_header_int(future->response, "Content-Length", body_len);
+    response_write_body(future->response, body, body_len);
+
+    char* head = "HTTP/1.1 200 OK\r\n" TEST_DATE "Content-Length: 1048576\r\n\r\n";
+    size_t total = strlen(head) + body_len;
+    char* received = malloc(total);
+    size_t received_len = 0;
+    async_result_t r = poll_response_write_buffer(future->response, fds[0], false);
+    test_assert(future->output.chain.len <= strlen(head),
+        "expected only the status line and headers to be copied");
+    while (r.result == POLL_PENDING) {
+        test_assert(future->output.body + future->output.body_len == body + body_len,
+            "expected the rest of the body to be written from where it is");
+        ssize_t n = read(fds[1], received + received_len, total - received_len);
+        test_assert(n > 0, "failed to read the response");
+        received_len += n;
+        r = poll_response_write_buffer(future->response, fds[0], false);
+    }
     test_assert(
-        boyer_moore_search(haystack, needle) == 0, "boyer_moore_search(haystack, needle) == 0");
+        r.value == 0 && future->output.body_len == 0, "expected the response to be written");
+    while (received_len < total) {
+        ssize_t n = read(fds[1], received + received_len, total - received_len);
+        test_assert(n > 0, "failed to read the response");
+        received_len += n;
+    }
+    test_assert(memcmp(received, head, strlen(head)) == 0
+            && memcmp(received + strlen(head), body, body_len) == 0
+            && future->output.bytes_written == total,
+        "expected the whole response, in order");
+
+    free_handler_future(future);
+    free(received);
+    free(body);
+    close(fds[0]);
+    close(fds[1]);
+    return 0;
+}
 
-    haystack = "hello world";
-    needle = "not found";
+static int test_file_response()
+{
+    int fds[2];
+    test_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0
+            && fcntl(fds[0], F_SETFL, O_NONBLOCK) == 0,
+        "failed to create a socket pair");
+
+    // A file that takes more than one send, behind a response that was held back before it
+    char path[] = "/tmp/c-http-test-XXXXXX";
+    int file_fd = mkstemp(path);
+    test_assert(file_fd >= 0, "failed to create a temp file");
+    unlink(path);
+    size_t file_len = 1024 * 1024;
+    char* contents = malloc(file_len);
+    for (size_t i = 0; i < file_len; i++) {
+        contents[i] = 'a' + i % 26;
+    }
     test_assert(
-        boyer_moore_search(haystack, needle) == -1, "boyer_moore_search(haystack, needle) == -1");
+        write(file_fd, contents, file_len) == (ssize_t)file_len, "failed to write the file");
+
+    handler_future_t* future = new_handler_future(fds[0]);
+    future->response->status = STATUS_NO_CONTENT;
+    async_result_t r = poll_response_write_buffer(future->response, fds[0], true);
+    test_assert(r.result == POLL_READY && future->output.bytes_written == 0,
+        "expected the first response to be held");
+    reset_handler_future(future);
+
+    future->response->status = STATUS_OK;
+    response_write_header_int(future->response, "Content-Length", file_len);
+    response_write_file(future->response, file_fd, file_len);
+
+    char* head = "HTTP/1.1 204 No Content\r\n" TEST_DATE "\r\n"
+                 "HTTP/1.1 200 OK\r\n" TEST_DATE "Content-Length: 1048576\r\n\r\n";
+    size_t total = strlen(head) + file_len;
+    char* received = malloc(total);
+    size_t received_len = 0;
+    r = poll_response_write_buffer(future->response, fds[0], true);
+    test_assert(future->output.chain.len <= strlen(head),
+        "expected only the status lines and headers to be copied");
+    while (r.result == POLL_PENDING || received_len < total) {
+        ssize_t n = read(fds[1], received + received_len, total - received_len);
+        test_assert(n > 0, "failed to read the response");
+        received_len += n;
+        if (r.result == POLL_PENDING) {
+            r = poll_response_write_buffer(future->response, fds[0], true);
+        }
+    }
+    test_assert(r.value == 0 && memcmp(received, head, strlen(head)) == 0
+            && memcmp(received + strlen(head), contents, file_len) == 0,
+        "expected both responses, with the file in full");
+    test_assert(future->output.file_len == 0 && fcntl(file_fd, F_GETFD) == -1,
+        "expected the file to be closed once it was sent");
+
+    free_handler_future(future);
+    free(received);
+    free(contents);
+    close(fds[0]);
+    close(fds[1]);
+    return 0;
+}
+
+// Pending the first time it is polled, like a handler that waits on the worker pool
+static async_result_t test_item_handler(route_context_t* ctx)
+{
+    if (!ctx->state) {
+        ctx->state = ctx;
+        return (async_result_t) { .result = POLL_PENDING, .value = NULL };
+    }
+
+    string_view_t id = route_param(&ctx->match, "id");
+    char* body = arena_alloc(ctx->arena, 5 + id.len, 1);
+    memcpy(body, "item ", 5);
+    memcpy(body + 5, id.data, id.len);
+    ctx->response->status = STATUS_OK;
+    response_write_header_int(ctx->response, "Content-Length", 5 + id.len);
+    response_write_body(ctx->response, body, 5 + id.len);
+    return (async_result_t) { .result = POLL_READY, .value = (void*)0 };
+}
+
+static int test_routed_requests()
+{
+    router_t routes;
+    router_init(&routes);
+    test_assert(router_add(&routes, "GET", "/items/:id", test_item_handler, NULL),
+        "expected the route to be added");
+    handler_set_router(&routes);
+
+    int fds[2];
+    test_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0
+            && fcntl(fds[0], F_SETFL, O_NONBLOCK) == 0,
+        "failed to create a socket pair");
+    char* requests = "GET /items/42?full=1 HTTP/1.1\r\n\r\n"
+                     "DELETE /items/42 HTTP/1.1\r\n\r\n"
+                     "GET /other HTTP/1.1\r\n\r\n";
+    test_assert(write(fds[1], requests, strlen(requests)) == (ssize_t)strlen(requests),
+        "failed to write the requests");
+
+    handler_future_t* future = new_handler_future(fds[0]);
+    async_result_t r = poll_handler_future(future);
+    test_assert(r.result == POLL_PENDING && future->state == HANDLER_RUNNING_ROUTE,
+        "expected to wait for the route's handler");
+    for (int i = 0; i < 3; i++) {
+        r = poll_handler_future(future);
+        test_assert(r.result == POLL_READY && (long)r.value == HANDLER_KEEPALIVE,
+            "expected the request to be answered");
+    }
+
+    char buf[512];
+    char* expected = "HTTP/1.1 200 OK\r\n" TEST_DATE "Content-Length: 7\r\n\r\nitem 42"
+                     "HTTP/1.1 405 Method Not Allowed\r\n" TEST_DATE "Content-Length: 0\r\n\r\n"
+                     "HTTP/1.1 404 Not Found\r\n" TEST_DATE "Content-Length: 0\r\n\r\n";
+    ssize_t n = read(fds[1], buf, sizeof(buf));
+    test_assert(n == (ssize_t)strlen(expected) && memcmp(buf, expected, n) == 0,
+        "expected the route's response, then a 405 and a 404");
+
+    handler_set_router(NULL);
+    router_free(&routes);
+    free_handler_future(future);
+    close(fds[0]);
+    close(fds[1]);
+    return 0;
+}
+
+// Collects the body of an upload a piece at a time as it arrives, and answers with it. A body that
+// doesn't fit is only counted, and answered with an empty response.
+typedef struct test_upload_t {
+    char data[64];
+    size_t len;
+} test_upload_t;
+
+static async_result_t test_upload_handler(route_context_t* ctx)
+{
+    test_upload_t* upload = ctx->state;
+    if (!upload) {
+        upload = arena_alloc(ctx->arena, sizeof(test_upload_t), alignof(test_upload_t));
+        upload->len = 0;
+        ctx->state = upload;
+    }
+
+    while (1) {
+        string_view_t slice;
+        void* _r;
+        ready(poll_route_body(ctx, &slice), _r);
+        if ((long)_r < 0) {
+            return (async_result_t) { .result = POLL_READY, .value = (void*)-1 };
+        }
+        if (slice.len == 0) {
+            break;
+        }
+        if (upload->len + slice.len <= sizeof(upload->data)) {
+            memcpy(upload->data + upload->len, slice.data, slice.len);
+        }
+        upload->len += slice.len;
+    }
+
+    ctx->response->status = STATUS_OK;
+    size_t len = upload->len <= sizeof(upload->data) ? upload->len : 0;
+    response_write_header_int(ctx->response, "Content-Length", len);
+    response_write_body(ctx->response, upload->data, len);
+    return (async_result_t) { .result = POLL_READY, .value = (void*)0 };
+}
+
+static int test_streamed_body()
+{
+    router_t routes;
+    router_init(&routes);
+    test_assert(router_add_streaming(&routes, "POST", "/upload", test_upload_handler, NULL),
+        "expected the route to be added");
+    handler_set_router(&routes);
+
+    int fds[2];
+    test_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0
+            && fcntl(fds[0], F_SETFL, O_NONBLOCK) == 0,
+        "failed to create a socket pair");
+
+    // The handler gets the first chunk before the rest of the body has been sent
+    char* first = "POST /upload HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nhello\r\n";
+    test_assert(write(fds[1], first, strlen(first)) == (ssize_t)strlen(first),
+        "failed to write the start of the request");
+    handler_future_t* future = new_handler_future(fds[0]);
+    async_result_t r = poll_handler_future(future);
+    test_assert(r.result == POLL_PENDING && future->state == HANDLER_RUNNING_ROUTE,
+        "expected the handler to be waiting for the rest of the body");
+    test_assert(((test_upload_t*)future->route.state)->len == 5 && future->body.len == 0,
+        "expected the handler to have the first chunk, and the body to be left empty");
+    size_t progress;
+    test_assert(handler_timeout(future, &progress) == TIMEOUT_BODY,
+        "expected the body timeout to apply while the handler waits for the body");
+
+    char* rest = "6\r\n world\r\n0\r\n\r\nGET /next HTTP/1.1\r\n\r\n";
+    test_assert(write(fds[1], rest, strlen(rest)) == (ssize_t)strlen(rest),
+        "failed to write the rest of the requests");
+    for (int i = 0; i < 2; i++) {
+        r = poll_handler_future(future);
+        test_assert(r.result == POLL_READY && (long)r.value == HANDLER_KEEPALIVE,
+            "expected the request to be answered");
+    }
+
+    char buf[512];
+    char* expected = "HTTP/1.1 200 OK\r\n" TEST_DATE "Content-Length: 11\r\n\r\nhello world"
+                     "HTTP/1.1 404 Not Found\r\n" TEST_DATE "Content-Length: 0\r\n\r\n";
+    ssize_t n = read(fds[1], buf, sizeof(buf));
+    test_assert(n == (ssize_t)strlen(expected) && memcmp(buf, expected, n) == 0,
+        "expected the streamed body back, then a 404 for the request after it");
+    free_handler_future(future);
+
+    // Many times more body than a segment holds, which goes through the read stream without
+    // piling up there
+    char* headers = "POST /upload HTTP/1.1\r\nContent-Length: 1000000\r\n\r\n";
+    test_assert(write(fds[1], headers, strlen(headers)) == (ssize_t)strlen(headers),
+        "failed to write the headers");
+    future = new_handler_future(fds[0]);
+    char chunk[10000];
+    memset(chunk, 'x', sizeof(chunk));
+    for (int i = 0; i < 100; i++) {
+        test_assert(write(fds[1], chunk, sizeof(chunk)) == sizeof(chunk), "failed to write");
+        r = poll_handler_future(future);
+        if (i == 99) {
+            break;
+        }
+        test_assert(r.result == POLL_PENDING
+                && ((test_upload_t*)future->route.state)->len == (i + 1) * sizeof(chunk),
+            "expected the handler to have all of the body sent so far");
+        test_assert(future->read_stream.chain.head->next == future->read_stream.chain.tail
+                || future->read_stream.chain.head == future->read_stream.chain.tail,
+            "expected the body to take a single segment of the read stream at most");
+    }
+    test_assert(r.result == POLL_READY && (long)r.value == HANDLER_KEEPALIVE,
+        "expected the request to be answered");
+    expected = "HTTP/1.1 200 OK\r\n" TEST_DATE "Content-Length: 0\r\n\r\n";
+    n = read(fds[1], buf, sizeof(buf));
+    test_assert(n == (ssize_t)strlen(expected) && memcmp(buf, expected, n) == 0,
+        "expected an empty response");
+    free_handler_future(future);
+
+    // A streamed body past the limit is turned away too
+    body_configure(BODY_SPOOL_THRESHOLD, 8, "/tmp");
+    char* too_large = "POST /upload HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"
+                      "9\r\nabcdefghi\r\n";
+    test_assert(write(fds[1], too_large, strlen(too_large)) == (ssize_t)strlen(too_large),
+        "failed to write the request");
+    future = new_handler_future(fds[0]);
+    r = poll_handler_future(future);
+    test_assert(r.result == POLL_READY && (long)r.value == HANDLER_CLOSE,
+        "expected the connection to be closed");
+    expected = "HTTP/1.1 413 Content Too Large\r\n" TEST_DATE "Connection: close\r\n"
+               "Content-Length: 0\r\n\r\n";
+    n = read(fds[1], buf, sizeof(buf));
+    test_assert(n == (ssize_t)strlen(expected) && memcmp(buf, expected, n) == 0,
+        "expected a 413");
+    body_configure(BODY_SPOOL_THRESHOLD, BODY_MAX_SIZE, "/tmp");
+
+    handler_set_router(NULL);
+    router_free(&routes);
+    free_handler_future(future);
+    close(fds[0]);
+    close(fds[1]);
+    return 0;
+}
+
+static int test_serve_files()
+{
+    router_t routes;
+    router_init(&routes);
+    test_assert(router_add(&routes, NULL, "/*path", serve_files, NULL),
+        "expected the route to be added");
+    handler_set_router(&routes);
+
+    int fds[2];
+    test_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0
+            && fcntl(fds[0], F_SETFL, O_NONBLOCK) == 0,
+        "failed to create a socket pair");
+
+    // The query string isn't part of the file's path
+    char* requests = "GET /style.css?v=3 HTTP/1.1\r\n\r\n"
+                     "GET /missing.css?v=3 HTTP/1.1\r\n\r\n";
+    test_assert(write(fds[1], requests, strlen(requests)) == (ssize_t)strlen(requests),
+        "failed to write the requests");
+    size_t segments_in_use = buffer_get_stats().in_use;
+    handler_future_t* future = new_handler_future(fds[0]);
+    for (int i = 0; i < 2; i++) {
+        async_result_t r;
+        do {
+            r = poll_handler_future(future);
+        } while (r.result == POLL_PENDING);
+        test_assert((long)r.value == HANDLER_KEEPALIVE, "expected the request to be answered");
+    }
+
+    char file[4096];
+    FILE* f = fopen("data/style.css", "r");
+    test_assert(f, "failed to open data/style.css");
+    size_t file_len = fread(file, 1, sizeof(file), f);
+    fclose(f);
+
+    char expected[8192];
+    size_t expected_len = snprintf(expected, sizeof(expected),
+        "HTTP/1.1 200 OK\r\n" TEST_DATE "Content-Type: text/css\r\nContent-Length: %zu\r\n\r\n",
+        file_len);
+    memcpy(expected + expected_len, file, file_len);
+    expected_len += file_len;
+    char* not_found = "HTTP/1.1 404 Not Found\r\n" TEST_DATE "Content-Length: 0\r\n\r\n";
+    memcpy(expected + expected_len, not_found, strlen(not_found));
+    expected_len += strlen(not_found);
+
+    char buf[8192];
+    size_t n = 0;
+    ssize_t r;
+    while (n < expected_len && (r = read(fds[1], buf + n, sizeof(buf) - n)) > 0) {
+        n += r;
+    }
+    test_assert(n == expected_len && memcmp(buf, expected, n) == 0,
+        "expected the file, then a 404");
+
+    handler_set_router(NULL);
+    router_free(&routes);
+    free_handler_future(future);
+    test_assert(buffer_get_stats().in_use == segments_in_use,
+        "expected the segments the files were read into to be back in the pool");
+    close(fds[0]);
+    close(fds[1]);
+    return 0;
+}
+
+static int test_rejected_requests()
+{
+    int fds[2];
+    test_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0
+            && fcntl(fds[0], F_SETFL, O_NONBLOCK) == 0,
+        "failed to create a socket pair");
+
+    // The request before the malformed one still gets its answer, which is held back for the 400
+    // to join it
+    char* requests = "GET /a HTTP/1.1\r\n\r\n"
+                     "GET /b HTTP/1.1\r\nContent-Length: abc\r\n\r\n"
+                     "GET /c HTTP/1.1\r\n\r\n";
+    test_assert(write(fds[1], requests, strlen(requests)) == (ssize_t)strlen(requests),
+        "failed to write the requests");
+    handler_future_t* future = new_handler_future(fds[0]);
+    async_result_t r = poll_handler_future(future);
+    test_assert(r.result == POLL_READY && (long)r.value == HANDLER_KEEPALIVE,
+        "expected the first request to be answered");
+    r = poll_handler_future(future);
+    test_assert(r.result == POLL_READY && (long)r.value == HANDLER_CLOSE,
+        "expected the malformed request to close the connection");
+
+    char buf[512];
+    char* expected = "HTTP/1.1 404 Not Found\r\n" TEST_DATE "Content-Length: 0\r\n\r\n"
+                     "HTTP/1.1 400 Bad Request\r\n" TEST_DATE
+                     "Connection: close\r\nContent-Length: 0\r\n\r\n";
+    ssize_t n = read(fds[1], buf, sizeof(buf));
+    test_assert(n == (ssize_t)strlen(expected) && memcmp(buf, expected, n) == 0,
+        "expected a 404, then a 400");
+    free_handler_future(future);
+
+    // Headers that don't fit into a segment
+    char headers[BUFFER_SEGMENT_CAP + 100];
+    memset(headers, 'a', sizeof(headers));
+    memcpy(headers, "GET / HTTP/1.1\r\nX-Long: ", 25);
+    test_assert(write(fds[1], headers, sizeof(headers)) == sizeof(headers),
+        "failed to write the headers");
+    future = new_handler_future(fds[0]);
+    do {
+        r = poll_handler_future(future);
+    } while (r.result == POLL_PENDING);
+    test_assert((long)r.value == HANDLER_CLOSE, "expected the connection to be closed");
+    expected = "HTTP/1.1 431 Request Header Fields Too Large\r\n" TEST_DATE "Connection: close\r\n"
+               "Content-Length: 0\r\n\r\n";
+    n = read(fds[1], buf, sizeof(buf));
+    test_assert(n == (ssize_t)strlen(expected) && memcmp(buf, expected, n) == 0,
+        "expected a 431");
+
+    free_handler_future(future);
+
+    // Bodies past the limit, whether the length says so up front or the chunks only add up to it
+    // as they arrive
+    body_configure(BODY_SPOOL_THRESHOLD, 8, "/tmp");
+    char* too_large[] = {
+        "POST / HTTP/1.1\r\nContent-Length: 9\r\n\r\n",
+        "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nabcde\r\n4\r\nfghi\r\n",
+    };
+    expected = "HTTP/1.1 413 Content Too Large\r\n" TEST_DATE "Connection: close\r\n"
+               "Content-Length: 0\r\n\r\n";
+    for (int i = 0; i < 2; i++) {
+        ssize_t len = strlen(too_large[i]);
+        test_assert(write(fds[1], too_large[i], len) == len, "failed to write the request");
+        future = new_handler_future(fds[0]);
+        r = poll_handler_future(future);
+        test_assert(r.result == POLL_READY && (long)r.value == HANDLER_CLOSE,
+            "expected the connection to be closed");
+        n = read(fds[1], buf, sizeof(buf));
+        test_assert(n == (ssize_t)strlen(expected) && memcmp(buf, expected, n) == 0,
+            "expected a 413");
+        free_handler_future(future);
+    }
+    body_configure(BODY_SPOOL_THRESHOLD, BODY_MAX_SIZE, "/tmp");
+    close(fds[0]);
+    close(fds[1]);
+    return 0;
+}
+
+static int test_chunked_body()
+{
+    int fds[2];
+    test_assert(pipe(fds) == 0 && fcntl(fds[0], F_SETFL, O_NONBLOCK) == 0,
+        "failed to create a pipe");
+
+    char* headers = "POST /upload HTTP/1.1\r\nTransfer-Encoding: Chunked\r\n\r\n";
+    test_assert(write(fds[1], headers, strlen(headers)) == (ssize_t)strlen(headers),
+        "failed to write the headers");
+
+    handler_future_t* future = new_handler_future(fds[0]);
+    async_result_t r = poll_read_headers(future);
+    test_assert(r.result == POLL_READY && r.value == 0 && parse_request(future)
+            && get_transfer_encoding(&future->request) && future->request.chunked
+            && start_body(future) == STATUS_OK,
+        "expected a chunked request");
+
+    // Many times more body than a segment holds, in chunks that straddle the reads, with the
+    // reader keeping up with the writer
+    char chunk[3000];
+    size_t header_len = sprintf(chunk, "%zx;ext=1\r\n", sizeof(chunk) - 20);
+    memset(chunk + header_len, 'x', sizeof(chunk) - 20);
+    memcpy(chunk + header_len + sizeof(chunk) - 20, "\r\n", 2);
+    size_t chunk_len = header_len + sizeof(chunk) - 18;
+
+    for (int i = 0; i < 100; i++) {
+        test_assert(write(fds[1], chunk, chunk_len) == (ssize_t)chunk_len, "failed to write");
+        r = poll_read_body(future);
+        test_assert(r.result == POLL_PENDING, "expected to wait for the rest of the body");
+        test_assert(future->read_stream.chain.head->next == future->read_stream.chain.tail
+                || future->read_stream.chain.head == future->read_stream.chain.tail,
+            "expected the body to take a single segment of the read stream at most");
+        test_assert(future->body.chain.len <= BODY_SPOOL_THRESHOLD + BUFFER_SEGMENT_CAP,
+            "expected the body to be spooled rather than kept in memory");
+    }
+
+    char* last = "0\r\nChecksum: none\r\n\r\nGET /next HTTP/1.1\r\n\r\n";
+    test_assert(write(fds[1], last, strlen(last)) == (ssize_t)strlen(last), "failed to write");
+    r = poll_read_body(future);
+    test_assert(r.result == POLL_READY && r.value == 0, "expected the body to be read");
+    test_assert(future->body.len == 100 * (sizeof(chunk) - 20) && future->body.spooling
+            && future->body.chain.len == 0,
+        "expected all of the body to be spooled");
+
+    // The request behind it is still there
+    reset_handler_future(future);
+    r = poll_read_headers(future);
+    test_assert(r.result == POLL_READY && r.value == 0 && parse_request(future)
+            && string_view_equals(future->request.path, (string_view_t) { "/next", 5 }),
+        "expected the next request to follow the body");
+
+    free_handler_future(future);
+    close(fds[0]);
+    close(fds[1]);
+    return 0;
+}
+
+static int test_chunked_body_data()
+{
+    int fds[2];
+    test_assert(pipe(fds) == 0 && fcntl(fds[0], F_SETFL, O_NONBLOCK) == 0,
+        "failed to create a pipe");
+
+    char* headers = "POST /upload HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n";
+    test_assert(write(fds[1], headers, strlen(headers)) == (ssize_t)strlen(headers),
+        "failed to write the headers");
+    handler_future_t* future = new_handler_future(fds[0]);
+    async_result_t r = poll_read_headers(future);
+    test_assert(r.result == POLL_READY && r.value == 0 && parse_request(future)
+            && get_transfer_encoding(&future->request) && start_body(future) == STATUS_OK,
+        "expected a chunked request");
+
+    // Reads that split the data, the sizes and the CRLFs around them
+    char* pieces[] = { "4\r\nWi", "ki\r\n5\r", "\npedia\r", "\n0\r\n\r\n" };
+    for (int i = 0; i < 4; i++) {
+        test_assert(write(fds[1], pieces[i], strlen(pieces[i])) == (ssize_t)strlen(pieces[i]),
+            "failed to write");
+        r = poll_read_body(future);
+    }
+    test_assert(r.result == POLL_READY && r.value == 0, "expected the body to be read");
+
+    char body[16];
+    size_t len = 0;
+    for (buffer_segment_t* segment = future->body.chain.head; segment; segment = segment->next) {
+        test_assert(len + segment->len <= sizeof(body), "expected a short body");
+        memcpy(body + len, segment->data, segment->len);
+        len += segment->len;
+    }
+    test_assert(future->body.len == 9 && len == 9 && memcmp(body, "Wikipedia", 9) == 0,
+        "expected the decoded data of every chunk to make it into the body");
+
+    free_handler_future(future);
+    close(fds[0]);
+    close(fds[1]);
+    return 0;
+}
+
+static int test_transfer_encoding()
+{
+    request_t request;
+    test_assert(parses("POST / HTTP/1.1\r\nTransfer-Encoding: gzip, chunked\r\n\r\n", &request)
+            && !get_transfer_encoding(&request),
+        "expected a transfer coding we don't support to be rejected");
+    test_assert(parses("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n"
+                       "Content-Length: 5\r\n\r\n",
+                    &request)
+            && !get_transfer_encoding(&request),
+        "expected a length along with chunks to be rejected");
+    test_assert(parses("POST / HTTP/1.1\r\nContent-Length: 5\r\n\r\n", &request)
+            && get_transfer_encoding(&request) && !request.chunked,
+        "expected a plain request not to be chunked");
     return 0;
 }
 
 int handler_test_suite()
 {
+    // The tests read from pipes with plain level-triggered reads, whatever mode the event loop
+    // tests left behind
+    kqueue_init();
+
     int r = 0;
-    if (test_string_search() < 0) {
+    clock_set(TEST_NOW, 0);
+    if (test_headers_in_pieces() < 0) {
+        r = -1;
+        printf("\t❌ test_headers_in_pieces\n");
+    } else {
+        printf("\t✅ test_headers_in_pieces\n");
+    }
+    if (test_header_slots() < 0) {
+        r = -1;
+        printf("\t❌ test_header_slots\n");
+    } else {
+        printf("\t✅ test_header_slots\n");
+    }
+    if (test_content_length() < 0) {
+        r = -1;
+        printf("\t❌ test_content_length\n");
+    } else {
+        printf("\t✅ test_content_length\n");
+    }
+    if (test_parse_request_head() < 0) {
+        r = -1;
+        printf("\t❌ test_parse_request_head\n");
+    } else {
+        printf("\t✅ test_parse_request_head\n");
+    }
+    if (test_future_pool() < 0) {
+        r = -1;
+        printf("\t❌ test_future_pool\n");
+    } else {
+        printf("\t✅ test_future_pool\n");
+    }
+    if (test_body_across_segments() < 0) {
+        r = -1;
+        printf("\t❌ test_body_across_segments\n");
+    } else {
+        printf("\t✅ test_body_across_segments\n");
+    }
+    if (test_pipelined_requests() < 0) {
+        r = -1;
+        printf("\t❌ test_pipelined_requests\n");
+    } else {
+        printf("\t✅ test_pipelined_requests\n");
+    }
+    if (test_response_body_not_copied() < 0) {
+        r = -1;
+        printf("\t❌ test_response_body_not_copied\n");
+    } else {
+        printf("\t✅ test_response_body_not_copied\n");
+    }
+    if (test_file_response() < 0) {
+        r = -1;
+        printf("\t❌ test_file_response\n");
+    } else {
+        printf("\t✅ test_file_response\n");
+    }
+    if (test_routed_requests() < 0) {
+        r = -1;
+        printf("\t❌ test_routed_requests\n");
+    } else {
+        printf("\t✅ test_routed_requests\n");
+    }
+    if (test_streamed_body() < 0) {
+        r = -1;
+        printf("\t❌ test_streamed_body\n");
+    } else {
+        printf("\t✅ test_streamed_body\n");
+    }
+    if (test_serve_files() < 0) {
+        r = -1;
+        printf("\t❌ test_serve_files\n");
+    } else {
+        printf("\t✅ test_serve_files\n");
+    }
+    if (test_rejected_requests() < 0) {
+        r = -1;
+        printf("\t❌ test_rejected_requests\n");
+    } else {
+        printf("\t✅ test_rejected_requests\n");
+    }
+    if (test_chunked_body() < 0) {
+        r = -1;
+        printf("\t❌ test_chunked_body\n");
+    } else {
+        printf("\t✅ test_chunked_body\n");
+    }
+    if (test_chunked_body_data() < 0) {
         r = -1;
-        printf("\t❌ test_string_search\n");
+        printf("\t❌ test_chunked_body_data\n");
     } else {
-        printf("\t✅ test_string_search\n");
+        printf("\t✅ test_chunked_body_data\n");
     }
-    if (test_header_insertion() < 0) {
+    if (test_transfer_encoding() < 0) {
         r = -1;
-        printf("\t❌ test_header_insertion\n");
+        printf("\t❌ test_transfer_encoding\n");
     } else {
-        printf("\t✅ test_header_insertion\n");
+        printf("\t✅ test_transfer_encoding\n");
     }
+    // back to the real time
+    clock_update();
     return r;
 }
@@ -1,28 +1,19 @@
 #pragma once
 
 #include "arena.h"
+#include "body.h"
+#include "buffer.h"
+#include "chunked.h"
 #include "common.h"
-#include "fs.h"
+#include "headers.h"
 #include "response.h"
-
-// A string view represents a pointer into the read buffer owned by the HTTP request handler. During
-// parsing, we simply identify the starting index and length of the string we're interested in, and
-// then we can use this view to access the string without copying it.
-typedef struct string_view_t {
-    char* data;
-    size_t len;
-} string_view_t;
-
-bool string_view_equals(string_view_t a, string_view_t b);
-
-typedef struct header_value_t {
-    string_view_t name;
-    struct header_value_t* next;
-} header_value_t;
+#include "router.h"
+#include "timer.h"
 
 typedef struct header_t {
     string_view_t key;
-    header_value_t value;
+    string_view_t value;
+    // The next header with the same name, when the request repeats a known header
     struct header_t* next;
 } header_t;
 
@@ -31,29 +22,130 @@ typedef struct request_t {
     string_view_t path;
     string_view_t version;
     long content_length;
-    header_t* headers;
+    // Whether the body comes in chunks (Transfer-Encoding: chunked) rather than with a length
+    bool chunked;
+    // The headers we know by name (see headers.h), by `known_header_t`. NULL for the ones the
+    // request doesn't have.
+    header_t* known[KNOWN_HEADER_COUNT];
+    // Every other header, in the order they arrived
+    header_t* other;
+    size_t other_count;
+    size_t other_cap;
 } request_t;
 
+/**
+ * Returns the first header called `name` (whatever its case), or NULL if the request doesn't have
+ * one. Known headers are found in their slot, so `request->known[HEADER_...]` is the quicker way
+ * to get at those.
+ */
+header_t* request_header(request_t* request, const char* name);
+
+/**
+ * Parses the request line and headers in `data`, which holds `len` bytes up to and including the
+ * empty line that ends them, into the empty `request`. The strings in the request point into
+ * `data`, and headers are allocated from `arena`. Returns false if the request is malformed.
+ */
+bool parse_request_head(arena_t* arena, char* data, size_t len, request_t* request);
+
+/**
+ * What a route's handler gets to work with (see router.h). It has the request once it has been read
+ * in full, body and all, and fills in the response, which the connection writes once the handler is
+ * ready. A handler that has to wait for something hands it to the worker pool on behalf of `fd`,
+ * whose completion polls the handler again, the way `serve_files` waits for its file read.
+ *
+ * The handler of a route added with `router_add_streaming` is polled as soon as the headers are in
+ * instead, and pulls the body through `poll_route_body`, which leaves `body` empty.
+ */
+typedef struct route_context_t {
+    // The client file descriptor
+    int fd;
+    // The connection's handler, which `poll_route_body` reads the body through
+    struct handler_future_t* future;
+    // The request arena, which the handler can allocate from for anything that lasts as long as
+    // the request
+    arena_t* arena;
+    request_t* request;
+    request_body_t* body;
+    response_t* response;
+    // The route that matched, and the values of its parameters
+    route_match_t match;
+    // Whatever the handler wants to keep between polls. NULL the first time it is polled.
+    void* state;
+} route_context_t;
+
+/**
+ * Routes the requests of every connection with `router`, which must not change once the event loops
+ * are running. Without a router, every request is answered with a 404.
+ */
+void handler_set_router(const router_t* router);
+
+/**
+ * Serves the file under the data directory (see fs.h) at the path the route's `path` wildcard
+ * matched, or a 404 if there isn't one. Like every route parameter, the path leaves out the query
+ * string. The file is read on the worker pool.
+ */
+async_result_t serve_files(route_context_t* ctx);
+
+/**
+ * Reads the next piece of the body for a route that streams it (see `router_add_streaming`), as it
+ * arrives from the client, decoded if it is chunked. Ready with 0 and the piece in `slice`, which
+ * points into the read buffer and is only good until the next poll, or with an empty slice once
+ * the body is complete. Ready with -1 if the body is malformed, or larger than `body_max_size`,
+ * which the handler returns as it is: the connection then closes, after a 413 for the latter.
+ *
+ * A handler that answers before it has read all of the body closes the connection after the
+ * response. One that hands a piece to the worker pool should stop reading from the connection
+ * until it comes back (see `io_suspend_reading`), like `fs_read_submit` does.
+ */
+async_result_t poll_route_body(route_context_t* ctx, string_view_t* slice);
+
 typedef enum handler_future_state_t {
     HANDLER_READING_HEADERS,
     HANDLER_READING_BODY,
+    HANDLER_RUNNING_ROUTE,
     HANDLER_WRITING,
     HANDLER_DONE,
 } handler_future_state_t;
 
+// The deadline that applies to a connection, depending on what its handler is waiting for
+typedef enum handler_timeout_t {
+    TIMEOUT_NONE,
+    // Waiting for the next request on a keepalive connection
+    TIMEOUT_IDLE,
+    // Waiting for the rest of the request line and headers
+    TIMEOUT_HEADERS,
+    // Waiting for the rest of the request body
+    TIMEOUT_BODY,
+    // Waiting for the client to accept more of the response
+    TIMEOUT_WRITE,
+} handler_timeout_t;
+
 typedef struct read_stream_t {
-    // Buffer holding stream data read from the client file descriptor
+    // Segments holding the stream data read from the client file descriptor. The request line and
+    // headers have to fit into the first one, the body continues into as many more as it needs.
+    // Segments never move, so string views into them stay valid for the whole request. Whatever the
+    // client sent after the request (when it pipelines them) stays for the next one. A connection
+    // that is waiting for its next request holds no segments at all.
+    buffer_chain_t chain;
+    // The data of the first segment, NULL while the stream holds no segments
     char* data;
-    // The total allocated length of the buffer
-    size_t len;
-    // How far into the allocated length of the buffer we should write new data on the next `read`
-    // call.
-    size_t write_cursor;
-    // How far the user has actually read from the stream via calls like `read_line`.
-    size_t read_cursor;
+    // How far we have looked for the end of the headers
+    size_t scanned;
     // The index into the buffer where the request body begins (after the \r\n\r\n delimiter). A
     // zero value means that this has not been found yet.
     size_t body_start_idx;
+    // The index just past the end of the body, which is where the next request begins. A zero value
+    // means that the body hasn't been read yet.
+    size_t body_end_idx;
+    // How much of a body with a Content-Length has yet to be handed over
+    size_t body_remaining;
+    // How much of the body has been handed over so far, which for a chunked body the limit is
+    // checked against as it arrives
+    size_t body_len;
+    // How far the body has been handed over, and how much of it has been dropped from the buffer
+    // since, which keeps the buffer from growing with the body
+    size_t decoded;
+    size_t discarded;
 } read_stream_t;
 
 typedef struct handler_future_t {
@@ -68,8 +160,31 @@ typedef struct handler_future_t {
     handler_future_state_t state;
     // Buffer state that we read into from the client fd
     read_stream_t read_stream;
+    // Decoder for a chunked request body
+    chunked_decoder_t chunked;
+    // The request body, as far as it has been read
+    request_body_t body;
     response_t* response;
-    fs_read_result_t* read_result;
+    // The responses that haven't been written to the client yet, which outlive the requests they
+    // answer when they are held back for the next one
+    response_output_t output;
+    // The handler the request was routed to, and what it gets to work with
+    route_handler_t route_handler;
+    route_context_t route;
+    // Whether the route's handler reads the body itself, whether it is waiting on the client for
+    // more of it, and whether the body went past the size limit (see `poll_route_body`)
+    bool streaming_body;
+    bool waiting_for_body;
+    bool body_too_large;
+    // Number of requests that have been completed on the connection
+    size_t requests_served;
+    // Deadline for whatever the handler is waiting on. Owned by the event loop, which arms it
+    // based on `handler_timeout`.
+    timer_entry_t timer;
+    handler_timeout_t timer_kind;
+    size_t timer_progress;
+    // Link in the pool of free futures, see `free_handler_future`
+    struct handler_future_t* next_free;
 } handler_future_t;
 
 // Values that can be returned as the `value` parameter of the handler's async result.
@@ -78,10 +193,29 @@ typedef enum handler_return_t {
     HANDLER_CLOSE,
 } handler_return_t;
 
+/**
+ * Returns a future for a new connection, reusing one from the calling thread's pool (along with
+ * its buffers) if there is one.
+ */
 handler_future_t* new_handler_future(int fd);
 
 async_result_t poll_handler_future(handler_future_t* self);
 
+/**
+ * Returns the future to the calling thread's pool, or frees it if the pool is full.
+ */
 void free_handler_future(handler_future_t* self);
 
+/**
+ * Returns which deadline applies to the handler in its current state, and sets `progress` to a
+ * counter that goes up whenever the connection makes progress in that state.
+ */
+handler_timeout_t handler_timeout(handler_future_t* self, size_t* progress);
+
+/**
+ * Whether the client has sent any of its next request already, which the handler can get on with
+ * without waiting for the connection to become readable.
+ */
+bool handler_has_input(handler_future_t* self);
+
 int handler_test_suite();
@@ -0,0 +1,137 @@
+#include "headers.h"
+
+// Size of the hash table, a power of two
+#define HEADER_SLOTS 128
+
+typedef struct known_name_t {
+    const char* name;
+    size_t len;
+} known_name_t;
+
+#define HEADER_NAME(id, name) { name, sizeof(name) - 1 },
+static const known_name_t names[] = { KNOWN_HEADERS(HEADER_NAME) };
+#undef HEADER_NAME
+
+// The known header that hashes to each slot, HEADER_UNKNOWN for the empty ones
+static uint8_t slots[HEADER_SLOTS];
+
+static inline char lower(char c) { return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c; }
+
+// The multiplier and the characters that go into the hash were picked so that no two known headers
+// share a slot
+static size_t slot_of(const char* name, size_t len)
+{
+    size_t first = (unsigned char)lower(name[0]);
+    size_t last = (unsigned char)lower(name[len - 1]);
+    return ((len + last) * 10 + first) & (HEADER_SLOTS - 1);
+}
+
+// C can't hash a string literal in a constant expression, so the table is filled in when the
+// program is loaded
+__attribute__((constructor)) static void fill_slots()
+{
+    memset(slots, HEADER_UNKNOWN, sizeof(slots));
+    for (int header = 0; header < KNOWN_HEADER_COUNT; header++) {
+        size_t slot = slot_of(names[header].name, names[header].len);
+        // A collision leaves the second header unknown, which the tests catch
+        if (slots[slot] == HEADER_UNKNOWN) {
+            slots[slot] = header;
+        }
+    }
+}
+
+bool equals_ignore_case(const char* a, const char* b, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        if (lower(a[i]) != lower(b[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+known_header_t known_header(const char* name, size_t len)
+{
+    if (len == 0) {
+        return HEADER_UNKNOWN;
+    }
+
+    known_header_t header = slots[slot_of(name, len)];
+    if (header == HEADER_UNKNOWN || names[header].len != len
+        || !equals_ignore_case(name, names[header].name, len)) {
+        return HEADER_UNKNOWN;
+    }
+    return header;
+}
+
+const char* known_header_name(known_header_t header)
+{
+    return header < KNOWN_HEADER_COUNT ? names[header].name : NULL;
+}
+
+/**
+ ***************************************************************************************************
+ * Tests
+ ***************************************************************************************************
+ */
+#define test_assert(cond, msg)                                                                     \
+    do {                                                                                           \
+        if (!(cond)) {                                                                             \
+            printf("Assertion failed: %s\n", msg);                                                 \
+            return -1;                                                                             \
+        }                                                                                          \
+    } while (0)
+
+static int test_known_headers()
+{
+    // Every known header has to come back as itself, in any case, which also proves that the hash
+    // has no collisions
+    for (int header = 0; header < KNOWN_HEADER_COUNT; header++) {
+        const char* name = names[header].name;
+        size_t len = names[header].len;
+        char upper[64];
+        for (size_t i = 0; i < len; i++) {
+            upper[i] = name[i] >= 'a' && name[i] <= 'z' ? name[i] - ('a' - 'A') : name[i];
+        }
+
+        if (known_header(name, len) != (known_header_t)header
+            || known_header(upper, len) != (known_header_t)header) {
+            printf("header %s\n", name);
+            test_assert(false, "expected the known header to be found in either case");
+        }
+    }
+
+    test_assert(known_header("Content-Length", 14) == HEADER_CONTENT_LENGTH,
+        "expected Content-Length to be known");
+    test_assert(strcmp(known_header_name(HEADER_HOST), "host") == 0, "expected the name of Host");
+    return 0;
+}
+
+static int test_unknown_headers()
+{
+    test_assert(known_header("X-Custom", 8) == HEADER_UNKNOWN, "expected X-Custom to be unknown");
+    test_assert(known_header("", 0) == HEADER_UNKNOWN, "expected an empty name to be unknown");
+    // A prefix of a known header, and one with the same hash inputs as a known header
+    test_assert(
+        known_header("Content-Len", 11) == HEADER_UNKNOWN, "expected a prefix to be unknown");
+    test_assert(known_header("hoxt", 4) == HEADER_UNKNOWN, "expected a near miss to be unknown");
+    return 0;
+}
+
+int headers_test_suite()
+{
+    int r = 0;
+    if (test_known_headers() < 0) {
+        r = -1;
+        printf("\t❌ test_known_headers\n");
+    } else {
+        printf("\t✅ test_known_headers\n");
+    }
+    if (test_unknown_headers() < 0) {
+        r = -1;
+        printf("\t❌ test_unknown_headers\n");
+    } else {
+        printf("\t✅ test_unknown_headers\n");
+    }
+    return r;
+}
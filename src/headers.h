@@ -0,0 +1,76 @@
+/**
+ * The request headers we know by name.
+ *
+ * The parser classifies every header name as it goes, so that the handler can get at the headers
+ * it cares about through a slot on the request instead of searching for them. Classifying a name
+ * takes a perfect hash of its length and first and last characters, and a single comparison to
+ * confirm it, all case-insensitive.
+ */
+
+#pragma once
+
+#include "common.h"
+
+// X(id, name) for every known header. Adding one is all it takes, as long as the hash stays
+// perfect, which the tests check.
+#define KNOWN_HEADERS(X)                                                                           \
+    X(HEADER_ACCEPT, "accept")                                                                     \
+    X(HEADER_ACCEPT_CHARSET, "accept-charset")                                                     \
+    X(HEADER_ACCEPT_ENCODING, "accept-encoding")                                                   \
+    X(HEADER_ACCEPT_LANGUAGE, "accept-language")                                                   \
+    X(HEADER_AUTHORIZATION, "authorization")                                                       \
+    X(HEADER_CACHE_CONTROL, "cache-control")                                                       \
+    X(HEADER_CONNECTION, "connection")                                                             \
+    X(HEADER_CONTENT_ENCODING, "content-encoding")                                                 \
+    X(HEADER_CONTENT_LENGTH, "content-length")                                                     \
+    X(HEADER_CONTENT_TYPE, "content-type")                                                         \
+    X(HEADER_COOKIE, "cookie")                                                                     \
+    X(HEADER_EXPECT, "expect")                                                                     \
+    X(HEADER_FORWARDED, "forwarded")                                                               \
+    X(HEADER_HOST, "host")                                                                         \
+    X(HEADER_IF_MATCH, "if-match")                                                                 \
+    X(HEADER_IF_MODIFIED_SINCE, "if-modified-since")                                               \
+    X(HEADER_IF_NONE_MATCH, "if-none-match")                                                       \
+    X(HEADER_IF_RANGE, "if-range")                                                                 \
+    X(HEADER_IF_UNMODIFIED_SINCE, "if-unmodified-since")                                           \
+    X(HEADER_ORIGIN, "origin")                                                                     \
+    X(HEADER_PRAGMA, "pragma")                                                                     \
+    X(HEADER_RANGE, "range")                                                                       \
+    X(HEADER_REFERER, "referer")                                                                   \
+    X(HEADER_TE, "te")                                                                             \
+    X(HEADER_TRAILER, "trailer")                                                                   \
+    X(HEADER_TRANSFER_ENCODING, "transfer-encoding")                                               \
+    X(HEADER_UPGRADE, "upgrade")                                                                   \
+    X(HEADER_USER_AGENT, "user-agent")                                                             \
+    X(HEADER_VIA, "via")                                                                           \
+    X(HEADER_X_FORWARDED_FOR, "x-forwarded-for")                                                   \
+    X(HEADER_X_FORWARDED_PROTO, "x-forwarded-proto")                                               \
+    X(HEADER_X_REAL_IP, "x-real-ip")                                                               \
+    X(HEADER_X_REQUEST_ID, "x-request-id")
+
+#define HEADER_ENUM(id, name) id,
+typedef enum known_header_t {
+    KNOWN_HEADERS(HEADER_ENUM)
+    // The number of known headers, and what `known_header` returns for any other name
+    HEADER_UNKNOWN,
+} known_header_t;
+#undef HEADER_ENUM
+
+#define KNOWN_HEADER_COUNT HEADER_UNKNOWN
+
+/**
+ * Classifies the header name, whatever its case. Returns HEADER_UNKNOWN for names we don't know.
+ */
+known_header_t known_header(const char* name, size_t len);
+
+/**
+ * The lowercase name of a known header.
+ */
+const char* known_header_name(known_header_t header);
+
+/**
+ * Whether the `len` bytes at `a` and `b` are equal, ignoring ASCII case.
+ */
+bool equals_ignore_case(const char* a, const char* b, size_t len);
+
+int headers_test_suite();
@@ -1,4 +1,5 @@
 #include "kqueue.h"
+#include <errno.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <sys/socket.h>
@@ -7,7 +8,33 @@
 #include <time.h>
 #include <unistd.h>
 
-static int queue_fd;
+static _Thread_local int queue_fd;
+
+// Registrations are queued here and submitted in the same `kevent` call that waits for events,
+// instead of costing a syscall each.
+#define KQUEUE_MAX_CHANGES 1024
+static _Thread_local struct kevent changelist[KQUEUE_MAX_CHANGES];
+static _Thread_local size_t change_count = 0;
+// How many times the changelist filled up and had to be submitted on its own
+static _Thread_local size_t standalone_flushes = 0;
+
+// Stats for the changes queued since the last wait, and for the ones flushed by it
+static _Thread_local event_stats_t pending_stats = { 0 };
+static _Thread_local event_stats_t last_stats = { 0 };
+
+// What we know about each fd, indexed by fd
+typedef struct fd_state_t {
+    // Edge-triggered mode only: the fd has its persistent EV_CLEAR registrations
+    bool registered;
+    // Edge-triggered mode only: an edge was reported and the fd hasn't been drained since
+    bool readable;
+    // Passed as the udata of every registration, see `set_event_generation`
+    uint32_t generation;
+} fd_state_t;
+
+static _Thread_local bool edge_triggered = false;
+static _Thread_local fd_state_t* fd_states = NULL;
+static _Thread_local size_t fd_states_cap = 0;
 
 void kqueue_init()
 {
@@ -18,62 +45,194 @@ void kqueue_init()
     }
 
     queue_fd = r;
+    edge_triggered = false;
 }
 
-int register_read_event(int fd)
+void enable_edge_triggered() { edge_triggered = true; }
+
+bool is_edge_triggered() { return edge_triggered; }
+
+static fd_state_t* get_fd_state(int fd)
 {
-    struct kevent changelist[1];
-    EV_SET(&changelist[0], fd, EVFILT_READ, EV_ADD | EV_ONESHOT, 0, 0, NULL);
+    if ((size_t)fd >= fd_states_cap) {
+        size_t new_cap = fd_states_cap ? fd_states_cap : 1024;
+        while (new_cap <= (size_t)fd) {
+            new_cap *= 2;
+        }
+
+        fd_states = realloc(fd_states, new_cap * sizeof(fd_state_t));
+        memset(fd_states + fd_states_cap, 0, (new_cap - fd_states_cap) * sizeof(fd_state_t));
+        fd_states_cap = new_cap;
+    }
 
-    if (kevent(queue_fd, changelist, 1, NULL, 0, NULL) == -1) {
-        perror("kevent");
-        return -1;
+    return &fd_states[fd];
+}
+
+static int push_change(int fd, int16_t filter, uint16_t flags, uint32_t generation)
+{
+    // The changelist is full, so it has to go to the kernel on its own
+    if (change_count == KQUEUE_MAX_CHANGES) {
+        standalone_flushes++;
+        if (kevent(queue_fd, changelist, change_count, NULL, 0, NULL) == -1) {
+            perror("kevent");
+            change_count = 0;
+            return -1;
+        }
+        change_count = 0;
     }
 
+    EV_SET(&changelist[change_count++], fd, filter, flags, 0, 0, (void*)(uintptr_t)generation);
     return 0;
 }
 
-int register_write_event(int fd)
+static int queue_registration(int fd, int16_t filter)
 {
-    struct kevent changelist[1];
-    EV_SET(&changelist[0], fd, EVFILT_WRITE, EV_ADD | EV_ONESHOT, 0, 0, NULL);
+    pending_stats.registrations++;
+
+    fd_state_t* state = get_fd_state(fd);
+    if (!edge_triggered) {
+        return push_change(fd, filter, EV_ADD | EV_ONESHOT, state->generation);
+    }
 
-    if (kevent(queue_fd, changelist, 1, NULL, 0, NULL) == -1) {
-        perror("kevent");
+    // Both filters are added once for the life of the fd. After that a read registration only
+    // tells us the caller has drained the fd.
+    if (filter == EVFILT_READ) {
+        state->readable = false;
+    }
+
+    if (state->registered) {
+        return 0;
+    }
+
+    state->registered = true;
+    if (push_change(fd, EVFILT_READ, EV_ADD | EV_CLEAR, state->generation) < 0) {
         return -1;
     }
+    return push_change(fd, EVFILT_WRITE, EV_ADD | EV_CLEAR, state->generation);
+}
 
-    return 0;
+void set_event_generation(int fd, uint32_t generation)
+{
+    get_fd_state(fd)->generation = generation;
+}
+
+int register_read_event(int fd) { return queue_registration(fd, EVFILT_READ); }
+
+int register_write_event(int fd) { return queue_registration(fd, EVFILT_WRITE); }
+
+// Drops the changes for the fd that haven't been submitted yet
+static void drop_changes(int fd)
+{
+    size_t i = 0;
+    while (i < change_count) {
+        if ((int)changelist[i].ident == fd) {
+            changelist[i] = changelist[--change_count];
+        } else {
+            i++;
+        }
+    }
+}
+
+void suspend_events(int fd)
+{
+    // Level-triggered registrations are one-shot, so once the ones we haven't submitted yet are
+    // dropped, nothing is left to report the fd. An edge is only reported once anyway.
+    if (edge_triggered) {
+        return;
+    }
+
+    drop_changes(fd);
+}
+
+void deregister_events(int fd)
+{
+    // kqueue drops every knote attached to a descriptor when it is closed, but changes we haven't
+    // submitted yet would fail with EBADF (or worse, apply to whoever gets the fd number next).
+    drop_changes(fd);
+
+    if ((size_t)fd < fd_states_cap) {
+        fd_states[fd] = (fd_state_t) { 0 };
+    }
+}
+
+void remove_events(int fd)
+{
+    // Unlike epoll, kqueue attaches knotes to the descriptor itself, so closing ours is enough even
+    // if another process holds a copy
+    deregister_events(fd);
+}
+
+bool is_readable(int fd)
+{
+    return edge_triggered && (size_t)fd < fd_states_cap && fd_states[fd].readable;
+}
+
+void mark_read_drained(int fd)
+{
+    if ((size_t)fd < fd_states_cap) {
+        fd_states[fd].readable = false;
+    }
 }
 
 // Note that this effectively places an upper bound on the number of incoming client handlers we can
 // have in a "ready" state at any one time
 #define KQUEUE_MAX_EVENTS 1024
-struct kevent eventlist[KQUEUE_MAX_EVENTS];
-size_t last_event_len = 0;
+static _Thread_local struct kevent eventlist[KQUEUE_MAX_EVENTS];
+static _Thread_local size_t last_event_len = 0;
 
-int block_until_events()
+int block_until_events(int timeout_ms)
 {
-    int event_count = kevent(queue_fd, NULL, 0, eventlist, KQUEUE_MAX_EVENTS, NULL);
+    int submitted = change_count;
+    change_count = 0;
+
+    struct timespec timeout = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_nsec = (long)(timeout_ms % 1000) * 1000000,
+    };
+    int event_count = kevent(queue_fd, changelist, submitted, eventlist, KQUEUE_MAX_EVENTS,
+        timeout_ms < 0 ? NULL : &timeout);
     if (event_count == -1) {
-        perror("kevent");
+        last_event_len = 0;
+        if (errno != EINTR) {
+            perror("kevent");
+        }
         return -1;
     }
 
+    // Every registration rode along with the wait, except for when the changelist filled up
+    size_t registrations = pending_stats.registrations;
+    pending_stats.syscalls_saved
+        = registrations > standalone_flushes ? registrations - standalone_flushes : 0;
+    standalone_flushes = 0;
+    last_stats = pending_stats;
+    pending_stats = (event_stats_t) { 0 };
+
     last_event_len = event_count;
 
-    return 0;
+    return event_count;
 }
 
+event_stats_t get_event_stats() { return last_stats; }
+
 eventlist_iter_t get_eventlist_iter() { return (eventlist_iter_t) { 0 }; }
 
-struct kevent* get_next_event(eventlist_iter_t* iter)
+event_t* get_next_event(eventlist_iter_t* iter)
 {
-    if (iter->index >= last_event_len) {
-        return NULL;
+    while (iter->index < last_event_len) {
+        struct kevent* event = &eventlist[iter->index++];
+        // Changes submitted with the wait report their failures in the eventlist
+        if (event->flags & EV_ERROR) {
+            println("kevent: failed to register fd %d: %s", (int)event->ident,
+                strerror((int)event->data));
+            continue;
+        }
+        if (edge_triggered && event->filter == EVFILT_READ) {
+            get_fd_state((int)event->ident)->readable = true;
+        }
+        return event;
     }
 
-    return &eventlist[iter->index++];
+    return NULL;
 }
 
 /**
@@ -161,17 +320,23 @@ int test_kqueue_register_read_event()
         return -1;
     }
 
+    set_event_generation(client_sock, 7);
     if (register_read_event(client_sock) < 0) {
         return -1;
     }
 
     test_log("[client]: blocking until read events available\n");
-    block_until_events();
+    block_until_events(-1);
+
+    event_stats_t stats = get_event_stats();
+    assert(stats.registrations == 1 && stats.syscalls_saved == 1,
+        "the registration should have been submitted together with the wait");
 
     eventlist_iter_t iter = get_eventlist_iter();
-    struct kevent* event = get_next_event(&iter);
+    event_t* event = get_next_event(&iter);
     // We should only have one event since we only registered one
-    assert((int)event->ident == client_sock, "client socket not in event list");
+    assert(event_fd(event) == client_sock, "client socket not in event list");
+    assert(event_generation(event) == 7, "expected the event to carry the generation");
 
     // read the server message into our buffer:
     char buffer[1024];
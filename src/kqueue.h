@@ -1,12 +1,29 @@
 #pragma once
 
 #include "common.h"
+
+#ifdef __linux__
+// On Linux the same API is implemented on top of epoll (see epoll.c). The Makefile picks the
+// backend for the platform we're building on.
+#include <sys/epoll.h>
+
+typedef struct epoll_event event_t;
+// The user data of every registration packs the fd with its generation
+#define event_fd(event) ((int)(uint32_t)(event)->data.u64)
+#define event_generation(event) ((uint32_t)((event)->data.u64 >> 32))
+#else
 #include <sys/event.h>
 #include <sys/time.h>
 #include <sys/types.h>
 
+typedef struct kevent event_t;
+#define event_fd(event) ((int)(event)->ident)
+#define event_generation(event) ((uint32_t)(uintptr_t)(event)->udata)
+#endif
+
 /**
- * Initialize the kqueue subsystem.
+ * Initialize the kqueue subsystem. All of the state behind this API is thread-local, so every
+ * thread that calls this gets its own independent event loop.
  */
 void kqueue_init();
 
@@ -16,20 +33,92 @@ typedef enum {
 } kqueue_event_t;
 
 /**
- * Register yourself for read events on the given file descriptor.
+ * Switches to persistent, edge-triggered registrations (EV_CLEAR / EPOLLET). Must be called right
+ * after `kqueue_init`.
+ *
+ * In this mode the first registration for an fd adds it for both reads and writes, for the life of
+ * the connection. Later calls to `register_read_event` / `register_write_event` don't touch the
+ * kernel at all, they only record that the caller has drained the fd and is waiting for the next
+ * edge. Since no new edge arrives for data that was already there, callers have to read until
+ * EAGAIN (or a short read), and use `is_readable` to find out whether that has happened yet.
+ */
+void enable_edge_triggered();
+
+bool is_edge_triggered();
+
+/**
+ * Whether the fd may still have unread data, because an edge was reported for it and it hasn't
+ * been drained since. Always false unless edge-triggered mode is enabled, since otherwise the
+ * kernel simply reports the fd again.
+ */
+bool is_readable(int fd);
+
+/**
+ * Records that a read on the fd came back short or with EAGAIN, so it has nothing more to give
+ * until the next edge.
+ */
+void mark_read_drained(int fd);
+
+/**
+ * Register yourself for read events on the given file descriptor. Registrations are queued and
+ * handed to the kernel together with the next `block_until_events` call, so errors for a single
+ * registration are only logged at that point.
  */
 int register_read_event(int fd);
 
 /**
- * Register yourself for write events on the given file descriptor.
+ * Register yourself for write events on the given file descriptor. Queued like
+ * `register_read_event`.
  */
 int register_write_event(int fd);
 
 /**
- * Blocks the thread until one or more registered events are triggered. Returns the number of events
- * that were triggered.
+ * Stops reporting the fd until the next `register_read_event` / `register_write_event`, for a
+ * caller that can't do anything with it until something else wakes it up. Without this a
+ * level-triggered fd with unread data would be reported on every wait. Does nothing in
+ * edge-triggered mode, where it wouldn't be. Queued like `register_read_event`.
+ */
+void suspend_events(int fd);
+
+/**
+ * Sets the generation that events for the fd report from now on (see `event_generation`), so that
+ * an event for a connection that has been closed can't be mistaken for one for the next connection
+ * that gets the same fd number. Must be called before the first registration for the fd, and is
+ * reset to 0 by `deregister_events`.
+ */
+void set_event_generation(int fd, uint32_t generation);
+
+/**
+ * Forget any registrations for the given file descriptor. Must be called before the descriptor is
+ * closed, since the number may be handed out again by the kernel for a new connection.
+ */
+void deregister_events(int fd);
+
+/**
+ * Like `deregister_events`, but also takes the descriptor out of the kernel's event queue right
+ * away. Only needed for descriptors that stay open elsewhere after we close ours (like a listening
+ * socket that has been handed to another process), which the kernel would otherwise keep reporting.
+ */
+void remove_events(int fd);
+
+/**
+ * Blocks the thread until one or more registered events are triggered, or until `timeout_ms`
+ * milliseconds have passed (-1 waits forever). Returns the number of events that were triggered,
+ * which is 0 if the timeout expired first.
+ */
+int block_until_events(int timeout_ms);
+
+typedef struct event_stats_t {
+    // Registrations that were queued since the previous `block_until_events` call
+    size_t registrations;
+    // How many syscalls we avoided by batching them, compared to one syscall per registration
+    size_t syscalls_saved;
+} event_stats_t;
+
+/**
+ * Returns stats about the registrations flushed by the most recent `block_until_events` call.
  */
-int block_until_events();
+event_stats_t get_event_stats();
 
 typedef struct eventlist_iter_t {
     size_t index;
@@ -43,6 +132,6 @@ eventlist_iter_t get_eventlist_iter();
 /**
  * Returns the next event that was triggered. Returns NULL if there are no more events.
  */
-struct kevent* get_next_event(eventlist_iter_t* iter);
+event_t* get_next_event(eventlist_iter_t* iter);
 
 int kqueue_test_suite();
@@ -1,143 +1,869 @@
+#include "arena.h"
+#include "body.h"
+#include "buffer.h"
 #include "common.h"
 #include "conn.h"
 #include "handler.h"
 #include "kqueue.h"
+#include "router.h"
 #include "tcp.h"
+#include "timer.h"
+#include "upgrade.h"
+#include "uring.h"
+#include "workers.h"
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
-#include <sys/event.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
+// Options that only have a long form
+enum {
+    OPT_IDLE_TIMEOUT = 256,
+    OPT_HEADER_TIMEOUT,
+    OPT_BODY_TIMEOUT,
+    OPT_WRITE_TIMEOUT,
+    OPT_DEFER_ACCEPT,
+    OPT_FASTOPEN,
+    OPT_DRAIN_TIMEOUT,
+    OPT_UPGRADE_SOCKET,
+    OPT_UPGRADE,
+    OPT_SPOOL_THRESHOLD,
+    OPT_SPOOL_DIR,
+    OPT_MAX_BODY_SIZE,
+};
+
 struct option long_options[] = { { "help", no_argument, 0, 'h' },
-    { "version", no_argument, 0, 'v' }, { "port", required_argument, 0, 'p' } };
+    { "version", no_argument, 0, 'v' }, { "port", required_argument, 0, 'p' },
+    { "io-uring", no_argument, 0, 'u' }, { "edge-triggered", no_argument, 0, 'e' },
+    { "threads", required_argument, 0, 't' }, { "pin-cpus", no_argument, 0, 'c' },
+    { "io-threads", required_argument, 0, 'w' },
+    { "idle-timeout", required_argument, 0, OPT_IDLE_TIMEOUT },
+    { "header-timeout", required_argument, 0, OPT_HEADER_TIMEOUT },
+    { "body-timeout", required_argument, 0, OPT_BODY_TIMEOUT },
+    { "write-timeout", required_argument, 0, OPT_WRITE_TIMEOUT },
+    { "backlog", required_argument, 0, 'b' },
+    { "defer-accept", required_argument, 0, OPT_DEFER_ACCEPT },
+    { "fastopen", required_argument, 0, OPT_FASTOPEN },
+    { "drain-timeout", required_argument, 0, OPT_DRAIN_TIMEOUT },
+    { "upgrade-socket", required_argument, 0, OPT_UPGRADE_SOCKET },
+    { "upgrade", no_argument, 0, OPT_UPGRADE },
+    { "spool-threshold", required_argument, 0, OPT_SPOOL_THRESHOLD },
+    { "spool-dir", required_argument, 0, OPT_SPOOL_DIR },
+    { "max-body-size", required_argument, 0, OPT_MAX_BODY_SIZE }, { 0, 0, 0, 0 } };
+
+// Every event loop runs on its own thread, with its own listening socket (all of them sharing the
+// port through SO_REUSEPORT), its own event queue, and its own connection table. Nothing is shared
+// between loops, so they scale independently.
+typedef struct event_loop_t {
+    int id;
+    pthread_t thread;
+    int server_fd;
+    conn_map_t* conn_map;
+    // Deadlines of the connections in `conn_map`
+    timer_wheel_t timers;
+    // Edge-triggered mode only: the last accept batch ran out of budget before the listener ran dry
+    bool accept_backlogged;
+    // A socketpair the loop watches for reads. Both `on_signal` and the worker pool write to it to
+    // interrupt the loop's wait, no matter which thread they are running on.
+    int wake_fds[2];
+    // Work submitted to the worker pool by this loop comes back here once it's finished
+    completion_queue_t completions;
+    // When the loop gives up on the connections it is draining, on the `clock_monotonic_ms` clock.
+    // 0 as long as the loop hasn't started draining.
+    uint64_t drain_deadline;
+} event_loop_t;
 
 int port = 8080;
-bool shutdown = false;
+int backlog = SOMAXCONN;
+int defer_accept = 0;
+int fastopen = 0;
+bool use_io_uring = false;
+bool edge_triggered = false;
+int thread_count = 1;
+bool pin_cpus = false;
+int io_thread_count = 4;
+// Connection deadlines in seconds, see `update_deadline`
+int idle_timeout = 60;
+int header_timeout = 10;
+int body_timeout = 30;
+int write_timeout = 30;
+// How long in-flight requests get to finish once we start draining, in seconds
+int drain_timeout = 30;
+// Where we listen for the process that replaces us, see upgrade.h
+const char* upgrade_socket = NULL;
+// Whether to take over the listening sockets of the process at `upgrade_socket`
+bool upgrade = false;
+// Request bodies larger than this go to a temp file in `spool_dir`, see body.h
+long spool_threshold = BODY_SPOOL_THRESHOLD;
+const char* spool_dir = NULL;
+// Requests with a larger body are answered with a 413
+long max_body_size = BODY_MAX_SIZE;
+// Where requests go, see router.h
+router_t router;
+// Set once the loops should stop accepting and finish the connections they have
+volatile sig_atomic_t draining = 0;
+volatile sig_atomic_t shutting_down = 0;
+event_loop_t* loops = NULL;
+
+// What the thread that waits for our replacement hands over, see `run_upgrade_listener`
+typedef struct upgrade_listener_t {
+    // The Unix socket the new process connects to
+    int listen_fd;
+    // Written to once we start draining, so that the thread stops waiting for a new process
+    int wake_fds[2];
+    // The listening sockets of the loops, copied before they start. A draining loop closes its own,
+    // so by then the number may already belong to something else.
+    int fds[UPGRADE_MAX_FDS];
+    int count;
+} upgrade_listener_t;
+upgrade_listener_t upgrade_listener = { .listen_fd = -1, .wake_fds = { -1, -1 } };
+// Held while the listening sockets are handed over, so that a loop that starts draining in the
+// meantime doesn't close its own before the new process has it
+pthread_mutex_t handoff_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Initial size of each loop's connection table, which grows to fit the highest fd
 #define CONN_MAP_SIZE 1024
+// Maximum number of connections accepted per event loop iteration
+#define ACCEPT_BUDGET 64
 
+// Interrupts every loop's wait (and the upgrade listener's), so that it notices that `draining` or
+// `shutting_down` has changed. write() is async-signal-safe, and unlike interrupting the threads
+// with a signal it can't race with a loop that has checked the flags but not started waiting yet.
+static void wake_loops()
+{
+    for (int i = 0; loops && i < thread_count; i++) {
+        ssize_t r = write(loops[i].wake_fds[1], "", 1);
+        (void)r;
+    }
+    if (upgrade_listener.wake_fds[1] >= 0) {
+        ssize_t r = write(upgrade_listener.wake_fds[1], "", 1);
+        (void)r;
+    }
+}
+
+// The first signal drains the loops, a second one stops them right away
 void on_signal(int sig)
 {
-    println("received signal %d, shutting down...", sig);
-    shutdown = true;
+    if (draining) {
+        println("received signal %d again, shutting down...", sig);
+        shutting_down = 1;
+    } else {
+        println("received signal %d, draining connections...", sig);
+        draining = 1;
+    }
+    wake_loops();
 }
 
-int main(int argc, char* argv[])
+static void close_connection(event_loop_t* loop, int fd)
 {
-    if (signal(SIGINT, on_signal) == SIG_ERR) {
-        perror("failed to register signal handler");
-        return 1;
+    handler_future_t* future = conn_map_get(loop->conn_map, fd);
+    if (future) {
+        timer_cancel(&loop->timers, &future->timer);
     }
 
-    switch (getopt_long(argc, argv, "hvp:", long_options, NULL)) {
-    case 'h':
-        printf("Usage: %s [OPTION]...\n", argv[0]);
-        printf("Async http server for fun.\n\n");
-        printf("  -p, --port=PORT specify the port to listen on\n");
-        printf("  -h, --help      display this help and exit\n");
-        printf("  -v, --version   output version information and exit\n");
-        return 0;
-    case 'v':
-        printf("c-http %s\n", VERSION);
-        return 0;
-    case 'p':
-        port = atoi(optarg);
-        break;
-    case -1:
-        break;
+    conn_map_remove(loop->conn_map, fd);
+    if (uring_enabled) {
+        uring_close_conn(fd);
+    } else {
+        deregister_events(fd);
+        close(fd);
+    }
+}
+
+static int timeout_seconds(handler_timeout_t kind)
+{
+    switch (kind) {
+    case TIMEOUT_IDLE:
+        return idle_timeout;
+    case TIMEOUT_HEADERS:
+        return header_timeout;
+    case TIMEOUT_BODY:
+        return body_timeout;
+    case TIMEOUT_WRITE:
+        return write_timeout;
     default:
-        return 1;
+        return 0;
     }
+}
 
-    println("starting server on port %d...", port);
+// Arms the deadline for whatever the connection is waiting on now. Idle and header deadlines run
+// from the moment the connection starts waiting, so that a client can't push them back by dribbling
+// in one byte at a time. Body and write deadlines are pushed back whenever the connection makes
+// progress, so they only fire once it stalls.
+static void update_deadline(event_loop_t* loop, handler_future_t* future)
+{
+    size_t progress;
+    handler_timeout_t kind = handler_timeout(future, &progress);
+    if (kind == TIMEOUT_NONE) {
+        timer_cancel(&loop->timers, &future->timer);
+        return;
+    }
 
-    // Initialize subsystems:
-    kqueue_init();
-    int server_fd = start_server(port);
+    bool stall_deadline = kind == TIMEOUT_BODY || kind == TIMEOUT_WRITE;
+    if (timer_is_scheduled(&future->timer) && kind == future->timer_kind
+        && (!stall_deadline || progress == future->timer_progress)) {
+        return;
+    }
+
+    future->timer.fd = future->fd;
+    future->timer_kind = kind;
+    future->timer_progress = progress;
+    timer_schedule(&loop->timers, &future->timer,
+        clock_monotonic_ms() + (uint64_t)timeout_seconds(kind) * 1000);
+}
+
+// Closes every connection whose deadline has passed, all in one go.
+static void expire_connections(event_loop_t* loop)
+{
+    timer_entry_t* expired = timer_wheel_advance(&loop->timers, clock_monotonic_ms());
+    size_t count = 0;
+    while (expired) {
+        // closing the connection frees the timer
+        timer_entry_t* next = expired->next;
+
+        // Reset the connection instead of closing it gracefully, so that the kernel drops whatever
+        // is still queued for a client that has stopped reading, instead of holding on to it
+        struct linger linger = { .l_onoff = 1, .l_linger = 0 };
+        setsockopt(expired->fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+        close_connection(loop, expired->fd);
+        expired = next;
+        count++;
+    }
+
+    if (count > 0) {
+        println("closed %zu connection(s) that missed their deadline", count);
+    }
+}
+
+// Polls the handler future associated with `fd` after the event loop has been told that it can make
+// progress.
+static void poll_connection(event_loop_t* loop, int fd)
+{
+    handler_future_t* future = conn_map_get(loop->conn_map, fd);
+    if (future == NULL) {
+        println("no handler found for fd %d, ignoring event", fd);
+        return;
+    }
+
+    while (1) {
+        async_result_t result = poll_handler_future(future);
+        // There are 3 possible outcomes:
+        // 1) the event loop lied to us and we're not actually ready to read from the connection.
+        if (result.result == POLL_PENDING) {
+            // handler futures are responsible for re-registering themselves, we only need to
+            // keep track of how long they are allowed to wait
+            update_deadline(loop, future);
+            return;
+        }
+
+        long return_val = (long)result.value;
+        if (result.result == POLL_READY && return_val < 0) {
+            // 2) our handler failed in some way, we just need to clean up and move on
+            println("failure while handling connection %d, dropping it.", fd);
+            close_connection(loop, fd);
+            return;
+        }
+
+        // 3) else, it succeeded, and we either need to close the connection or re-create the
+        // handler for the next request
+        handler_return_t handler_return = (handler_return_t)return_val;
+
+        if (handler_return == HANDLER_CLOSE) {
+            println("HTTP handler future completed with CLOSE status");
+            close_connection(loop, fd);
+            return;
+        }
+
+        println("HTTP handler future completed with KEEP_ALIVE status");
+
+        // A draining loop only finishes the requests that were already in flight, which includes
+        // the ones the client has pipelined behind them
+        if (loop->drain_deadline && !handler_has_input(future)) {
+            close_connection(loop, fd);
+            return;
+        }
+
+        // The next request may already be waiting for us (pipelined behind the last one, in the
+        // io_uring inbox, or in a socket whose edge we've already consumed), in which case nothing
+        // else is going to wake us up for it.
+        if (!handler_has_input(future) && !io_has_input(fd)) {
+            io_wait_readable(fd);
+            update_deadline(loop, future);
+            return;
+        }
+    }
+}
+
+// Accepts new connections on the listener until it runs dry, and sets up a handler for each of
+// them. At most ACCEPT_BUDGET connections are accepted per loop iteration, so that a storm of new
+// connections can't starve the ones we already have.
+static void accept_connections(event_loop_t* loop)
+{
+    int server_fd = loop->server_fd;
+    int accepted = 0;
+
+    while (accepted < ACCEPT_BUDGET) {
+        async_result_t result = poll_accept_connection(server_fd);
+        // There are 3 possible outcomes:
+        // 1) there is nothing (left) to accept
+        if (result.result == POLL_PENDING) {
+            break;
+        }
+
+        int client_fd = (int)(size_t)result.value;
+
+        // 2) we failed to accept the connection. This is usually something like running out of
+        // file descriptors, so there's no point in trying again right away.
+        if (client_fd < 0) {
+            println("failed to accept connection, dropping it and moving on.");
+            break;
+        }
+
+        // 3) we successfully accepted a connection that we should register as an HTTP handler
+        handler_future_t* future = new_handler_future(client_fd);
+        uint32_t generation = conn_map_insert(loop->conn_map, client_fd, future);
+        set_event_generation(client_fd, generation);
+        register_read_event(client_fd);
+        update_deadline(loop, future);
+        accepted++;
+    }
+
+    // One registration covers the whole batch. If we ran out of budget the listener is still
+    // readable, which the level-triggered modes will tell us about again. In edge-triggered mode no
+    // new edge is coming for those connections, so we have to remember them ourselves.
     register_read_event(server_fd);
-    conn_map_t* conn_map = conn_map_new(CONN_MAP_SIZE);
+    loop->accept_backlogged = edge_triggered && accepted == ACCEPT_BUDGET;
+}
 
-    // Main event loop:
-    while (!shutdown) {
-        println("starting new event loop");
-        block_until_events();
+// Handles a read event on the loop's wake fd: polls every connection whose work has come back from
+// the worker pool. Shutdown needs no handling here, the loop condition takes care of it.
+static void on_wakeup(event_loop_t* loop)
+{
+    int wake_fd = loop->wake_fds[0];
+    char buf[64];
+    while (io_read(wake_fd, buf, sizeof(buf)) > 0) { }
+    io_wait_readable(wake_fd);
+
+    work_item_t* item = completion_queue_take(&loop->completions);
+    while (item) {
+        // polling the connection frees the item
+        work_item_t* next = item->next;
+        // The connection stopped reading while it waited (see `io_suspend_reading`)
+        io_resume_reading(item->fd);
+        poll_connection(loop, item->fd);
+        item = next;
+    }
+}
+
+static void close_if_idle(int fd, handler_future_t* future, void* ctx)
+{
+    size_t progress;
+    // A request that has arrived already but hasn't been looked at yet still gets served
+    if (handler_timeout(future, &progress) == TIMEOUT_IDLE && !io_has_input(fd)) {
+        close_connection(ctx, fd);
+    }
+}
+
+// Stops accepting and closes the keepalive connections that are waiting for their next request.
+// Everything else is left to finish the request it is working on, see `poll_connection`.
+static void start_draining(event_loop_t* loop)
+{
+    loop->drain_deadline = clock_monotonic_ms() + (uint64_t)drain_timeout * 1000;
+
+    // The listener may live on in the process that took over from us, so it has to be taken out of
+    // the event queue explicitly
+    if (uring_enabled) {
+        uring_unlisten();
+    } else {
+        remove_events(loop->server_fd);
+    }
+    // Waits for a handoff that is under way to finish, which takes the new process at most as long
+    // as the ack timeout (see upgrade.c)
+    pthread_mutex_lock(&handoff_lock);
+    close(loop->server_fd);
+    pthread_mutex_unlock(&handoff_lock);
+    loop->server_fd = -1;
+    loop->accept_backlogged = false;
+
+    conn_map_for_each(loop->conn_map, close_if_idle, loop);
+    println("event loop %d is draining %zu connection(s)", loop->id, loop->conn_map->count);
+}
+
+// Checked before every loop iteration. Returns false once the loop should stop.
+static bool keep_running(event_loop_t* loop)
+{
+    if (shutting_down) {
+        return false;
+    }
+    if (draining && !loop->drain_deadline) {
+        start_draining(loop);
+    }
+    if (!loop->drain_deadline) {
+        return true;
+    }
+
+    if (loop->conn_map->count == 0) {
+        println("event loop %d has drained", loop->id);
+        return false;
+    }
+    if (clock_monotonic_ms() >= loop->drain_deadline) {
+        println("event loop %d gave up on draining, dropping %zu connection(s)", loop->id,
+            loop->conn_map->count);
+        return false;
+    }
+    return true;
+}
+
+// How long the loop may wait for events: until the next connection deadline, or the drain deadline
+static int wait_timeout(event_loop_t* loop)
+{
+    uint64_t now = clock_monotonic_ms();
+    int timeout = timer_wheel_timeout(&loop->timers, now);
+    if (loop->drain_deadline && loop->drain_deadline > now) {
+        int drain_left = (int)(loop->drain_deadline - now);
+        if (timeout < 0 || drain_left < timeout) {
+            timeout = drain_left;
+        }
+    }
+    return timeout;
+}
+
+static void run_event_loop(event_loop_t* loop)
+{
+    kqueue_init();
+    if (edge_triggered) {
+        enable_edge_triggered();
+    }
+    register_read_event(loop->server_fd);
+    register_read_event(loop->wake_fds[0]);
+
+    while (keep_running(loop)) {
+        event_stats_t stats = get_event_stats();
+        println("starting new event loop (last wait flushed %zu registrations, saved %zu syscalls)",
+            stats.registrations, stats.syscalls_saved);
+        // Don't block while there are connections left over from the last accept batch
+        int timeout = loop->accept_backlogged ? 0 : wait_timeout(loop);
+        block_until_events(timeout);
+        // Everything the loop does until it waits again happens at the time it woke up
+        clock_update();
 
+        bool accepted = false;
         eventlist_iter_t iter = get_eventlist_iter();
-        struct kevent* event;
+        event_t* event;
         while ((event = get_next_event(&iter)) != NULL) {
-            if ((int)event->ident == server_fd) {
-                // we are ready to accept a new connection:
-                async_result_t result = poll_accept_connection(server_fd);
-                // first of all, we want to re-register the server_fd for read events,
-                // since no matter what happens we want to be able to accept new
-                // connections
-                register_read_event(server_fd);
-
-                // There are 3 possible outcomes:
-                // 1) kqueue lied to us and we're not actually ready to accept a
-                // connection.
-                if (result.result == POLL_PENDING) {
-                    // nothing to do, since we've already re-registered the server_fd
+            int fd = event_fd(event);
+            if (fd == loop->wake_fds[0]) {
+                on_wakeup(loop);
+                continue;
+            }
+
+            if (fd != loop->server_fd) {
+                // The connection the event was meant for may have been closed earlier in this
+                // batch, and its fd handed to a new one since
+                if (!conn_map_lookup(loop->conn_map, fd, event_generation(event))) {
+                    println("ignoring stale event for fd %d", fd);
                     continue;
                 }
+                poll_connection(loop, fd);
+                continue;
+            }
 
-                int return_val = (int)(size_t)result.value;
+            // we are ready to accept new connections
+            accept_connections(loop);
+            accepted = true;
+        }
 
-                // 2) we successfully accepted a connection.
-                if (result.result == POLL_READY && return_val > 0) {
-                    // return_val is a file descriptor that we should register as an HTTP
-                    // handler
-                    handler_future_t* future = new_handler_future(return_val);
-                    conn_map_insert(conn_map, return_val, future);
-                    register_read_event(return_val);
-                }
+        // In edge-triggered mode the listener won't be reported again for connections that didn't
+        // fit into the last batch
+        if (loop->accept_backlogged && !accepted) {
+            accept_connections(loop);
+        }
 
-                // 3) we failed to accept the connection
-                if (result.result == POLL_READY && return_val < 0) {
-                    println("failed to accept connection, dropping it and moving on.");
-                }
+        expire_connections(loop);
+    }
+}
 
-            } else {
-                // we need to poll the handler associated with the event:
-                handler_future_t* future = conn_map_get(conn_map, event->ident);
-                if (future == NULL) {
-                    println("no handler found for fd %ld, ignoring event", event->ident);
-                    continue;
-                }
+#ifdef __linux__
+static void run_uring_event_loop(event_loop_t* loop)
+{
+    uring_init();
+    uring_listen(loop->server_fd);
+    uring_open_conn(loop->wake_fds[0]);
 
-                async_result_t result = poll_handler_future(future);
-                // Once again, there are 3 possible outcomes:
-                // 1) kqueue lied to us and we're not actually ready to read from the
-                // connection.
-                if (result.result == POLL_PENDING) {
-                    // nothing to do, since handler futures are responsible for
-                    // re-registering themselves
-                    continue;
-                }
+    while (keep_running(loop)) {
+        println("starting new event loop");
+        uring_wait(wait_timeout(loop));
+        clock_update();
 
-                long return_val = (long)result.value;
-                if (result.result == POLL_READY && return_val < 0) {
-                    // 2) our handler failed in some way, we just need to clean up and
-                    // move on
-                    println("failure while handling connection %ld, dropping it.", event->ident);
-                    conn_map_remove(conn_map, event->ident);
-                    close(event->ident);
-                    continue;
-                }
+        uring_event_t event;
+        while (uring_next_event(&event)) {
+            if (event.kind == URING_EVENT_ACCEPT) {
+                handler_future_t* future = new_handler_future(event.fd);
+                conn_map_insert(loop->conn_map, event.fd, future);
+                uring_open_conn(event.fd);
+                update_deadline(loop, future);
+                continue;
+            }
 
-                // 3) else, it succeeded, and we either need to close the connection or
-                // re-create the handler for the next request
-                handler_return_t handler_return = (handler_return_t)return_val;
-
-                if (handler_return == HANDLER_CLOSE) {
-                    println("HTTP handler future completed with CLOSE status");
-                    conn_map_remove(conn_map, event->ident);
-                    close(event->ident);
-                } else {
-                    println("HTTP handler future completed with KEEP_ALIVE status");
-                    register_read_event(event->ident);
-                }
+            if (event.fd == loop->wake_fds[0]) {
+                on_wakeup(loop);
+                continue;
             }
+
+            poll_connection(loop, event.fd);
+        }
+
+        expire_connections(loop);
+    }
+}
+#endif
+
+static void pin_to_cpu(int cpu)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu % sysconf(_SC_NPROCESSORS_ONLN), &set);
+    int r = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (r != 0) {
+        println("failed to pin event loop %d to a cpu: %s", cpu, strerror(r));
+    }
+#else
+    println("cpu pinning is not supported on this platform, ignoring it for event loop %d", cpu);
+#endif
+}
+
+static void* run_loop_thread(void* arg)
+{
+    event_loop_t* loop = arg;
+    if (pin_cpus) {
+        pin_to_cpu(loop->id);
+    }
+
+    loop->conn_map = conn_map_new(CONN_MAP_SIZE);
+    timer_wheel_init(&loop->timers, clock_monotonic_ms());
+    completion_queue_init(&loop->completions, loop->wake_fds[1]);
+
+    if (use_io_uring) {
+#ifdef __linux__
+        run_uring_event_loop(loop);
+#else
+        panic("io_uring is only available on Linux");
+#endif
+    } else {
+        run_event_loop(loop);
+    }
+
+    // What the request arenas of this loop went through, for sizing REQUEST_ARENA_SIZE
+    arena_stats_t arena_stats = arena_get_stats();
+    println("event loop %d arenas: high-water %zu bytes, at most %zu region(s), %zu bytes wasted, "
+            "%zu oversized allocation(s), %zu reset(s)",
+        loop->id, arena_stats.high_water, arena_stats.max_regions, arena_stats.bytes_wasted,
+        arena_stats.oversized, arena_stats.resets);
+    buffer_stats_t buffer_stats = buffer_get_stats();
+    println("event loop %d buffers: at most %zu segment(s) in use, %zu allocated",
+        loop->id, buffer_stats.max_in_use, buffer_stats.allocated);
+
+    println("event loop %d closed", loop->id);
+    return NULL;
+}
+
+// Waits for the process that replaces us to connect to the upgrade socket, hands it the listening
+// sockets of every loop, and drains this one. Once we are draining anyway, the upgrade socket is
+// closed, so that a new process that tries to connect after that fails right away.
+static void* run_upgrade_listener(void* arg)
+{
+    upgrade_listener_t* self = arg;
+    struct pollfd fds[2] = {
+        { .fd = self->listen_fd, .events = POLLIN },
+        { .fd = self->wake_fds[0], .events = POLLIN },
+    };
+
+    while (!draining) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+        if (!(fds[0].revents & POLLIN)) {
+            continue;
+        }
+
+        int conn_fd = accept(self->listen_fd, NULL, NULL);
+        if (conn_fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("accept");
+            break;
+        }
+
+        // A loop that has started draining may have closed its listener already. One that starts
+        // now waits for the handoff to finish before it does.
+        pthread_mutex_lock(&handoff_lock);
+        int r = draining ? -1 : upgrade_send_fds(conn_fd, self->fds, self->count);
+        if (r == 0) {
+            draining = 1;
+        }
+        pthread_mutex_unlock(&handoff_lock);
+        close(conn_fd);
+
+        if (r == 0) {
+            println("handed %d listening socket(s) to a new process, draining connections...",
+                self->count);
+            wake_loops();
         }
     }
 
+    close(self->listen_fd);
+    return NULL;
+}
+
+static int parse_timeout(const char* option, const char* value)
+{
+    int seconds = atoi(value);
+    if (seconds < 1) {
+        panic("%s must be at least 1 second", option);
+    }
+    return seconds;
+}
+
+int main(int argc, char* argv[])
+{
+    if (signal(SIGINT, on_signal) == SIG_ERR || signal(SIGTERM, on_signal) == SIG_ERR) {
+        perror("failed to register signal handler");
+        return 1;
+    }
+    // A client that resets its connection turns the next write into EPIPE rather than killing us.
+    // The sends through the ring say MSG_NOSIGNAL, but `writev` and `sendfile` can't.
+    signal(SIGPIPE, SIG_IGN);
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "hvp:uet:cw:b:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'h':
+            printf("Usage: %s [OPTION]...\n", argv[0]);
+            printf("Async http server for fun.\n\n");
+            printf("  -p, --port=PORT            specify the port to listen on\n");
+            printf("  -u, --io-uring             use io_uring instead of epoll (Linux only)\n");
+            printf("  -e, --edge-triggered       register each connection once, edge-triggered\n");
+            printf("  -t, --threads=N            run N event loops on their own threads\n");
+            printf("  -c, --pin-cpus             pin each event loop thread to its own cpu\n");
+            printf("  -w, --io-threads=N         read files on N worker threads (default 4, 0\n");
+            printf("                             reads them on the event loop)\n");
+            printf("  -b, --backlog=N            length of the queue of connections waiting to\n");
+            printf("                             be accepted (default SOMAXCONN)\n");
+            printf("      --defer-accept=SECS    only wake up for new connections once they\n");
+            printf("                             have sent data, or after SECS (Linux only)\n");
+            printf("      --fastopen=N           accept TCP Fast Open connections, with at most\n");
+            printf("                             N pending\n");
+            printf("      --idle-timeout=SECS    close keepalive connections that are idle for\n");
+            printf("                             longer than this (default 60)\n");
+            printf("      --header-timeout=SECS  time allowed for sending the request headers\n");
+            printf("                             (default 10)\n");
+            printf("      --body-timeout=SECS    close connections that stop sending their\n");
+            printf("                             request body for this long (default 30)\n");
+            printf("      --write-timeout=SECS   close connections that stop accepting their\n");
+            printf("                             response for this long (default 30)\n");
+            printf("      --drain-timeout=SECS   time in-flight requests get to finish after\n");
+            printf("                             SIGINT or SIGTERM (default 30)\n");
+            printf("      --upgrade-socket=PATH  hand the listening sockets to a new process\n");
+            printf("                             that connects to the Unix socket at PATH\n");
+            printf("      --upgrade              take over the listening sockets of the server\n");
+            printf("                             at --upgrade-socket, which then drains\n");
+            printf("      --spool-threshold=N    spool request bodies larger than N bytes to a\n");
+            printf("                             temp file (default 65536)\n");
+            printf("      --spool-dir=PATH       where to create the temp files (default\n");
+            printf("                             $TMPDIR, or /tmp)\n");
+            printf("      --max-body-size=N      turn away requests with a body larger than N\n");
+            printf("                             bytes (default 1073741824)\n");
+            printf("  -h, --help                 display this help and exit\n");
+            printf("  -v, --version              output version information and exit\n");
+            return 0;
+        case 'v':
+            printf("c-http %s\n", VERSION);
+            return 0;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'u':
+            use_io_uring = true;
+            break;
+        case 'e':
+            edge_triggered = true;
+            break;
+        case 't':
+            thread_count = atoi(optarg);
+            if (thread_count < 1) {
+                panic("--threads must be at least 1");
+            }
+            break;
+        case 'c':
+            pin_cpus = true;
+            break;
+        case 'b':
+            backlog = atoi(optarg);
+            if (backlog < 1) {
+                panic("--backlog must be at least 1");
+            }
+            break;
+        case OPT_DEFER_ACCEPT:
+            defer_accept = parse_timeout("--defer-accept", optarg);
+            break;
+        case OPT_FASTOPEN:
+            fastopen = atoi(optarg);
+            if (fastopen < 1) {
+                panic("--fastopen must be at least 1");
+            }
+            break;
+        case 'w':
+            io_thread_count = atoi(optarg);
+            if (io_thread_count < 0) {
+                panic("--io-threads can't be negative");
+            }
+            break;
+        case OPT_IDLE_TIMEOUT:
+            idle_timeout = parse_timeout("--idle-timeout", optarg);
+            break;
+        case OPT_HEADER_TIMEOUT:
+            header_timeout = parse_timeout("--header-timeout", optarg);
+            break;
+        case OPT_BODY_TIMEOUT:
+            body_timeout = parse_timeout("--body-timeout", optarg);
+            break;
+        case OPT_WRITE_TIMEOUT:
+            write_timeout = parse_timeout("--write-timeout", optarg);
+            break;
+        case OPT_DRAIN_TIMEOUT:
+            drain_timeout = parse_timeout("--drain-timeout", optarg);
+            break;
+        case OPT_UPGRADE_SOCKET:
+            upgrade_socket = optarg;
+            break;
+        case OPT_UPGRADE:
+            upgrade = true;
+            break;
+        case OPT_SPOOL_THRESHOLD:
+            spool_threshold = atol(optarg);
+            if (spool_threshold < 0) {
+                panic("--spool-threshold can't be negative");
+            }
+            break;
+        case OPT_SPOOL_DIR:
+            spool_dir = optarg;
+            break;
+        case OPT_MAX_BODY_SIZE:
+            max_body_size = atol(optarg);
+            if (max_body_size < 0) {
+                panic("--max-body-size can't be negative");
+            }
+            break;
+        default:
+            return 1;
+        }
+    }
+
+    int inherited_fds[UPGRADE_MAX_FDS];
+    if (upgrade) {
+        if (!upgrade_socket) {
+            panic("--upgrade requires --upgrade-socket");
+        }
+        // Every inherited listener needs a loop accepting from it, or the connections queued on it
+        // would never be picked up
+        int inherited = upgrade_receive_fds(upgrade_socket, inherited_fds, UPGRADE_MAX_FDS);
+        if (inherited < 0) {
+            panic("failed to take over the listening sockets from %s", upgrade_socket);
+        }
+        if (inherited != thread_count) {
+            println("took over %d listening socket(s), running as many event loops", inherited);
+        }
+        thread_count = inherited;
+    } else if (upgrade_socket && thread_count > UPGRADE_MAX_FDS) {
+        panic("at most %d event loops can be handed over through --upgrade-socket",
+            UPGRADE_MAX_FDS);
+    }
+
+    println("starting server on port %d with %d event loop(s)...", port, thread_count);
+
+    server_options_t server_options = {
+        .port = port,
+        .reuse_port = thread_count > 1,
+        .backlog = backlog,
+        .defer_accept = defer_accept,
+        .fastopen = fastopen,
+    };
+
+    if (!spool_dir) {
+        spool_dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    }
+    body_configure(spool_threshold, max_body_size, spool_dir);
+
+    // Everything is a file under the data directory, whatever the method
+    router_init(&router);
+    router_add(&router, NULL, "/*path", serve_files, NULL);
+    handler_set_router(&router);
+
+    loops = calloc(thread_count, sizeof(event_loop_t));
+    for (int i = 0; i < thread_count; i++) {
+        loops[i].id = i;
+        loops[i].server_fd = upgrade ? inherited_fds[i] : start_server(&server_options);
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, loops[i].wake_fds) < 0) {
+            perror("socketpair");
+            return 1;
+        }
+        // neither the loop draining it nor a writer (possibly a signal handler) may block
+        for (int j = 0; j < 2; j++) {
+            int flags = fcntl(loops[i].wake_fds[j], F_GETFL, 0);
+            fcntl(loops[i].wake_fds[j], F_SETFL, flags | O_NONBLOCK);
+        }
+    }
+
+    workers_start(io_thread_count);
+
+    // Only listen for our own replacement once we have finished taking over, since this replaces
+    // the socket of the process we took over from
+    if (upgrade_socket) {
+        upgrade_listener.listen_fd = upgrade_listen(upgrade_socket);
+        if (upgrade_listener.listen_fd < 0) {
+            panic("failed to listen on %s", upgrade_socket);
+        }
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, upgrade_listener.wake_fds) < 0) {
+            perror("socketpair");
+            return 1;
+        }
+        fcntl(upgrade_listener.wake_fds[1], F_SETFL,
+            fcntl(upgrade_listener.wake_fds[1], F_GETFL, 0) | O_NONBLOCK);
+        for (int i = 0; i < thread_count; i++) {
+            upgrade_listener.fds[i] = loops[i].server_fd;
+        }
+        upgrade_listener.count = thread_count;
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, run_upgrade_listener, &upgrade_listener) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+        pthread_detach(thread);
+    }
+
+    // The main thread runs the first loop itself
+    for (int i = 1; i < thread_count; i++) {
+        if (pthread_create(&loops[i].thread, NULL, run_loop_thread, &loops[i]) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+    run_loop_thread(&loops[0]);
+
+    for (int i = 1; i < thread_count; i++) {
+        pthread_join(loops[i].thread, NULL);
+    }
+
     println("event loop closed, exiting server program");
 }
@@ -1,75 +1,199 @@
+#include "clock.h"
 #include "common.h"
 #include "kqueue.h"
 #include "response.h"
+#include "uring.h"
 #include <assert.h>
 #include <errno.h>
+#include <stdalign.h>
 #include <stdio.h>
+#include <limits.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
-static void init_response_buffer(response_buffer_t* buffer)
+// Initial capacity of the header buffer
+#define RESPONSE_HEADERS_SIZE 512
+// The largest body a held response copies into the output. A larger one goes out right away, from
+// where it is.
+#define MAX_HELD_BODY BUFFER_SEGMENT_CAP
+// Length of the Date header line
+#define DATE_LINE_LEN (6 + CLOCK_HTTP_DATE_LEN + 2)
+// The most buffers a single write of the output takes
+#define OUTPUT_MAX_IOV 16
+
+typedef struct prebuilt_t {
+    const char* data;
+    size_t len;
+} prebuilt_t;
+
+#define PREBUILT(text) { text, sizeof(text) - 1 }
+
+#define STATUS_LINE(id, code, reason) [id] = PREBUILT("HTTP/1.1 " #code " " reason "\r\n"),
+static const prebuilt_t status_lines[] = { HTTP_STATUSES(STATUS_LINE) };
+#undef STATUS_LINE
+
+#define STATUS_CODE(id, code, reason) [id] = code,
+static const int status_codes[] = { HTTP_STATUSES(STATUS_CODE) };
+#undef STATUS_CODE
+
+typedef struct canned_t {
+    prebuilt_t response;
+    bool close;
+} canned_t;
+
+#define CANNED(headers) PREBUILT(headers "Content-Length: 0\r\n\r\n")
+#define CLOSE "Connection: close\r\n"
+
+static const canned_t canned[STATUS_COUNT] = {
+    [STATUS_BAD_REQUEST] = { CANNED(CLOSE), true },
+    [STATUS_NOT_FOUND] = { CANNED(""), false },
+    [STATUS_METHOD_NOT_ALLOWED] = { CANNED(""), false },
+    [STATUS_CONTENT_TOO_LARGE] = { CANNED(CLOSE), true },
+    [STATUS_HEADERS_TOO_LARGE] = { CANNED(CLOSE), true },
+    [STATUS_SERVICE_UNAVAILABLE] = { CANNED(CLOSE), true },
+};
+
+#undef CLOSE
+#undef CANNED
+
+// "00" to "99", so that integers can be formatted two digits at a time
+static const char digit_pairs[] = "00010203040506070809"
+                                  "10111213141516171819"
+                                  "20212223242526272829"
+                                  "30313233343536373839"
+                                  "40414243444546474849"
+                                  "50515253545556575859"
+                                  "60616263646566676869"
+                                  "70717273747576777879"
+                                  "80818283848586878889"
+                                  "90919293949596979899";
+
+static size_t decimal_digits(uint64_t value)
+{
+    size_t digits = 1;
+    while (value >= 10000) {
+        value /= 10000;
+        digits += 4;
+    }
+    return digits + (value >= 10) + (value >= 100) + (value >= 1000);
+}
+
+// Writes the `digits` digits of `value` to `out`, from the back
+static void format_decimal(char* out, size_t digits, uint64_t value)
+{
+    char* p = out + digits;
+    while (value >= 100) {
+        const char* pair = digit_pairs + (value % 100) * 2;
+        value /= 100;
+        *--p = pair[1];
+        *--p = pair[0];
+    }
+    if (value >= 10) {
+        memcpy(p - 2, digit_pairs + value * 2, 2);
+    } else {
+        p[-1] = '0' + value;
+    }
+}
+
+int http_status_code(http_status_t status) { return status_codes[status]; }
+
+// Makes sure the buffer can hold `needed` bytes. Like everything else in the response, the memory
+// comes from the request arena, so an outgrown buffer is simply left behind until the arena is
+// reset.
+static void reserve(arena_t* arena, response_buffer_t* buffer, size_t needed)
 {
-    buffer->cap = 1024;
-    buffer->len = 0;
-    buffer->cursor = 0;
-    buffer->data = malloc(buffer->cap);
+    if (needed <= buffer->cap) {
+        return;
+    }
+
+    size_t cap = buffer->cap * 2;
+    if (cap < needed) {
+        cap = needed;
+    }
+
+    char* data = arena_alloc(arena, cap, 1);
+    if (buffer->len > 0) {
+        memcpy(data, buffer->data, buffer->len);
+    }
+    buffer->data = data;
+    buffer->cap = cap;
 }
 
-response_t* response_new()
+response_t* response_new(arena_t* arena, response_output_t* output)
 {
-    response_t* response = malloc(sizeof(response_t));
+    response_t* response = arena_alloc(arena, sizeof(response_t), alignof(response_t));
     bzero(response, sizeof(response_t));
 
+    response->arena = arena;
+    response->output = output;
     response->state = RESPONSE_PREPARE;
-    init_response_buffer(&response->write_buffer);
-    init_response_buffer(&response->headers);
+    reserve(arena, &response->headers, RESPONSE_HEADERS_SIZE);
 
     return response;
 }
 
-void response_free(response_t* response)
+void response_release(response_t* response)
 {
-    free(response->write_buffer.data);
-    free(response->headers.data);
-    // note: body expected to be freed by caller
-    free(response);
+    if (response->segment) {
+        buffer_segment_put(response->segment);
+        response->segment = NULL;
+    }
 }
 
-void response_write_header_str(response_t* self, const char* key, const char* value)
+void response_output_release(response_output_t* output)
 {
-    // 4 = space + colon + \r\n + null terminator that we will overwrite
-    size_t buf_len = strlen(key) + strlen(value) + 5;
-    char buf[buf_len];
-    snprintf(buf, buf_len, "%s: %s\r\n", key, value);
-
-    // make sure we have enough data in the headers buffer
-    if (self->headers.cursor + buf_len > self->headers.cap) {
-        self->headers.cap *= 2;
-        self->headers.data = realloc(self->headers.data, self->headers.cap);
+    buffer_chain_release(&output->chain);
+    output->offset = 0;
+    output->body = NULL;
+    output->body_len = 0;
+    if (output->file_len > 0) {
+        close(output->file_fd);
+        output->file_len = 0;
     }
+}
 
-    memcpy(self->headers.data + self->headers.cursor, buf, buf_len);
-    self->headers.cursor += buf_len - 1;
-    self->headers.len += buf_len - 1;
+// Makes room for `len` more bytes of headers, and returns where they go
+static char* header_space(response_t* self, size_t len)
+{
+    reserve(self->arena, &self->headers, self->headers.cursor + len);
+    char* p = self->headers.data + self->headers.cursor;
+    self->headers.cursor += len;
+    self->headers.len += len;
+    return p;
 }
 
-void response_write_header_int(response_t* self, const char* key, int value)
+static char* put(char* p, const char* data, size_t len)
 {
-    // get the number of characters we need to render value:
-    int num_chars = snprintf(NULL, 0, "%d", value);
-    // 4 = space + colon + \r\n + the null terminator that we will overwrite
-    size_t buf_len = strlen(key) + num_chars + 5;
-    char buf[buf_len];
-    snprintf(buf, buf_len, "%s: %d\r\n", key, value);
+    memcpy(p, data, len);
+    return p + len;
+}
 
-    // make sure we have enough data in the headers buffer
-    if (self->headers.cursor + buf_len > self->headers.cap) {
-        self->headers.cap *= 2;
-        self->headers.data = realloc(self->headers.data, self->headers.cap);
-    }
+void response_write_header_str(response_t* self, const char* key, const char* value)
+{
+    size_t key_len = strlen(key);
+    size_t value_len = strlen(value);
+    char* p = header_space(self, key_len + value_len + 4);
+    p = put(p, key, key_len);
+    p = put(p, ": ", 2);
+    p = put(p, value, value_len);
+    put(p, "\r\n", 2);
+}
 
-    memcpy(self->headers.data + self->headers.cursor, buf, buf_len);
-    self->headers.cursor += buf_len - 1;
-    self->headers.len += buf_len - 1;
+void response_write_header_int(response_t* self, const char* key, long value)
+{
+    // Negated as unsigned, so that LONG_MIN works too
+    uint64_t magnitude = value < 0 ? 0 - (uint64_t)value : (uint64_t)value;
+    size_t digits = decimal_digits(magnitude);
+    size_t key_len = strlen(key);
+    char* p = header_space(self, key_len + (value < 0) + digits + 4);
+    p = put(p, key, key_len);
+    p = put(p, ": ", 2);
+    if (value < 0) {
+        *p++ = '-';
+    }
+    format_decimal(p, digits, magnitude);
+    put(p + digits, "\r\n", 2);
 }
 
 void response_write_body(response_t* response, char* body, size_t len)
@@ -78,38 +202,122 @@ void response_write_body(response_t* response, char* body, size_t len)
     response->body_len = len;
 }
 
-static void write_bytes(response_buffer_t* buffer, const char* data, size_t len)
+void response_write_segment(response_t* response, buffer_segment_t* segment)
+{
+    response_write_body(response, segment->data, segment->len);
+    response->segment = segment;
+}
+
+void response_write_file(response_t* response, int fd, size_t len)
+{
+    if (len == 0) {
+        close(fd);
+        return;
+    }
+    response->output->file_fd = fd;
+    response->output->file_offset = 0;
+    response->output->file_len = len;
+}
+
+bool response_write_canned(response_t* response, http_status_t status)
 {
-    // make sure we have enough space in buffer:
-    if (buffer->cursor + len > buffer->cap) {
-        buffer->cap *= 2;
-        buffer->data = realloc(buffer->data, buffer->cap);
+    if (status >= STATUS_COUNT || !canned[status].response.data) {
+        return false;
     }
 
-    memcpy(buffer->data + buffer->cursor, data, len);
-    buffer->cursor += len;
-    buffer->len += len;
+    response->status = status;
+    response->canned = canned[status].response.data;
+    response->canned_len = canned[status].response.len;
+    response->close = canned[status].close;
+    response->body = NULL;
+    response->body_len = 0;
+    if (response->output->file_len > 0) {
+        close(response->output->file_fd);
+        response->output->file_len = 0;
+    }
+    return true;
 }
 
-static async_result_t poll_flush_write_buf(int fd, response_buffer_t* stream)
+// Drops the `len` bytes at the front of the output, which have been written. Each segment goes back
+// to the pool as soon as it is out.
+static void output_advance(response_output_t* self, size_t len)
 {
-    int bytes_written = write(fd, stream->data + stream->cursor, stream->len - stream->cursor);
-    while (bytes_written != -1) {
-        stream->cursor += bytes_written;
-        // we're done
-        if (stream->cursor == stream->len) {
-            async_result_t res = { .result = POLL_READY, .value = (void*)0 };
-            return res;
+    self->bytes_written += len;
+    while (len > 0 && self->chain.head) {
+        buffer_segment_t* segment = self->chain.head;
+        size_t left = segment->len - self->offset;
+        if (len < left) {
+            self->offset += len;
+            return;
         }
+        len -= left;
+        buffer_segment_put(buffer_chain_pop(&self->chain));
+        self->offset = 0;
+    }
+
+    size_t body = len < self->body_len ? len : self->body_len;
+    self->body += body;
+    self->body_len -= body;
+    len -= body;
 
-        // otherwise try again
-        bytes_written = write(fd, stream->data + stream->cursor, stream->len - stream->cursor);
+    // `sendfile` has moved the file offset along already
+    self->file_len -= len;
+    if (len > 0 && self->file_len == 0) {
+        close(self->file_fd);
+    }
+}
+
+async_result_t poll_response_output_flush(response_output_t* self, int fd)
+{
+    // Write the segments and the body out together, and then the file, picking up where the last
+    // call left off
+    while (self->chain.head || self->body_len > 0 || self->file_len > 0) {
+        ssize_t bytes_written;
+        if (self->chain.head || self->body_len > 0) {
+            struct iovec iov[OUTPUT_MAX_IOV];
+            int count = 0;
+            size_t offset = self->offset;
+            buffer_segment_t* segment = self->chain.head;
+            for (; segment && count < OUTPUT_MAX_IOV; segment = segment->next) {
+                iov[count++] = (struct iovec) {
+                    .iov_base = segment->data + offset,
+                    .iov_len = segment->len - offset,
+                };
+                offset = 0;
+            }
+            // The body comes after all of the segments, so it has to wait if they didn't all fit
+            if (!segment && self->body_len > 0 && count < OUTPUT_MAX_IOV) {
+                iov[count++] = (struct iovec) {
+                    .iov_base = (char*)self->body,
+                    .iov_len = self->body_len,
+                };
+            }
+            bytes_written = io_writev(fd, iov, count, self->file_len > 0);
+        } else {
+            bytes_written = io_sendfile(fd, self->file_fd, &self->file_offset, self->file_len);
+            if (bytes_written == 0) {
+                // The file got shorter since we said how long the body is
+                errno = EIO;
+                bytes_written = -1;
+            }
+        }
+
+        if (bytes_written == -1) {
+            break;
+        }
+        output_advance(self, bytes_written);
+    }
+
+    // we're done
+    if (!self->chain.head && self->body_len == 0 && self->file_len == 0) {
+        async_result_t res = { .result = POLL_READY, .value = (void*)0 };
+        return res;
     }
 
     // 1) we errored because it would block, so we just need to re-register
     // ourselves for the write
     if (errno == EAGAIN || errno == EWOULDBLOCK) {
-        register_write_event(fd);
+        io_wait_writable(fd);
         async_result_t res = { .result = POLL_PENDING, .value = NULL };
         return res;
     }
@@ -120,35 +328,52 @@ static async_result_t poll_flush_write_buf(int fd, response_buffer_t* stream)
     return res;
 }
 
-async_result_t poll_response_write_buffer(response_t* self, int fd)
+async_result_t poll_response_write_buffer(response_t* self, int fd, bool hold)
 {
     while (1) {
         switch (self->state) {
         case RESPONSE_PREPARE: {
-            // header line:
-            write_bytes(&self->write_buffer, "HTTP/1.1 ", 9);
-            write_bytes(&self->write_buffer, self->status_code, strlen(self->status_code));
-            write_bytes(&self->write_buffer, " ", 1);
-            write_bytes(&self->write_buffer, self->status_text, strlen(self->status_text));
-            write_bytes(&self->write_buffer, "\r\n", 2);
-
-            if (self->headers.len > 0) {
-                // headers:
-                write_bytes(&self->write_buffer, self->headers.data, self->headers.cursor);
+            buffer_chain_t* buffer = &self->output->chain;
+            const char* body = self->body;
+            size_t body_len = self->body_len;
+
+            const prebuilt_t* status_line = &status_lines[self->status];
+            buffer_chain_append(buffer, status_line->data, status_line->len);
+
+            // Every response is dated, with the date the clock formats once a second
+            char date[DATE_LINE_LEN];
+            memcpy(date, "Date: ", 6);
+            memcpy(date + 6, clock_http_date(), CLOCK_HTTP_DATE_LEN);
+            memcpy(date + 6 + CLOCK_HTTP_DATE_LEN, "\r\n", 2);
+            buffer_chain_append(buffer, date, DATE_LINE_LEN);
+
+            if (self->canned) {
+                // The rest of a canned response goes out like a body would
+                body = self->canned;
+                body_len = self->canned_len;
+            } else {
+                buffer_chain_append(buffer, self->headers.data, self->headers.cursor);
+                buffer_chain_append(buffer, "\r\n", 2);
             }
-            write_bytes(&self->write_buffer, "\r\n", 2);
 
-            if (self->body_len > 0) {
-                write_bytes(&self->write_buffer, self->body, self->body_len);
+            // Nothing comes after a response that closes the connection, so there is no reason to
+            // hold it back
+            if (self->close || body_len > MAX_HELD_BODY || self->output->file_len > 0) {
+                hold = false;
+            }
+            if (body_len > 0 && hold) {
+                buffer_chain_append(buffer, body, body_len);
+            } else if (body_len > 0) {
+                self->output->body = body;
+                self->output->body_len = body_len;
             }
 
-            self->write_buffer.cursor = 0;
-            self->state = RESPONSE_POLLING;
+            self->state = hold ? RESPONSE_DONE : RESPONSE_POLLING;
             break;
         }
         case RESPONSE_POLLING: {
             void* r;
-            ready(poll_flush_write_buf(fd, &self->write_buffer), r);
+            ready(poll_response_output_flush(self->output, fd), r);
             long ret_val = (long)r;
             if (ret_val < 0) {
                 return (async_result_t) { .result = POLL_READY, .value = (void*)-1 };
@@ -164,3 +389,162 @@ async_result_t poll_response_write_buffer(response_t* self, int fd)
         }
     }
 }
+
+/**
+ ***************************************************************************************************
+ * Tests
+ ***************************************************************************************************
+ */
+#define test_assert(cond, msg)                                                                     \
+    do {                                                                                           \
+        if (!(cond)) {                                                                             \
+            printf("Assertion failed: %s\n", msg);                                                 \
+            return -1;                                                                             \
+        }                                                                                          \
+    } while (0)
+
+// Responses are dated, so the tests pin the clock to a known time, see `response_test_suite`
+#define TEST_NOW 784111777
+#define TEST_DATE "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+
+static int test_status_lines()
+{
+#define CHECK_STATUS(id, code, reason)                                                             \
+    do {                                                                                           \
+        char expected[128];                                                                        \
+        int len = snprintf(expected, sizeof(expected), "HTTP/1.1 %d %s\r\n", code, reason);        \
+        test_assert(status_lines[id].len == (size_t)len                                            \
+                && memcmp(status_lines[id].data, expected, len) == 0                               \
+                && http_status_code(id) == code,                                                   \
+            "expected the status line to be " #code " " reason);                                   \
+    } while (0);
+    HTTP_STATUSES(CHECK_STATUS)
+#undef CHECK_STATUS
+    return 0;
+}
+
+static int test_header_values()
+{
+    arena_t* arena = arena_create(1024);
+    response_output_t output = { 0 };
+    response_t* response = response_new(arena, &output);
+
+    long values[] = { 0, 7, 10, 99, 100, 999, 1000, 9999, 10000, 123456789, 1000000000000, -1,
+        -42, LONG_MAX, LONG_MIN };
+    char expected[4096];
+    size_t expected_len = 0;
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+        response_write_header_int(response, "Content-Length", values[i]);
+        expected_len += snprintf(expected + expected_len, sizeof(expected) - expected_len,
+            "Content-Length: %ld\r\n", values[i]);
+    }
+    response_write_header_str(response, "Content-Type", "text/html");
+    response_write_header_str(response, "X-Empty", "");
+    expected_len += snprintf(expected + expected_len, sizeof(expected) - expected_len,
+        "Content-Type: text/html\r\nX-Empty: \r\n");
+    test_assert(response->headers.len == expected_len
+            && memcmp(response->headers.data, expected, expected_len) == 0,
+        "expected the headers as snprintf would write them");
+
+    // Past the initial capacity, the buffer grows
+    for (int i = 0; i < 100; i++) {
+        response_write_header_int(response, "X-Count", i);
+    }
+    test_assert(response->headers.len == expected_len + 10 * 12 + 90 * 13,
+        "expected the buffer to grow to fit the headers");
+
+    arena_release(arena);
+    return 0;
+}
+
+// Reads from `fd` until the other end closes or `len` bytes have arrived
+static size_t read_all(int fd, char* buf, size_t len)
+{
+    size_t received = 0;
+    ssize_t n;
+    while (received < len && (n = read(fd, buf + received, len - received)) > 0) {
+        received += n;
+    }
+    return received;
+}
+
+static int test_canned_responses()
+{
+    int fds[2];
+    test_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0, "failed to create a socket pair");
+    arena_t* arena = arena_create(1024);
+    response_output_t output = { 0 };
+
+    // A canned response goes out in one write, whatever else was written
+    response_t* response = response_new(arena, &output);
+    response_write_header_str(response, "Content-Type", "text/html");
+    response_write_body(response, "hello", 5);
+    test_assert(response_write_canned(response, STATUS_BAD_REQUEST) && response->close,
+        "expected a canned 400 that closes the connection");
+    async_result_t r = poll_response_write_buffer(response, fds[0], true);
+    test_assert(r.result == POLL_READY && r.value == 0 && output.chain.len == 0,
+        "expected the canned response to be written in one go");
+    const char* bad_request = "HTTP/1.1 400 Bad Request\r\n" TEST_DATE
+                              "Connection: close\r\n"
+                              "Content-Length: 0\r\n\r\n";
+    char received[256];
+    size_t len = strlen(bad_request);
+    test_assert(read_all(fds[1], received, len) == len
+            && memcmp(received, bad_request, len) == 0,
+        "expected the canned 400");
+
+    // One that keeps the connection open can be held back for the next response to join
+    response = response_new(arena, &output);
+    test_assert(response_write_canned(response, STATUS_NOT_FOUND) && !response->close,
+        "expected a canned 404 that keeps the connection open");
+    r = poll_response_write_buffer(response, fds[0], true);
+    const char* not_found = "HTTP/1.1 404 Not Found\r\n" TEST_DATE "Content-Length: 0\r\n\r\n";
+    test_assert(r.result == POLL_READY && output.chain.len == strlen(not_found),
+        "expected the canned 404 to be held");
+    response = response_new(arena, &output);
+    response->status = STATUS_NO_CONTENT;
+    r = poll_response_write_buffer(response, fds[0], false);
+    const char* both = "HTTP/1.1 404 Not Found\r\n" TEST_DATE "Content-Length: 0\r\n\r\n"
+                       "HTTP/1.1 204 No Content\r\n" TEST_DATE "\r\n";
+    len = strlen(both);
+    test_assert(r.result == POLL_READY && r.value == 0 && read_all(fds[1], received, len) == len
+            && memcmp(received, both, len) == 0,
+        "expected the held 404 to go out with the next response");
+
+    response = response_new(arena, &output);
+    test_assert(!response_write_canned(response, STATUS_OK) && !response->canned,
+        "expected no canned response for 200");
+
+    response_output_release(&output);
+    arena_release(arena);
+    close(fds[0]);
+    close(fds[1]);
+    return 0;
+}
+
+int response_test_suite()
+{
+    int r = 0;
+    clock_set(TEST_NOW, 0);
+    if (test_status_lines() < 0) {
+        r = -1;
+        printf("\t❌ test_status_lines\n");
+    } else {
+        printf("\t✅ test_status_lines\n");
+    }
+    if (test_header_values() < 0) {
+        r = -1;
+        printf("\t❌ test_header_values\n");
+    } else {
+        printf("\t✅ test_header_values\n");
+    }
+    if (test_canned_responses() < 0) {
+        r = -1;
+        printf("\t❌ test_canned_responses\n");
+    } else {
+        printf("\t✅ test_canned_responses\n");
+    }
+    // back to the real time
+    clock_update();
+    return r;
+}
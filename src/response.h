@@ -1,6 +1,36 @@
 #pragma once
 
+#include "arena.h"
+#include "buffer.h"
 #include "common.h"
+#include <sys/types.h>
+
+// X(id, code, reason) for every status we answer with. The status lines are put together at compile
+// time, so writing one is a single copy.
+#define HTTP_STATUSES(X)                                                                           \
+    X(STATUS_OK, 200, "OK")                                                                        \
+    X(STATUS_CREATED, 201, "Created")                                                              \
+    X(STATUS_NO_CONTENT, 204, "No Content")                                                        \
+    X(STATUS_PARTIAL_CONTENT, 206, "Partial Content")                                              \
+    X(STATUS_MOVED_PERMANENTLY, 301, "Moved Permanently")                                          \
+    X(STATUS_FOUND, 302, "Found")                                                                  \
+    X(STATUS_NOT_MODIFIED, 304, "Not Modified")                                                    \
+    X(STATUS_BAD_REQUEST, 400, "Bad Request")                                                      \
+    X(STATUS_FORBIDDEN, 403, "Forbidden")                                                          \
+    X(STATUS_NOT_FOUND, 404, "Not Found")                                                          \
+    X(STATUS_METHOD_NOT_ALLOWED, 405, "Method Not Allowed")                                        \
+    X(STATUS_REQUEST_TIMEOUT, 408, "Request Timeout")                                              \
+    X(STATUS_CONTENT_TOO_LARGE, 413, "Content Too Large")                                          \
+    X(STATUS_HEADERS_TOO_LARGE, 431, "Request Header Fields Too Large")                            \
+    X(STATUS_INTERNAL_SERVER_ERROR, 500, "Internal Server Error")                                  \
+    X(STATUS_SERVICE_UNAVAILABLE, 503, "Service Unavailable")
+
+#define STATUS_ENUM(id, code, reason) id,
+typedef enum http_status_t {
+    HTTP_STATUSES(STATUS_ENUM)
+    STATUS_COUNT,
+} http_status_t;
+#undef STATUS_ENUM
 
 typedef enum response_write_state_t {
     RESPONSE_PREPARE,
@@ -8,7 +38,7 @@ typedef enum response_write_state_t {
     RESPONSE_DONE,
 } response_write_state_t;
 
-// The actual buffer of data that we write to a file descriptor
+// A buffer in the request arena
 typedef struct response_buffer_t {
     // allocated memory to write to
     char* data;
@@ -16,27 +46,98 @@ typedef struct response_buffer_t {
     size_t cap;
     // the actual length of the real data in the buffer
     size_t len;
-    // variable cursor into the buffer tracking how much data we have written
+    // variable cursor into the buffer tracking how much data we have written into it
     size_t cursor;
 } response_buffer_t;
 
+// Responses on their way to the client. It belongs to the connection rather than to a response, so
+// that the responses to pipelined requests can be held back and go out together, in as few writes
+// as possible. Everything goes out in a single `writev`, as far as the socket takes it: the copied
+// bytes in `chain`, and after them the body of the last response, right from where it lies. A body
+// that is a file goes out last, with `sendfile`.
+typedef struct response_output_t {
+    // The status lines and headers of the responses, and the bodies of the ones that were held
+    // back, in pooled segments. A held response's request is over before it goes out, so its body
+    // has to come along.
+    buffer_chain_t chain;
+    // How far into the first segment has been written
+    size_t offset;
+    // What is left of the body of the last response, which is written without being copied. Its
+    // request waits for the write, so the body stays where it is until then.
+    const char* body;
+    size_t body_len;
+    // The file the body of the last response is sent from, and how much of it is left to send. The
+    // output owns the file, which is open as long as there is some of it left.
+    int file_fd;
+    off_t file_offset;
+    size_t file_len;
+    // How many bytes have been written to the client so far
+    size_t bytes_written;
+} response_output_t;
+
 typedef struct response_t {
+    // The request arena, which the response and its buffers are allocated from
+    arena_t* arena;
     response_write_state_t state;
-    response_buffer_t write_buffer;
+    // Where the response goes once it is complete
+    response_output_t* output;
     // note: this is kinda cheating but I just don't want to have to bother writing a hashmap right
     // now
     response_buffer_t headers;
     char* body;
     size_t body_len;
-    const char* status_code;
-    const char* status_text;
+    // The pooled segment the body is in, if it is one, see `response_write_segment`
+    buffer_segment_t* segment;
+    // 200 OK unless it is set to something else
+    http_status_t status;
+    // Everything after the status line and the date, when the response is a canned one, and whether
+    // the connection closes after it
+    const char* canned;
+    size_t canned_len;
+    bool close;
 } response_t;
 
-response_t* response_new();
-void response_free(response_t* response);
+// Allocates a new response from `arena`, which is written to `output`. It is freed along with
+// everything else in the arena.
+response_t* response_new(arena_t* arena, response_output_t* output);
+
+// Returns the segments of the output that haven't been written to the pool.
+void response_output_release(response_output_t* output);
+
+// Returns what the response holds on to outside of the arena to the pool. Must be called before the
+// arena is reset, once the response has been written.
+void response_release(response_t* response);
 
+// The status code of `status`, like 404 for STATUS_NOT_FOUND
+int http_status_code(http_status_t status);
+
+// Headers are written straight into the response's header buffer, with no formatting in between
 void response_write_header_str(response_t* response, const char* key, const char* value);
-void response_write_header_int(response_t* self, const char* key, int value);
+void response_write_header_int(response_t* response, const char* key, long value);
 void response_write_body(response_t* response, char* body, size_t len);
 
-async_result_t poll_response_write_buffer(response_t* response, int fd);
+// Makes the data in the pooled segment the body. The response takes the segment over, and returns
+// it to the pool in `response_release`.
+void response_write_segment(response_t* response, buffer_segment_t* segment);
+
+// Makes the first `len` bytes of the open file `fd` the body, which is sent straight from the file.
+// The response's output takes the file over right away, and closes it once it is sent, or when the
+// output is released.
+void response_write_file(response_t* response, int fd, size_t len);
+
+// Makes the response a canned one, with prebuilt headers and an empty body, for the errors we
+// answer most often (400, 404, 405, 413, 431 and 503). Only the status line and the date are
+// copied, the rest goes out from where it is, all in a single write. The client errors after which
+// the rest of the connection can't be trusted (all but 404 and 405) say `Connection: close`, and
+// the connection does close once they are written. Whatever else was written to the response is
+// left out. Returns false if there is no canned response for `status`.
+bool response_write_canned(response_t* response, http_status_t status);
+
+// Adds the response to its output and writes the output to `fd`. With `hold`, the response only
+// joins the output, for the next response or `poll_response_output_flush` to write out.
+async_result_t poll_response_write_buffer(response_t* response, int fd, bool hold);
+
+// Writes everything in the output to `fd`.
+async_result_t poll_response_output_flush(response_output_t* output, int fd);
+
+int response_test_suite();
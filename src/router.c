@@ -0,0 +1,567 @@
+#include "router.h"
+
+struct route_node_t {
+    // The bytes of the path the node matches past its parent. Empty for a node past a parameter.
+    char* prefix;
+    size_t prefix_len;
+    // The static children, which all start with a different byte. `firsts` holds those bytes, by
+    // the index of the child, so that picking the child to go on with is a single memchr.
+    char* firsts;
+    route_node_t** children;
+    size_t child_count;
+    // Where the path goes on past a parameter segment
+    route_node_t* param;
+    // The routes that end in a wildcard here, and the routes that end right here
+    route_t* wildcard;
+    route_t* routes;
+};
+
+static route_node_t* node_new(const char* prefix, size_t len)
+{
+    route_node_t* node = calloc(1, sizeof(route_node_t));
+    node->prefix = malloc(len + 1);
+    memcpy(node->prefix, prefix, len);
+    node->prefix_len = len;
+    return node;
+}
+
+static void node_add_child(route_node_t* node, route_node_t* child)
+{
+    node->firsts = realloc(node->firsts, node->child_count + 1);
+    node->children = realloc(node->children, (node->child_count + 1) * sizeof(route_node_t*));
+    node->firsts[node->child_count] = child->prefix[0];
+    node->children[node->child_count] = child;
+    node->child_count++;
+}
+
+static void free_routes(route_t* route)
+{
+    while (route) {
+        route_t* next = route->next;
+        free(route->pattern);
+        free(route);
+        route = next;
+    }
+}
+
+static void node_free(route_node_t* node)
+{
+    if (!node) {
+        return;
+    }
+    for (size_t i = 0; i < node->child_count; i++) {
+        node_free(node->children[i]);
+    }
+    node_free(node->param);
+    free_routes(node->wildcard);
+    free_routes(node->routes);
+    free(node->firsts);
+    free(node->children);
+    free(node->prefix);
+    free(node);
+}
+
+void router_init(router_t* router)
+{
+    router->root = node_new("", 0);
+    router->route_count = 0;
+}
+
+void router_free(router_t* router)
+{
+    node_free(router->root);
+    router->root = NULL;
+    router->route_count = 0;
+}
+
+// Whether `p` starts a parameter or a wildcard, which only counts at the start of a segment
+static inline bool at_param(const char* p) { return (*p == ':' || *p == '*') && p[-1] == '/'; }
+
+// Walks down the static part of a pattern in [s, s + len) from `node`, adding the nodes it needs
+// along the way, and returns the node it ends at. A node whose prefix only partly matches is split
+// in two, where they part.
+static route_node_t* insert_static(route_node_t* node, const char* s, size_t len)
+{
+    while (len > 0) {
+        char* first = node->child_count ? memchr(node->firsts, s[0], node->child_count) : NULL;
+        if (!first) {
+            route_node_t* child = node_new(s, len);
+            node_add_child(node, child);
+            return child;
+        }
+
+        size_t index = first - node->firsts;
+        route_node_t* child = node->children[index];
+        size_t common = 0;
+        while (common < len && common < child->prefix_len && s[common] == child->prefix[common]) {
+            common++;
+        }
+        if (common < child->prefix_len) {
+            route_node_t* split = node_new(child->prefix, common);
+            memmove(child->prefix, child->prefix + common, child->prefix_len - common);
+            child->prefix_len -= common;
+            node_add_child(split, child);
+            node->children[index] = split;
+            child = split;
+        }
+
+        node = child;
+        s += common;
+        len -= common;
+    }
+    return node;
+}
+
+static bool same_method(const route_t* a, const route_t* b)
+{
+    if (!a->method || !b->method) {
+        return a->method == b->method;
+    }
+    return a->method_len == b->method_len && memcmp(a->method, b->method, a->method_len) == 0;
+}
+
+// Adds `route` to `list`, unless there is a route for its method there already
+static bool add_route(route_t** list, route_t* route)
+{
+    for (route_t* other = *list; other; other = other->next) {
+        if (same_method(other, route)) {
+            return false;
+        }
+    }
+    route->next = *list;
+    *list = route;
+    return true;
+}
+
+static bool add_pattern(router_t* router, const char* method, const char* pattern,
+    route_handler_t handler, void* data, bool stream_body)
+{
+    if (pattern[0] != '/') {
+        return false;
+    }
+
+    route_t* route = calloc(1, sizeof(route_t));
+    route->method = method;
+    route->method_len = method ? strlen(method) : 0;
+    route->handler = handler;
+    route->data = data;
+    route->stream_body = stream_body;
+    route->pattern = strdup(pattern);
+
+    // The names of the parameters, which checks the pattern before the trie is touched
+    for (const char* p = route->pattern; *p; p++) {
+        if (!at_param(p)) {
+            continue;
+        }
+        bool wildcard = *p == '*';
+        const char* name = p + 1;
+        const char* name_end = name;
+        while (*name_end && *name_end != '/') {
+            name_end++;
+        }
+        // A parameter needs a name, and a wildcard has to be the last segment
+        if (name_end == name || (wildcard && *name_end)
+            || route->param_count == ROUTER_MAX_PARAMS) {
+            free_routes(route);
+            return false;
+        }
+        route->param_names[route->param_count++] = (string_view_t) {
+            .data = (char*)name,
+            .len = name_end - name,
+        };
+        p = name_end - 1;
+    }
+
+    route_node_t* node = router->root;
+    const char* p = route->pattern;
+    size_t param = 0;
+    bool added = false;
+    while (1) {
+        if (!*p) {
+            added = add_route(&node->routes, route);
+            break;
+        }
+        if (at_param(p) && *p == '*') {
+            added = add_route(&node->wildcard, route);
+            break;
+        }
+        if (at_param(p)) {
+            if (!node->param) {
+                node->param = node_new("", 0);
+            }
+            node = node->param;
+            p += 1 + route->param_names[param++].len;
+            continue;
+        }
+
+        const char* end = p + 1;
+        while (*end && !at_param(end)) {
+            end++;
+        }
+        node = insert_static(node, p, end - p);
+        p = end;
+    }
+
+    if (!added) {
+        free_routes(route);
+        return false;
+    }
+    router->route_count++;
+    return true;
+}
+
+bool router_add(
+    router_t* router, const char* method, const char* pattern, route_handler_t handler, void* data)
+{
+    return add_pattern(router, method, pattern, handler, data, false);
+}
+
+bool router_add_streaming(
+    router_t* router, const char* method, const char* pattern, route_handler_t handler, void* data)
+{
+    return add_pattern(router, method, pattern, handler, data, true);
+}
+
+// The route for `method` in `routes`, or the one for any method if there is no such route
+static const route_t* find_route(const route_t* routes, string_view_t method)
+{
+    const route_t* any = NULL;
+    for (; routes; routes = routes->next) {
+        if (!routes->method) {
+            any = routes;
+        } else if (routes->method_len == method.len
+            && memcmp(routes->method, method.data, method.len) == 0) {
+            return routes;
+        }
+    }
+    return any;
+}
+
+// Matches the path in [p, end) against everything below `node`, whose own prefix has been matched
+// already. A static child that leads nowhere is backed out of for a parameter, and a parameter for
+// a wildcard. `path_matched` is set when a route matches the path but not the method.
+static bool match_node(const route_node_t* node, char* p, char* end, string_view_t method,
+    route_match_t* match, bool* path_matched)
+{
+    if (p == end && node->routes) {
+        const route_t* route = find_route(node->routes, method);
+        if (route) {
+            match->route = route;
+            return true;
+        }
+        *path_matched = true;
+    }
+
+    if (p < end && node->child_count) {
+        const char* first = memchr(node->firsts, *p, node->child_count);
+        if (first) {
+            const route_node_t* child = node->children[first - node->firsts];
+            if ((size_t)(end - p) >= child->prefix_len
+                && memcmp(p, child->prefix, child->prefix_len) == 0
+                && match_node(child, p + child->prefix_len, end, method, match, path_matched)) {
+                return true;
+            }
+        }
+    }
+
+    if (node->param && p < end && *p != '/') {
+        char* segment_end = memchr(p, '/', end - p);
+        if (!segment_end) {
+            segment_end = end;
+        }
+        size_t param_count = match->param_count;
+        match->params[match->param_count++] = (string_view_t) { .data = p, .len = segment_end - p };
+        if (match_node(node->param, segment_end, end, method, match, path_matched)) {
+            return true;
+        }
+        match->param_count = param_count;
+    }
+
+    if (node->wildcard) {
+        const route_t* route = find_route(node->wildcard, method);
+        if (route) {
+            match->params[match->param_count++] = (string_view_t) { .data = p, .len = end - p };
+            match->route = route;
+            return true;
+        }
+        *path_matched = true;
+    }
+    return false;
+}
+
+router_result_t router_match(
+    const router_t* router, string_view_t method, string_view_t path, route_match_t* match)
+{
+    match->route = NULL;
+    match->param_count = 0;
+
+    char* end = memchr(path.data, '?', path.len);
+    if (!end) {
+        end = path.data + path.len;
+    }
+
+    bool path_matched = false;
+    if (router->root && match_node(router->root, path.data, end, method, match, &path_matched)) {
+        return ROUTE_FOUND;
+    }
+    return path_matched ? ROUTE_METHOD_NOT_ALLOWED : ROUTE_NOT_FOUND;
+}
+
+string_view_t route_param(const route_match_t* match, const char* name)
+{
+    size_t len = strlen(name);
+    for (size_t i = 0; match->route && i < match->param_count; i++) {
+        string_view_t param_name = match->route->param_names[i];
+        if (param_name.len == len && memcmp(param_name.data, name, len) == 0) {
+            return match->params[i];
+        }
+    }
+    return (string_view_t) { .data = NULL, .len = 0 };
+}
+
+/**
+ ***************************************************************************************************
+ * Tests
+ ***************************************************************************************************
+ */
+#define test_assert(cond, msg)                                                                     \
+    do {                                                                                           \
+        if (!(cond)) {                                                                             \
+            printf("Assertion failed: %s\n", msg);                                                 \
+            return -1;                                                                             \
+        }                                                                                          \
+    } while (0)
+
+static async_result_t test_route_handler(struct route_context_t* ctx)
+{
+    (void)ctx;
+    return (async_result_t) { .result = POLL_READY, .value = (void*)0 };
+}
+
+// Matches `method` and `path`, and returns the data of the route it finds, NULL if there is none
+static const char* match_data(
+    const router_t* router, const char* method, const char* path, route_match_t* match)
+{
+    string_view_t method_view = { .data = (char*)method, .len = strlen(method) };
+    string_view_t path_view = { .data = (char*)path, .len = strlen(path) };
+    if (router_match(router, method_view, path_view, match) != ROUTE_FOUND) {
+        return NULL;
+    }
+    return match->route->data;
+}
+
+static bool param_is(const route_match_t* match, const char* name, const char* value)
+{
+    string_view_t param = route_param(match, name);
+    return param.data && param.len == strlen(value) && memcmp(param.data, value, param.len) == 0;
+}
+
+static int test_static_and_params()
+{
+    router_t router;
+    router_init(&router);
+    test_assert(router_add(&router, "GET", "/", test_route_handler, "root")
+            && router_add(&router, "GET", "/users", test_route_handler, "users")
+            && router_add(&router, "GET", "/users/:id", test_route_handler, "user")
+            && router_add(&router, "GET", "/users/:id/posts/:post", test_route_handler, "post")
+            && router_add(&router, "GET", "/user-agents", test_route_handler, "agents")
+            && router_add(&router, "GET", "/static/*path", test_route_handler, "static"),
+        "expected the routes to be added");
+
+    route_match_t match;
+    test_assert(strcmp(match_data(&router, "GET", "/", &match), "root") == 0, "expected /");
+    test_assert(strcmp(match_data(&router, "GET", "/users", &match), "users") == 0,
+        "expected /users");
+    test_assert(strcmp(match_data(&router, "GET", "/user-agents", &match), "agents") == 0,
+        "expected a route that shares a prefix to be found");
+    test_assert(strcmp(match_data(&router, "GET", "/users/42", &match), "user") == 0
+            && param_is(&match, "id", "42"),
+        "expected /users/:id");
+    test_assert(strcmp(match_data(&router, "GET", "/users/42/posts/7?sort=new", &match), "post")
+                == 0
+            && param_is(&match, "id", "42") && param_is(&match, "post", "7"),
+        "expected both parameters, without the query string");
+    test_assert(strcmp(match_data(&router, "GET", "/static/css/site.css", &match), "static") == 0
+            && param_is(&match, "path", "css/site.css"),
+        "expected the wildcard to take the rest of the path");
+    test_assert(strcmp(match_data(&router, "GET", "/static/", &match), "static") == 0
+            && param_is(&match, "path", ""),
+        "expected the wildcard to match an empty rest");
+    test_assert(route_param(&match, "id").data == NULL, "expected no parameter called id");
+
+    test_assert(match_data(&router, "GET", "/users/", &match) == NULL,
+        "expected a parameter not to match an empty segment");
+    test_assert(match_data(&router, "GET", "/users/42/posts", &match) == NULL,
+        "expected a partial match not to count");
+    test_assert(match_data(&router, "GET", "/static", &match) == NULL,
+        "expected the wildcard to need its slash");
+    test_assert(match_data(&router, "GET", "/user", &match) == NULL,
+        "expected a prefix of a route not to match");
+
+    router_free(&router);
+    return 0;
+}
+
+static int test_precedence()
+{
+    router_t router;
+    router_init(&router);
+    test_assert(router_add(&router, "GET", "/files/new", test_route_handler, "static")
+            && router_add(&router, "GET", "/files/:name", test_route_handler, "param")
+            && router_add(&router, "GET", "/files/:name/raw", test_route_handler, "raw")
+            && router_add(&router, NULL, "/files/*rest", test_route_handler, "wildcard")
+            && router_add(&router, "POST", "/files/:name", test_route_handler, "upload"),
+        "expected the routes to be added");
+
+    route_match_t match;
+    test_assert(strcmp(match_data(&router, "GET", "/files/new", &match), "static") == 0,
+        "expected a static segment to win");
+    test_assert(strcmp(match_data(&router, "GET", "/files/news", &match), "param") == 0
+            && param_is(&match, "name", "news"),
+        "expected the parameter when the static segment is only a prefix");
+    test_assert(strcmp(match_data(&router, "GET", "/files/new/raw", &match), "raw") == 0
+            && param_is(&match, "name", "new"),
+        "expected to back out of the static segment for the parameter");
+    test_assert(strcmp(match_data(&router, "POST", "/files/new", &match), "upload") == 0,
+        "expected to back out of a static segment without the method");
+    test_assert(strcmp(match_data(&router, "GET", "/files/a/b/c", &match), "wildcard") == 0
+            && param_is(&match, "rest", "a/b/c") && match.param_count == 1,
+        "expected the wildcard to win over nothing, without the parameters it backed out of");
+
+    router_free(&router);
+    return 0;
+}
+
+static int test_methods()
+{
+    router_t router;
+    router_init(&router);
+    test_assert(router_add(&router, "GET", "/items", test_route_handler, "list")
+            && router_add(&router, "POST", "/items", test_route_handler, "create")
+            && router_add(&router, NULL, "/health", test_route_handler, "health"),
+        "expected the routes to be added");
+
+    route_match_t match;
+    test_assert(strcmp(match_data(&router, "POST", "/items", &match), "create") == 0,
+        "expected the route for the method");
+    test_assert(strcmp(match_data(&router, "HEAD", "/health", &match), "health") == 0,
+        "expected a route for any method");
+
+    string_view_t delete = { .data = "DELETE", .len = 6 };
+    string_view_t items = { .data = "/items", .len = 6 };
+    string_view_t missing = { .data = "/missing", .len = 8 };
+    test_assert(router_match(&router, delete, items, &match) == ROUTE_METHOD_NOT_ALLOWED,
+        "expected the path to match without the method");
+    test_assert(router_match(&router, delete, missing, &match) == ROUTE_NOT_FOUND,
+        "expected nothing to match");
+    router_free(&router);
+    return 0;
+}
+
+static int test_rejects_bad_patterns()
+{
+    router_t router;
+    router_init(&router);
+    test_assert(router_add(&router, "GET", "/a/:id", test_route_handler, NULL),
+        "expected the route to be added");
+
+    const char* patterns[] = {
+        "relative",
+        "/a/:",
+        "/a/*",
+        "/a/*rest/more",
+        "/:a/:b/:c/:d/:e/:f/:g/:h/:i",
+    };
+    for (size_t i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++) {
+        if (router_add(&router, "GET", patterns[i], test_route_handler, NULL)) {
+            printf("pattern %s\n", patterns[i]);
+            test_assert(false, "expected a malformed pattern to be rejected");
+        }
+    }
+    test_assert(!router_add(&router, "GET", "/a/:other", test_route_handler, NULL),
+        "expected a second route for the same method and path to be rejected");
+    test_assert(router_add(&router, "PUT", "/a/:other", test_route_handler, NULL),
+        "expected a route for another method to be added");
+    test_assert(router.route_count == 2, "expected two routes");
+
+    // Colons and stars only count at the start of a segment
+    test_assert(router_add(&router, "GET", "/time/12:30*", test_route_handler, "literal"),
+        "expected a literal colon and star to be accepted");
+    route_match_t match;
+    test_assert(strcmp(match_data(&router, "GET", "/time/12:30*", &match), "literal") == 0,
+        "expected the literal path to match");
+    router_free(&router);
+    return 0;
+}
+
+static int test_many_routes()
+{
+    router_t router;
+    router_init(&router);
+
+    // Routes with long shared prefixes, which split nodes all over the trie
+    char pattern[64];
+    for (long i = 0; i < 2000; i++) {
+        snprintf(pattern, sizeof(pattern), "/api/v%ld/resource%ld/:id", i % 3, i);
+        if (!router_add(&router, "GET", pattern, test_route_handler, (void*)i)) {
+            printf("pattern %s\n", pattern);
+            test_assert(false, "expected the route to be added");
+        }
+    }
+
+    char path[64];
+    route_match_t match;
+    for (long i = 0; i < 2000; i++) {
+        snprintf(path, sizeof(path), "/api/v%ld/resource%ld/x%ld", i % 3, i, i);
+        string_view_t method = { .data = "GET", .len = 3 };
+        string_view_t path_view = { .data = path, .len = strlen(path) };
+        char value[16];
+        snprintf(value, sizeof(value), "x%ld", i);
+        if (router_match(&router, method, path_view, &match) != ROUTE_FOUND
+            || match.route->data != (void*)i || !param_is(&match, "id", value)) {
+            printf("path %s\n", path);
+            test_assert(false, "expected every route to find itself");
+        }
+    }
+    test_assert(match_data(&router, "GET", "/api/v1/resource2/x", &match) == NULL,
+        "expected a route under another version not to match");
+
+    router_free(&router);
+    return 0;
+}
+
+int router_test_suite()
+{
+    int r = 0;
+    if (test_static_and_params() < 0) {
+        r = -1;
+        printf("\t❌ test_static_and_params\n");
+    } else {
+        printf("\t✅ test_static_and_params\n");
+    }
+    if (test_precedence() < 0) {
+        r = -1;
+        printf("\t❌ test_precedence\n");
+    } else {
+        printf("\t✅ test_precedence\n");
+    }
+    if (test_methods() < 0) {
+        r = -1;
+        printf("\t❌ test_methods\n");
+    } else {
+        printf("\t✅ test_methods\n");
+    }
+    if (test_rejects_bad_patterns() < 0) {
+        r = -1;
+        printf("\t❌ test_rejects_bad_patterns\n");
+    } else {
+        printf("\t✅ test_rejects_bad_patterns\n");
+    }
+    if (test_many_routes() < 0) {
+        r = -1;
+        printf("\t❌ test_many_routes\n");
+    } else {
+        printf("\t✅ test_many_routes\n");
+    }
+    return r;
+}
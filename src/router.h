@@ -0,0 +1,109 @@
+/**
+ * Routes requests to handlers by method and path.
+ *
+ * Routes are registered at startup, before any event loop runs, and go into a radix trie: every
+ * node holds the bytes its routes have in common past its parent, so a lookup looks at each byte of
+ * the path about once, however many routes there are. The trie is only read once the loops run, so
+ * they share it without any locking. Matching allocates nothing, and the parameters it finds are
+ * views into the request path.
+ *
+ * A pattern is a path in which a segment can be a parameter, a `:` followed by its name, which
+ * matches a single segment that isn't empty (like `:id` in `/users/:id/posts`). The last segment
+ * can be a wildcard instead, a `*` followed by its name, which matches the rest of the path,
+ * slashes and all, even if it's empty.
+ *
+ * Where more than one route matches a path, a static segment wins over a parameter, and a
+ * parameter wins over a wildcard. The query string is not part of the path that is matched.
+ */
+
+#pragma once
+
+#include "common.h"
+
+// The most parameters (wildcard included) a pattern can have
+#define ROUTER_MAX_PARAMS 8
+
+struct route_context_t;
+
+/**
+ * Handles a request that matched a route, which works like any other future: it is polled until it
+ * is ready, and is expected to have filled in the response by then (see `route_context_t` in
+ * handler.h). Ready with -1 closes the connection instead.
+ */
+typedef async_result_t (*route_handler_t)(struct route_context_t* ctx);
+
+typedef struct route_t {
+    // The method the route is for, NULL for any method
+    const char* method;
+    size_t method_len;
+    route_handler_t handler;
+    // Passed to the handler, as it was given to `router_add`
+    void* data;
+    // Whether the handler reads the body itself, see `router_add_streaming`
+    bool stream_body;
+    // The pattern the route was registered with, which the parameter names point into
+    char* pattern;
+    string_view_t param_names[ROUTER_MAX_PARAMS];
+    size_t param_count;
+    // The next route with the same pattern, for another method
+    struct route_t* next;
+} route_t;
+
+typedef struct route_node_t route_node_t;
+
+typedef struct router_t {
+    route_node_t* root;
+    size_t route_count;
+} router_t;
+
+typedef enum router_result_t {
+    ROUTE_FOUND,
+    ROUTE_NOT_FOUND,
+    // Some route matches the path, but not for the request's method
+    ROUTE_METHOD_NOT_ALLOWED,
+} router_result_t;
+
+typedef struct route_match_t {
+    const route_t* route;
+    // The values of the route's parameters, in the order of `route->param_names`, pointing into the
+    // path that was matched
+    string_view_t params[ROUTER_MAX_PARAMS];
+    size_t param_count;
+} route_match_t;
+
+void router_init(router_t* router);
+
+/**
+ * Adds a route for `method` (NULL for any method) and `pattern`, whose requests go to `handler`.
+ * Returns false if the pattern is malformed, or if the router already has a route for the same
+ * method and pattern.
+ */
+bool router_add(
+    router_t* router, const char* method, const char* pattern, route_handler_t handler, void* data);
+
+/**
+ * Like `router_add`, but the handler is polled as soon as the request's headers are in, and reads
+ * the body itself, a piece at a time as it arrives (see `poll_route_body` in handler.h), instead of
+ * once all of it has been read.
+ */
+bool router_add_streaming(
+    router_t* router, const char* method, const char* pattern, route_handler_t handler, void* data);
+
+/**
+ * Finds the route for a request, and fills in `match` if there is one.
+ */
+router_result_t router_match(
+    const router_t* router, string_view_t method, string_view_t path, route_match_t* match);
+
+/**
+ * Returns the value of the parameter called `name`, or an empty view (with NULL data) if the
+ * matched route has no such parameter.
+ */
+string_view_t route_param(const route_match_t* match, const char* name);
+
+/**
+ * Frees the trie and every route in it.
+ */
+void router_free(router_t* router);
+
+int router_test_suite();
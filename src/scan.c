@@ -0,0 +1,247 @@
+#include "scan.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define SCAN_X86 1
+#else
+#define SCAN_X86 0
+#endif
+
+typedef const char* (*find2_fn)(const char* p, const char* end, char a, char b);
+
+typedef struct scan_kernel_t {
+    const char* name;
+    find2_fn find2;
+    // Whether the CPU we're running on can run the kernel
+    bool (*supported)();
+} scan_kernel_t;
+
+static const char* find2_scalar(const char* p, const char* end, char a, char b)
+{
+    for (; p < end; p++) {
+        if (*p == a || *p == b) {
+            return p;
+        }
+    }
+    return end;
+}
+
+static bool always_supported() { return true; }
+
+#if SCAN_X86
+// Whether a `size` byte load from `p` stays within one page, so that it can't fault even where it
+// goes past the end of the data
+#define SCAN_PAGE_SIZE 4096
+#define same_page(p, size) (((uintptr_t)(p) & (SCAN_PAGE_SIZE - 1)) <= SCAN_PAGE_SIZE - (size))
+
+// SSE2 is part of x86-64 itself, so this one needs no check
+static const char* find2_sse2(const char* p, const char* end, char a, char b)
+{
+    __m128i va = _mm_set1_epi8(a);
+    __m128i vb = _mm_set1_epi8(b);
+    for (; end - p >= 16; p += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*)p);
+        __m128i match = _mm_or_si128(_mm_cmpeq_epi8(block, va), _mm_cmpeq_epi8(block, vb));
+        unsigned mask = _mm_movemask_epi8(match);
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+
+    // Tokens are mostly short, so the tail is worth a vector of its own, with the bytes past `end`
+    // masked off
+    if (p < end && same_page(p, 16)) {
+        __m128i block = _mm_loadu_si128((const __m128i*)p);
+        __m128i match = _mm_or_si128(_mm_cmpeq_epi8(block, va), _mm_cmpeq_epi8(block, vb));
+        unsigned mask = _mm_movemask_epi8(match) & ((1u << (end - p)) - 1);
+        return mask ? p + __builtin_ctz(mask) : end;
+    }
+    return find2_scalar(p, end, a, b);
+}
+
+__attribute__((target("avx2"))) static const char* find2_avx2(
+    const char* p, const char* end, char a, char b)
+{
+    __m256i va = _mm256_set1_epi8(a);
+    __m256i vb = _mm256_set1_epi8(b);
+    for (; end - p >= 32; p += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i*)p);
+        __m256i match
+            = _mm256_or_si256(_mm256_cmpeq_epi8(block, va), _mm256_cmpeq_epi8(block, vb));
+        unsigned mask = _mm256_movemask_epi8(match);
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+
+    if (p < end && same_page(p, 32)) {
+        __m256i block = _mm256_loadu_si256((const __m256i*)p);
+        __m256i match
+            = _mm256_or_si256(_mm256_cmpeq_epi8(block, va), _mm256_cmpeq_epi8(block, vb));
+        unsigned mask = _mm256_movemask_epi8(match) & ((1u << (end - p)) - 1);
+        return mask ? p + __builtin_ctz(mask) : end;
+    }
+
+    // The compiler doesn't clear the upper halves of the registers before a tail call, and SSE code
+    // running with them dirty pays over 100ns for it
+    _mm256_zeroupper();
+    return find2_sse2(p, end, a, b);
+}
+
+static bool avx2_supported() { return __builtin_cpu_supports("avx2"); }
+#endif
+
+// Best first, the last one runs everywhere
+static const scan_kernel_t kernels[] = {
+#if SCAN_X86
+    { "avx2", find2_avx2, avx2_supported },
+    { "sse2", find2_sse2, always_supported },
+#endif
+    { "scalar", find2_scalar, always_supported },
+};
+
+#define KERNEL_COUNT (sizeof(kernels) / sizeof(kernels[0]))
+
+// Picked before main runs, so that a search is just an indirect call
+static const scan_kernel_t* kernel = &kernels[KERNEL_COUNT - 1];
+
+__attribute__((constructor)) static void pick_kernel()
+{
+    for (size_t i = 0; i < KERNEL_COUNT; i++) {
+        if (kernels[i].supported()) {
+            kernel = &kernels[i];
+            return;
+        }
+    }
+}
+
+const char* scan_find2(const char* p, const char* end, char a, char b)
+{
+    return kernel->find2(p, end, a, b);
+}
+
+const char* scan_kernel_name() { return kernel->name; }
+
+size_t scan_headers_end(const char* data, size_t len, size_t* scanned)
+{
+    // Every LF before `*scanned` has been looked at already, so the one that ends a CRLFCRLF has to
+    // be among the new bytes, even if the rest of it isn't
+    const char* end = data + len;
+    const char* p = data + *scanned;
+    while (p < end && (p = scan_find2(p, end, '\n', '\n')) < end) {
+        size_t i = p - data;
+        if (i >= 3 && p[-1] == '\r' && p[-2] == '\n' && p[-3] == '\r') {
+            *scanned = i + 1;
+            return i + 1;
+        }
+        p++;
+    }
+
+    *scanned = len;
+    return 0;
+}
+
+/**
+ ***************************************************************************************************
+ * Tests
+ ***************************************************************************************************
+ */
+#define test_assert(cond, msg)                                                                     \
+    do {                                                                                           \
+        if (!(cond)) {                                                                             \
+            printf("Assertion failed: %s\n", msg);                                                 \
+            return -1;                                                                             \
+        }                                                                                          \
+    } while (0)
+
+static int test_kernels_agree()
+{
+    // Every length up to a few vectors, with the match (if any) at every position, checked against
+    // the scalar loop. There is a delimiter right after `end`, which a kernel has to ignore even
+    // when its last load covers it.
+    char buf[100];
+    for (size_t k = 0; k < KERNEL_COUNT; k++) {
+        if (!kernels[k].supported()) {
+            continue;
+        }
+        for (size_t len = 0; len <= 80; len++) {
+            for (size_t at = 0; at <= len; at++) {
+                memset(buf, 'x', sizeof(buf));
+                buf[len] = ':';
+                if (at < len) {
+                    buf[at] = at % 2 ? ':' : '\r';
+                }
+                const char* expected = find2_scalar(buf, buf + len, ':', '\r');
+                const char* found = kernels[k].find2(buf, buf + len, ':', '\r');
+                if (found != expected) {
+                    printf("kernel %s, len %zu, match at %zu\n", kernels[k].name, len, at);
+                    test_assert(false, "expected the kernel to find the same delimiter as a loop");
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+static int test_finds_first()
+{
+    const char* line = "Host: example.com:8080\r\n";
+    const char* end = line + strlen(line);
+    test_assert(scan_find2(line, end, ':', '\r') == line + 4, "expected the first colon");
+    test_assert(scan_find2(line + 5, end, '\r', '\r') == line + 22, "expected the CR");
+    test_assert(scan_find2(line, end, '#', '@') == end, "expected end without a match");
+    return 0;
+}
+
+static int test_headers_end()
+{
+    const char* request = "GET / HTTP/1.1\r\nHost: x\r\n\r\nbody";
+    size_t headers_len = strlen(request) - 4;
+
+    size_t scanned = 0;
+    test_assert(scan_headers_end(request, strlen(request), &scanned) == headers_len,
+        "expected the index past the empty line");
+
+    // Delivered a byte at a time, the end is found as soon as its last byte arrives, which means
+    // it is found across the boundary of every earlier piece
+    scanned = 0;
+    for (size_t len = 1; len <= strlen(request); len++) {
+        size_t found = scan_headers_end(request, len, &scanned);
+        test_assert(found == (len < headers_len ? 0 : headers_len),
+            "expected the end exactly once it has arrived");
+        if (found) {
+            break;
+        }
+        test_assert(scanned == len, "expected the scan to have covered everything");
+    }
+
+    scanned = 0;
+    const char* bare_lf = "GET / HTTP/1.1\n\nHost: x\r\n\n\r\n";
+    test_assert(scan_headers_end(bare_lf, strlen(bare_lf), &scanned) == 0,
+        "expected only a CRLFCRLF to end the headers");
+    return 0;
+}
+
+int scan_test_suite()
+{
+    int r = 0;
+    if (test_kernels_agree() < 0) {
+        r = -1;
+        printf("\t❌ test_kernels_agree\n");
+    } else {
+        printf("\t✅ test_kernels_agree\n");
+    }
+    if (test_finds_first() < 0) {
+        r = -1;
+        printf("\t❌ test_finds_first\n");
+    } else {
+        printf("\t✅ test_finds_first\n");
+    }
+    if (test_headers_end() < 0) {
+        r = -1;
+        printf("\t❌ test_headers_end\n");
+    } else {
+        printf("\t✅ test_headers_end\n");
+    }
+    return r;
+}
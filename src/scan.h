@@ -0,0 +1,34 @@
+/**
+ * Vectorized delimiter search for the request parser.
+ *
+ * The parser tokenizes the request line and headers by jumping from one delimiter (SP, ':' or
+ * CRLF) to the next, and `scan_find2` is what finds them. On x86-64 it compares 32 bytes at a time
+ * with AVX2 when the CPU has it, 16 at a time with SSE2 otherwise, and everywhere else it falls
+ * back to a plain loop. The kernel is picked once, when the program is loaded.
+ */
+
+#pragma once
+
+#include "common.h"
+
+/**
+ * Returns a pointer to the first `a` or `b` in [p, end), or `end` if there is neither. The last
+ * load may go past `end` when that can't cross into another page, but what it finds there is
+ * ignored.
+ */
+const char* scan_find2(const char* p, const char* end, char a, char b);
+
+/**
+ * Looks for the empty line that ends the request headers in the `len` bytes at `data`, and returns
+ * the index just past it, or 0 if it hasn't arrived yet. The search resumes at `*scanned`, which
+ * is how far earlier calls have looked, and leaves it at `len`. So reading the headers in pieces
+ * only ever scans the new bytes, plus the 3 before them that an earlier piece may have ended on.
+ */
+size_t scan_headers_end(const char* data, size_t len, size_t* scanned);
+
+/**
+ * Name of the kernel `scan_find2` uses on this CPU.
+ */
+const char* scan_kernel_name();
+
+int scan_test_suite();
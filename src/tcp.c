@@ -2,20 +2,23 @@
 #include "tcp.h"
 #include <errno.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/fcntl.h>
 #include <sys/socket.h>
 
-int start_server(int port)
+int start_server(const server_options_t* options)
 {
-
     int server_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (server_fd < 0) {
         perror("socket");
         exit(1);
     }
 
-    struct sockaddr_in server_addr
-        = { .sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = INADDR_ANY };
+    struct sockaddr_in server_addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(options->port),
+        .sin_addr.s_addr = INADDR_ANY,
+    };
 
     int opt = 1;
     if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
@@ -23,6 +26,12 @@ int start_server(int port)
         exit(1);
     }
 
+    if (options->reuse_port
+        && setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        perror("setsockopt(SO_REUSEPORT)");
+        exit(1);
+    }
+
     int flags = fcntl(server_fd, F_GETFL, 0);
     fcntl(server_fd, F_SETFL, flags | O_NONBLOCK);
 
@@ -31,21 +40,53 @@ int start_server(int port)
         exit(1);
     }
 
-    // I'm setting the backlog to 0 here so that things will fail quickly if we screw up our async
-    // implementation and block too much (e.g. on file I/O).
-    if (listen(server_fd, 0) < 0) {
+    if (options->defer_accept > 0) {
+#ifdef TCP_DEFER_ACCEPT
+        if (setsockopt(server_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &options->defer_accept,
+                sizeof(options->defer_accept))
+            < 0) {
+            perror("setsockopt(TCP_DEFER_ACCEPT)");
+            exit(1);
+        }
+#else
+        println("TCP_DEFER_ACCEPT is not supported on this platform, ignoring it");
+#endif
+    }
+
+    if (listen(server_fd, options->backlog) < 0) {
         perror("listen");
         exit(1);
     }
 
+    // Some platforms only allow enabling fast open once the socket is listening
+    if (options->fastopen > 0) {
+#ifdef TCP_FASTOPEN
+        if (setsockopt(server_fd, IPPROTO_TCP, TCP_FASTOPEN, &options->fastopen,
+                sizeof(options->fastopen))
+            < 0) {
+            perror("setsockopt(TCP_FASTOPEN)");
+            exit(1);
+        }
+#else
+        println("TCP_FASTOPEN is not supported on this platform, ignoring it");
+#endif
+    }
+
     return server_fd;
 }
 
 async_result_t poll_accept_connection(int server_fd)
 {
+#ifdef SOCK_NONBLOCK
+    // Saves the two fcntl calls below
+    int client_fd = accept4(server_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
     int client_fd = accept(server_fd, NULL, NULL);
+#endif
 
-    if (errno == EWOULDBLOCK) {
+    // errno is only meaningful if accept actually failed, otherwise it may be left over from an
+    // earlier call and we'd leak the connection we just accepted.
+    if (client_fd < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
         return (async_result_t) { .result = POLL_PENDING, .value = NULL };
     } else if (client_fd < 0) {
         perror("accept");
@@ -54,11 +95,15 @@ async_result_t poll_accept_connection(int server_fd)
 
     println("accepted connection from client_fd: %d", client_fd);
 
+#ifndef SOCK_NONBLOCK
     int flags = fcntl(client_fd, F_GETFL, 0);
     if (fcntl(client_fd, F_SETFL, flags | O_NONBLOCK) < 0) {
         perror("fcntl");
+        close(client_fd);
         return (async_result_t) { .result = POLL_READY, .value = (void*)-1 };
     }
+    fcntl(client_fd, F_SETFD, FD_CLOEXEC);
+#endif
 
     size_t return_value = client_fd;
     return (async_result_t) { .result = POLL_READY, .value = (void*)return_value };
@@ -6,16 +6,31 @@
 
 #include "common.h"
 
+typedef struct server_options_t {
+    int port;
+    // Whether to set SO_REUSEPORT, so that several listening sockets (one per event loop thread)
+    // can share the port and have the kernel balance new connections between them.
+    bool reuse_port;
+    // Length of the queue of connections that are waiting to be accepted
+    int backlog;
+    // If non-zero, have the kernel hold on to new connections (TCP_DEFER_ACCEPT) until the client
+    // has sent some data, or this many seconds have passed. Linux only.
+    int defer_accept;
+    // If non-zero, accept TCP Fast Open connections (TCP_FASTOPEN), keeping at most this many of
+    // them pending at a time.
+    int fastopen;
+} server_options_t;
+
 /**
- * Starts a TCP server on the given port.
+ * Starts a non-blocking TCP server with the given options.
  *
- * @param port The port to listen on.
  * @return The server socket file descriptor.
  */
-int start_server(int port);
+int start_server(const server_options_t* options);
 
 /**
- * Polls for a new connection on the given server socket.
+ * Polls for a new connection on the given server socket. The client socket is already
+ * non-blocking and close-on-exec.
  *
  * @param server_fd The server socket file descriptor.
  * @return An async result indicating whether the poll is ready or pending, and the client socket
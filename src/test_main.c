@@ -1,7 +1,19 @@
 #include "arena.h"
+#include "body.h"
+#include "buffer.h"
+#include "chunked.h"
+#include "clock.h"
 #include "conn.h"
 #include "handler.h"
+#include "response.h"
+#include "headers.h"
 #include "kqueue.h"
+#include "router.h"
+#include "scan.h"
+#include "timer.h"
+#include "upgrade.h"
+#include "uring.h"
+#include "workers.h"
 
 int main()
 {
@@ -34,6 +46,69 @@ int main()
         printf("\t✅ Suite passed: arena.c\n");
     }
 
+    // buffer.c
+    printf("[SUITE]: buffer.c\n");
+    if (buffer_test_suite() < 0) {
+        r = 1;
+        printf("\t❌ Suite failed: buffer.c\n");
+    } else {
+        printf("\t✅ Suite passed: buffer.c\n");
+    }
+
+    // scan.c
+    printf("[SUITE]: scan.c\n");
+    if (scan_test_suite() < 0) {
+        r = 1;
+        printf("\t❌ Suite failed: scan.c\n");
+    } else {
+        printf("\t✅ Suite passed: scan.c\n");
+    }
+
+    // headers.c
+    printf("[SUITE]: headers.c\n");
+    if (headers_test_suite() < 0) {
+        r = 1;
+        printf("\t❌ Suite failed: headers.c\n");
+    } else {
+        printf("\t✅ Suite passed: headers.c\n");
+    }
+
+    // chunked.c
+    printf("[SUITE]: chunked.c\n");
+    if (chunked_test_suite() < 0) {
+        r = 1;
+        printf("\t❌ Suite failed: chunked.c\n");
+    } else {
+        printf("\t✅ Suite passed: chunked.c\n");
+    }
+
+    // body.c
+    printf("[SUITE]: body.c\n");
+    if (body_test_suite() < 0) {
+        r = 1;
+        printf("\t❌ Suite failed: body.c\n");
+    } else {
+        printf("\t✅ Suite passed: body.c\n");
+    }
+
+    // router.c
+    printf("[SUITE]: router.c\n");
+    if (router_test_suite() < 0) {
+        r = 1;
+        printf("\t❌ Suite failed: router.c\n");
+    } else {
+        printf("\t✅ Suite passed: router.c\n");
+    }
+
+    // response.c
+    printf("[SUITE]: response.c\n");
+    if (response_test_suite() < 0) {
+        r = 1;
+        printf("\t❌ Suite failed: response.c\n");
+    } else {
+        printf("\t✅ Suite passed: response.c\n");
+    }
+
     // handler.c
     printf("[SUITE]: handler.c\n");
     if (handler_test_suite() < 0) {
@@ -43,5 +118,52 @@ int main()
         printf("\t✅ Suite passed: handler.c\n");
     }
 
+    // clock.c
+    printf("[SUITE]: clock.c\n");
+    if (clock_test_suite() < 0) {
+        r = 1;
+        printf("\t❌ Suite failed: clock.c\n");
+    } else {
+        printf("\t✅ Suite passed: clock.c\n");
+    }
+
+    // timer.c
+    printf("[SUITE]: timer.c\n");
+    if (timer_test_suite() < 0) {
+        r = 1;
+        printf("\t❌ Suite failed: timer.c\n");
+    } else {
+        printf("\t✅ Suite passed: timer.c\n");
+    }
+
+    // workers.c
+    printf("[SUITE]: workers.c\n");
+    if (workers_test_suite() < 0) {
+        r = 1;
+        printf("\t❌ Suite failed: workers.c\n");
+    } else {
+        printf("\t✅ Suite passed: workers.c\n");
+    }
+
+    // upgrade.c
+    printf("[SUITE]: upgrade.c\n");
+    if (upgrade_test_suite() < 0) {
+        r = 1;
+        printf("\t❌ Suite failed: upgrade.c\n");
+    } else {
+        printf("\t✅ Suite passed: upgrade.c\n");
+    }
+
+#ifdef __linux__
+    // uring.c
+    printf("[SUITE]: uring.c\n");
+    if (uring_test_suite() < 0) {
+        r = 1;
+        printf("\t❌ Suite failed: uring.c\n");
+    } else {
+        printf("\t✅ Suite passed: uring.c\n");
+    }
+#endif
+
     return r;
 }
@@ -0,0 +1,299 @@
+#include "timer.h"
+
+#define SLOT_MASK (TIMER_SLOTS - 1)
+// How many ticks ahead the wheel reaches. Deadlines beyond that are clamped.
+#define WHEEL_SPAN ((uint64_t)1 << (TIMER_SLOT_BITS * TIMER_LEVELS))
+
+void timer_wheel_init(timer_wheel_t* self, uint64_t now_ms)
+{
+    bzero(self, sizeof(timer_wheel_t));
+    self->current = now_ms / TIMER_TICK_MS;
+}
+
+static int slot_level(timer_wheel_t* self, timer_entry_t** slot)
+{
+    return (slot - &self->slots[0][0]) / TIMER_SLOTS;
+}
+
+// Links the entry into the slot for its expiry, relative to the current tick. `expires` must not be
+// before the current tick.
+static void place(timer_wheel_t* self, timer_entry_t* entry)
+{
+    uint64_t delta = entry->expires - self->current;
+
+    int level = 0;
+    while (level < TIMER_LEVELS - 1 && delta >= (uint64_t)1 << (TIMER_SLOT_BITS * (level + 1))) {
+        level++;
+    }
+
+    size_t index = (entry->expires >> (TIMER_SLOT_BITS * level)) & SLOT_MASK;
+    timer_entry_t** slot = &self->slots[level][index];
+
+    entry->slot = slot;
+    entry->prev = NULL;
+    entry->next = *slot;
+    if (*slot) {
+        (*slot)->prev = entry;
+    }
+    *slot = entry;
+    self->counts[level]++;
+}
+
+bool timer_is_scheduled(timer_entry_t* entry) { return entry->slot != NULL; }
+
+void timer_cancel(timer_wheel_t* self, timer_entry_t* entry)
+{
+    if (!entry->slot) {
+        return;
+    }
+
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        *entry->slot = entry->next;
+    }
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    }
+
+    self->counts[slot_level(self, entry->slot)]--;
+    entry->slot = NULL;
+    entry->prev = NULL;
+    entry->next = NULL;
+}
+
+void timer_schedule(timer_wheel_t* self, timer_entry_t* entry, uint64_t deadline_ms)
+{
+    timer_cancel(self, entry);
+
+    // The slot for the current tick has already been processed, so the earliest we can expire a
+    // timer is the next one
+    uint64_t expires = (deadline_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    if (expires <= self->current) {
+        expires = self->current + 1;
+    }
+    if (expires - self->current >= WHEEL_SPAN) {
+        expires = self->current + WHEEL_SPAN - 1;
+    }
+
+    entry->expires = expires;
+    place(self, entry);
+}
+
+// Redistributes the timers in the slot of `level` that the current tick has just entered over the
+// levels below it. Continues with the level above whenever this one has wrapped around too.
+static void cascade(timer_wheel_t* self, int level)
+{
+    size_t index = (self->current >> (TIMER_SLOT_BITS * level)) & SLOT_MASK;
+    timer_entry_t* entry = self->slots[level][index];
+    self->slots[level][index] = NULL;
+
+    while (entry) {
+        timer_entry_t* next = entry->next;
+        self->counts[level]--;
+        place(self, entry);
+        entry = next;
+    }
+
+    if (index == 0 && level + 1 < TIMER_LEVELS) {
+        cascade(self, level + 1);
+    }
+}
+
+static size_t scheduled_count(timer_wheel_t* self)
+{
+    size_t count = 0;
+    for (int level = 0; level < TIMER_LEVELS; level++) {
+        count += self->counts[level];
+    }
+    return count;
+}
+
+timer_entry_t* timer_wheel_advance(timer_wheel_t* self, uint64_t now_ms)
+{
+    uint64_t target = now_ms / TIMER_TICK_MS;
+    timer_entry_t* expired = NULL;
+
+    while (self->current < target) {
+        // Nothing can expire, so there is no need to walk the ticks one by one
+        if (scheduled_count(self) == 0) {
+            self->current = target;
+            break;
+        }
+
+        self->current++;
+        if ((self->current & SLOT_MASK) == 0) {
+            cascade(self, 1);
+        }
+
+        timer_entry_t** slot = &self->slots[0][self->current & SLOT_MASK];
+        while (*slot) {
+            timer_entry_t* entry = *slot;
+            timer_cancel(self, entry);
+            entry->next = expired;
+            expired = entry;
+        }
+    }
+
+    return expired;
+}
+
+int timer_wheel_timeout(timer_wheel_t* self, uint64_t now_ms)
+{
+    if (scheduled_count(self) == 0) {
+        return -1;
+    }
+
+    // Timers on the upper levels only become due after they have been cascaded into level 0, which
+    // happens when level 0 wraps around, so we have to be awake by then.
+    uint64_t ticks = TIMER_SLOTS - (self->current & SLOT_MASK);
+    bool upper_levels_empty = scheduled_count(self) == self->counts[0];
+    if (upper_levels_empty) {
+        ticks = TIMER_SLOTS;
+    }
+
+    if (self->counts[0] > 0) {
+        for (uint64_t i = 1; i < ticks; i++) {
+            if (self->slots[0][(self->current + i) & SLOT_MASK]) {
+                ticks = i;
+                break;
+            }
+        }
+    }
+
+    uint64_t wake_ms = (self->current + ticks) * TIMER_TICK_MS;
+    return wake_ms > now_ms ? (int)(wake_ms - now_ms) : 0;
+}
+
+/**
+ ***************************************************************************************************
+ * Tests
+ ***************************************************************************************************
+ */
+#define test_assert(cond, msg)                                                                     \
+    do {                                                                                           \
+        if (!(cond)) {                                                                             \
+            printf("Assertion failed: %s\n", msg);                                                 \
+            return -1;                                                                             \
+        }                                                                                          \
+    } while (0)
+
+static size_t list_len(timer_entry_t* list)
+{
+    size_t len = 0;
+    for (; list; list = list->next) {
+        len++;
+    }
+    return len;
+}
+
+static int test_expiry_across_levels()
+{
+    timer_wheel_t wheel;
+    uint64_t start = 1000000;
+    timer_wheel_init(&wheel, start);
+
+    timer_entry_t soon = { .fd = 1 };
+    timer_entry_t later = { .fd = 2 };
+    timer_entry_t much_later = { .fd = 3 };
+    timer_schedule(&wheel, &soon, start + 50);
+    timer_schedule(&wheel, &later, start + 10 * 1000);
+    timer_schedule(&wheel, &much_later, start + 3600 * 1000);
+
+    test_assert(
+        timer_wheel_timeout(&wheel, start) == 50, "expected to wake up for the first timer");
+    test_assert(timer_wheel_advance(&wheel, start + 49) == NULL, "nothing should expire early");
+
+    timer_entry_t* expired = timer_wheel_advance(&wheel, start + 50);
+    test_assert(expired == &soon && list_len(expired) == 1, "expected the first timer to expire");
+    test_assert(!timer_is_scheduled(&soon), "expired timers should not be scheduled");
+
+    test_assert(timer_wheel_advance(&wheel, start + 9999) == NULL, "nothing should expire early");
+    expired = timer_wheel_advance(&wheel, start + 10 * 1000);
+    test_assert(expired == &later && list_len(expired) == 1, "expected the second timer to expire");
+
+    test_assert(timer_wheel_advance(&wheel, start + 3600 * 1000 - 10) == NULL,
+        "nothing should expire early");
+    expired = timer_wheel_advance(&wheel, start + 3600 * 1000);
+    test_assert(expired == &much_later, "expected the third timer to expire");
+    test_assert(timer_wheel_timeout(&wheel, start) == -1, "expected no timeout on an empty wheel");
+
+    return 0;
+}
+
+static int test_cancel_and_reschedule()
+{
+    timer_wheel_t wheel;
+    timer_wheel_init(&wheel, 0);
+
+    timer_entry_t entry = { .fd = 1 };
+    timer_schedule(&wheel, &entry, 100);
+    timer_cancel(&wheel, &entry);
+    test_assert(!timer_is_scheduled(&entry), "cancelled timer should not be scheduled");
+    test_assert(timer_wheel_advance(&wheel, 200) == NULL, "cancelled timer should not expire");
+
+    // moving a scheduled timer further out, like the event loop does when a connection makes
+    // progress
+    timer_schedule(&wheel, &entry, 300);
+    timer_schedule(&wheel, &entry, 5000);
+    test_assert(timer_wheel_advance(&wheel, 4990) == NULL, "rescheduled timer expired too early");
+    test_assert(timer_wheel_advance(&wheel, 5000) == &entry, "rescheduled timer should expire");
+
+    return 0;
+}
+
+static int test_bulk_expiry()
+{
+    timer_wheel_t wheel;
+    timer_wheel_init(&wheel, 0);
+
+#define BULK_TIMERS 2000
+    static timer_entry_t entries[BULK_TIMERS];
+    uint64_t seed = 42;
+    for (int i = 0; i < BULK_TIMERS; i++) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        entries[i] = (timer_entry_t) { .fd = i };
+        timer_schedule(&wheel, &entries[i], 10 + (seed >> 33) % (600 * 1000));
+    }
+
+    size_t expired_count = 0;
+    uint64_t now = 0;
+    while (expired_count < BULK_TIMERS) {
+        int timeout = timer_wheel_timeout(&wheel, now);
+        test_assert(timeout >= 0, "expected a timeout while timers are scheduled");
+        now += timeout;
+
+        for (timer_entry_t* e = timer_wheel_advance(&wheel, now); e; e = e->next) {
+            test_assert(e->expires * TIMER_TICK_MS <= now, "timer expired before its deadline");
+            test_assert(e->expires * TIMER_TICK_MS + TIMER_TICK_MS > now, "timer expired late");
+            expired_count++;
+        }
+    }
+    test_assert(timer_wheel_timeout(&wheel, now) == -1, "expected every timer to have expired");
+
+    return 0;
+}
+
+int timer_test_suite()
+{
+    int r = 0;
+    if (test_expiry_across_levels() < 0) {
+        r = -1;
+        printf("\t❌ test_expiry_across_levels\n");
+    } else {
+        printf("\t✅ test_expiry_across_levels\n");
+    }
+    if (test_cancel_and_reschedule() < 0) {
+        r = -1;
+        printf("\t❌ test_cancel_and_reschedule\n");
+    } else {
+        printf("\t✅ test_cancel_and_reschedule\n");
+    }
+    if (test_bulk_expiry() < 0) {
+        r = -1;
+        printf("\t❌ test_bulk_expiry\n");
+    } else {
+        printf("\t✅ test_bulk_expiry\n");
+    }
+    return r;
+}
@@ -0,0 +1,70 @@
+/**
+ * Hierarchical timer wheel for connection deadlines.
+ *
+ * Time is counted in ticks of TIMER_TICK_MS. The wheel has TIMER_LEVELS levels of TIMER_SLOTS slots
+ * each: level 0 holds the timers that expire within the next TIMER_SLOTS ticks, one slot per tick,
+ * level 1 the ones within the next TIMER_SLOTS^2 ticks, one slot per TIMER_SLOTS ticks, and so on.
+ * Every time level 0 wraps around, the next slot of level 1 is cascaded down into it (and likewise
+ * for the levels above). Scheduling, cancelling and expiring a timer are all O(1), no matter how
+ * many connections there are.
+ *
+ * Timers are intrusive, so a connection embeds its `timer_entry_t` and the wheel never allocates.
+ */
+
+#pragma once
+
+#include "common.h"
+
+#define TIMER_TICK_MS 10
+#define TIMER_LEVELS 4
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+
+typedef struct timer_entry_t {
+    // The tick at which the timer expires
+    uint64_t expires;
+    // The connection the timer belongs to
+    int fd;
+    // The slot list the entry is linked into, NULL if the timer isn't scheduled
+    struct timer_entry_t** slot;
+    struct timer_entry_t* prev;
+    // Link in the slot list, and in the list returned by `timer_wheel_advance`
+    struct timer_entry_t* next;
+} timer_entry_t;
+
+typedef struct timer_wheel_t {
+    // The last tick that has been fully processed
+    uint64_t current;
+    timer_entry_t* slots[TIMER_LEVELS][TIMER_SLOTS];
+    // Number of scheduled timers on each level
+    size_t counts[TIMER_LEVELS];
+} timer_wheel_t;
+
+void timer_wheel_init(timer_wheel_t* self, uint64_t now_ms);
+
+/**
+ * Schedules the timer to expire at `deadline_ms` (on the `clock_monotonic_ms` clock), moving it if
+ * it was already scheduled. Deadlines are rounded up to the next tick.
+ */
+void timer_schedule(timer_wheel_t* self, timer_entry_t* entry, uint64_t deadline_ms);
+
+/**
+ * Unschedules the timer. Does nothing if it isn't scheduled.
+ */
+void timer_cancel(timer_wheel_t* self, timer_entry_t* entry);
+
+bool timer_is_scheduled(timer_entry_t* entry);
+
+/**
+ * How long the event loop may wait before it has to call `timer_wheel_advance` again, in
+ * milliseconds. Returns -1 if no timers are scheduled.
+ */
+int timer_wheel_timeout(timer_wheel_t* self, uint64_t now_ms);
+
+/**
+ * Moves the wheel forward to `now_ms` and returns every timer that has expired on the way, as a
+ * list linked through `next`. The returned timers are no longer scheduled.
+ */
+timer_entry_t* timer_wheel_advance(timer_wheel_t* self, uint64_t now_ms);
+
+int timer_test_suite();
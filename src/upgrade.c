@@ -0,0 +1,261 @@
+#include "upgrade.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+// How long the old process waits for the new one to acknowledge the handoff. Until it does, the old
+// process keeps accepting as if nothing happened.
+#define ACK_TIMEOUT_SECONDS 5
+
+// Control buffer big enough for the most fds we ever hand over, aligned for `struct cmsghdr`
+typedef union fd_control_t {
+    struct cmsghdr header;
+    char buf[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_FDS)];
+} fd_control_t;
+
+static int unix_address(const char* path, struct sockaddr_un* addr)
+{
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        println("upgrade socket path is too long: %s", path);
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+int upgrade_listen(const char* path)
+{
+    struct sockaddr_un addr;
+    if (unix_address(path, &addr) < 0) {
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    // Either a stale file from a process that is gone, or the socket of the process we have just
+    // taken over from, which doesn't need it anymore
+    unlink(path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+        perror("upgrade socket");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int upgrade_send_fds(int conn_fd, const int* fds, int count)
+{
+    if (count < 1 || count > UPGRADE_MAX_FDS) {
+        return -1;
+    }
+
+    // The fds travel as ancillary data, which needs at least one byte of regular data to go with
+    // it. The count lets the receiver notice if some of them got lost on the way.
+    uint32_t fd_count = count;
+    struct iovec iov = { .iov_base = &fd_count, .iov_len = sizeof(fd_count) };
+    fd_control_t control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = CMSG_SPACE(sizeof(int) * count),
+    };
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+
+    if (sendmsg(conn_fd, &msg, 0) != (ssize_t)sizeof(fd_count)) {
+        perror("sendmsg");
+        return -1;
+    }
+
+    struct timeval timeout = { .tv_sec = ACK_TIMEOUT_SECONDS };
+    setsockopt(conn_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    char ack;
+    if (read(conn_fd, &ack, 1) != 1) {
+        println("the new process didn't acknowledge the listening sockets");
+        return -1;
+    }
+
+    return 0;
+}
+
+int upgrade_receive_fds(const char* path, int* fds, int max_fds)
+{
+    struct sockaddr_un addr;
+    if (unix_address(path, &addr) < 0) {
+        return -1;
+    }
+
+    int conn_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (conn_fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    if (connect(conn_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        println("failed to connect to %s: %s", path, strerror(errno));
+        close(conn_fd);
+        return -1;
+    }
+
+    uint32_t expected = 0;
+    struct iovec iov = { .iov_base = &expected, .iov_len = sizeof(expected) };
+    fd_control_t control;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+
+    int flags = 0;
+#ifdef MSG_CMSG_CLOEXEC
+    flags |= MSG_CMSG_CLOEXEC;
+#endif
+    ssize_t r;
+    do {
+        r = recvmsg(conn_fd, &msg, flags);
+    } while (r < 0 && errno == EINTR);
+
+    int count = 0;
+    int received[UPGRADE_MAX_FDS];
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); r > 0 && cmsg;
+        cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        if (count + n > UPGRADE_MAX_FDS) {
+            n = UPGRADE_MAX_FDS - count;
+        }
+        memcpy(&received[count], CMSG_DATA(cmsg), sizeof(int) * n);
+        count += n;
+    }
+
+    if (r != (ssize_t)sizeof(expected) || (msg.msg_flags & MSG_CTRUNC) || count == 0
+        || count != (int)expected || count > max_fds) {
+        println("failed to receive the listening sockets from %s", path);
+        for (int i = 0; i < count; i++) {
+            close(received[i]);
+        }
+        close(conn_fd);
+        return -1;
+    }
+
+    // The old process keeps accepting until it gets this, so nothing is lost if we die before
+    if (write(conn_fd, "", 1) != 1) {
+        perror("write");
+    }
+    close(conn_fd);
+
+    memcpy(fds, received, sizeof(int) * count);
+    return count;
+}
+
+/**
+ ***************************************************************************************************
+ * Tests
+ ***************************************************************************************************
+ */
+#define test_assert(cond, msg)                                                                     \
+    do {                                                                                           \
+        if (!(cond)) {                                                                             \
+            printf("Assertion failed: %s\n", msg);                                                 \
+            return -1;                                                                             \
+        }                                                                                          \
+    } while (0)
+
+#define TEST_SOCKET_PATH "./test-upgrade.sock"
+
+typedef struct handoff_t {
+    int listen_fd;
+    int fds[2];
+    int result;
+} handoff_t;
+
+static void* run_old_process(void* arg)
+{
+    handoff_t* handoff = arg;
+    handoff->result = -1;
+
+    int conn_fd = accept(handoff->listen_fd, NULL, NULL);
+    if (conn_fd >= 0) {
+        handoff->result = upgrade_send_fds(conn_fd, handoff->fds, 2);
+        close(conn_fd);
+    }
+    return NULL;
+}
+
+static int test_handoff()
+{
+    // Hand over both ends of a pipe, and check that the received fds refer to the same pipe
+    handoff_t handoff;
+    test_assert(pipe(handoff.fds) == 0, "failed to create a pipe");
+    handoff.listen_fd = upgrade_listen(TEST_SOCKET_PATH);
+    test_assert(handoff.listen_fd >= 0, "failed to listen on the upgrade socket");
+
+    pthread_t thread;
+    test_assert(pthread_create(&thread, NULL, run_old_process, &handoff) == 0,
+        "failed to start the old process thread");
+
+    int fds[UPGRADE_MAX_FDS];
+    int count = upgrade_receive_fds(TEST_SOCKET_PATH, fds, UPGRADE_MAX_FDS);
+    pthread_join(thread, NULL);
+    close(handoff.listen_fd);
+    unlink(TEST_SOCKET_PATH);
+
+    test_assert(handoff.result == 0, "expected the handoff to be acknowledged");
+    test_assert(count == 2, "expected to receive both fds");
+    test_assert(fds[0] != handoff.fds[0] && fds[1] != handoff.fds[1], "expected new fds");
+
+    char buf[8] = { 0 };
+    test_assert(write(fds[1], "hello", 5) == 5, "failed to write to the received fd");
+    test_assert(read(handoff.fds[0], buf, sizeof(buf)) == 5 && strcmp(buf, "hello") == 0,
+        "expected the received fd to write into the original pipe");
+
+    for (int i = 0; i < 2; i++) {
+        close(fds[i]);
+        close(handoff.fds[i]);
+    }
+    return 0;
+}
+
+static int test_nobody_listening()
+{
+    unlink(TEST_SOCKET_PATH);
+    int fds[UPGRADE_MAX_FDS];
+    test_assert(upgrade_receive_fds(TEST_SOCKET_PATH, fds, UPGRADE_MAX_FDS) == -1,
+        "expected the takeover to fail without a server to take over from");
+    return 0;
+}
+
+int upgrade_test_suite()
+{
+    int r = 0;
+    if (test_handoff() < 0) {
+        r = -1;
+        printf("\t❌ test_handoff\n");
+    } else {
+        printf("\t✅ test_handoff\n");
+    }
+    if (test_nobody_listening() < 0) {
+        r = -1;
+        printf("\t❌ test_nobody_listening\n");
+    } else {
+        printf("\t✅ test_nobody_listening\n");
+    }
+    return r;
+}
@@ -0,0 +1,35 @@
+/**
+ * Hands the listening sockets of a running server over to its replacement.
+ *
+ * The running server listens on a Unix socket. A new process connects to it and receives the
+ * listening sockets as SCM_RIGHTS ancillary data, then acknowledges them with a single byte. From
+ * then on both processes accept from the very same sockets (and accept queues), so the old one can
+ * stop accepting and drain without a single connection being refused.
+ */
+
+#pragma once
+
+#include "common.h"
+
+// The most listening sockets that can be handed over at once
+#define UPGRADE_MAX_FDS 64
+
+/**
+ * Creates the Unix socket at `path` for the next process to connect to, replacing whatever socket
+ * file is there already. Returns the listening fd, or -1 on failure.
+ */
+int upgrade_listen(const char* path);
+
+/**
+ * Sends `count` fds to the process connected on `conn_fd`, and waits for it to acknowledge them.
+ * Returns 0 once the other side has them, -1 on failure.
+ */
+int upgrade_send_fds(int conn_fd, const int* fds, int count);
+
+/**
+ * Connects to the server listening on `path` and receives its fds into `fds`. Returns how many were
+ * received, or -1 on failure.
+ */
+int upgrade_receive_fds(const char* path, int* fds, int max_fds);
+
+int upgrade_test_suite();
@@ -0,0 +1,878 @@
+#include "uring.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+_Thread_local bool uring_enabled = false;
+
+// Size of the submission queue. The completion queue is made larger, since multishot requests can
+// post many completions for a single submission.
+#define URING_SQ_ENTRIES 1024
+#define URING_CQ_ENTRIES 8192
+
+// Provided buffers that multishot recvs land in. The count must be a power of two.
+#define URING_BUF_COUNT 1024
+#define URING_BUF_SIZE 4096
+#define URING_BUF_GROUP 0
+// How many of them a single connection may hold on to. Without a cap a client that sends faster
+// than its handler reads (like one uploading a body) would take the whole ring, and every other
+// connection's recv would fail.
+#define URING_INBOX_MAX 16
+
+// Writes larger than this are split into a chain of linked sends
+#define URING_SEND_CHUNK (64 * 1024)
+
+typedef enum {
+    URING_OP_ACCEPT = 1,
+    URING_OP_RECV,
+    URING_OP_SEND,
+    URING_OP_CLOSE,
+    URING_OP_TIMEOUT,
+    URING_OP_POLL,
+    URING_OP_CANCEL,
+} uring_op_t;
+
+// Every submission carries the operation, the fd, and the generation of the connection that owned
+// the fd when it was submitted, so completions that arrive after a connection was closed (and its
+// fd possibly reused) can be told apart from live ones.
+#define pack_user_data(op, gen, fd)                                                                \
+    (((uint64_t)(op) << 56) | ((uint64_t)((gen) & 0xffffff) << 32) | (uint32_t)(fd))
+#define user_data_op(ud) ((uring_op_t)((ud) >> 56))
+#define user_data_gen(ud) ((uint32_t)(((ud) >> 32) & 0xffffff))
+#define user_data_fd(ud) ((int)(uint32_t)(ud))
+
+typedef struct uring_conn_t {
+    uint32_t generation;
+    bool open;
+    bool recv_armed;
+    // Whether the armed recv is being cancelled
+    bool recv_cancelling;
+    // Whether the recv is to stay disarmed until `uring_resume_recv`
+    bool recv_suspended;
+    // Whether recvs take a single buffer at a time. A multishot recv fills as many buffers as the
+    // socket has data for before we get to see any of them, so a connection that has filled its
+    // inbox goes on with single recvs until it has caught up with the client.
+    bool recv_single;
+    bool eof;
+    int recv_error;
+    // FIFO of provided buffers holding bytes that haven't been read yet, linked through
+    // `buf_next`. -1 means empty.
+    int inbox_head;
+    int inbox_tail;
+    // How much of the buffer at `inbox_head` has already been read
+    size_t inbox_offset;
+    // Number of buffers in the inbox
+    int inbox_count;
+    // Number of sends in the current chain that haven't completed yet
+    int sends_in_flight;
+    // Bytes the kernel has confirmed as sent since the last `uring_write` call
+    size_t sent;
+    int send_error;
+    // Whether a poll for writability is in flight, see `uring_poll_writable`
+    bool poll_armed;
+} uring_conn_t;
+
+static _Thread_local struct {
+    int fd;
+
+    unsigned sq_entries;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    // Our own copy of the tail, published to the kernel right before `io_uring_enter`
+    unsigned sq_local_tail;
+
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+
+    struct io_uring_buf_ring* buf_ring;
+    char* buf_base;
+    uint16_t buf_tail;
+    uint32_t buf_len[URING_BUF_COUNT];
+    int buf_next[URING_BUF_COUNT];
+
+    // Read by the kernel when the timeout of `uring_wait` is submitted
+    struct __kernel_timespec timeout;
+
+    int server_fd;
+    uring_conn_t* conns;
+    size_t conns_cap;
+} ring;
+
+static int sys_io_uring_enter(unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, ring.fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static void* map_ring(size_t size, off_t offset)
+{
+    void* ptr
+        = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, offset);
+    if (ptr == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    return ptr;
+}
+
+static void recycle_buffer(int bid)
+{
+    struct io_uring_buf* buf = &ring.buf_ring->bufs[ring.buf_tail & (URING_BUF_COUNT - 1)];
+    buf->addr = (uintptr_t)(ring.buf_base + (size_t)bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    ring.buf_tail++;
+    __atomic_store_n(&ring.buf_ring->tail, ring.buf_tail, __ATOMIC_RELEASE);
+}
+
+static void setup_buffer_ring()
+{
+    size_t ring_size = URING_BUF_COUNT * sizeof(struct io_uring_buf);
+    void* ptr = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (ptr == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    ring.buf_ring = ptr;
+
+    struct io_uring_buf_reg reg = {
+        .ring_addr = (uintptr_t)ptr,
+        .ring_entries = URING_BUF_COUNT,
+        .bgid = URING_BUF_GROUP,
+    };
+    if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        perror("io_uring_register(IORING_REGISTER_PBUF_RING)");
+        exit(1);
+    }
+
+    ring.buf_base = malloc((size_t)URING_BUF_COUNT * URING_BUF_SIZE);
+    ring.buf_tail = 0;
+    for (int bid = 0; bid < URING_BUF_COUNT; bid++) {
+        recycle_buffer(bid);
+    }
+}
+
+void uring_init()
+{
+    struct io_uring_params params;
+    bzero(&params, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+    params.cq_entries = URING_CQ_ENTRIES;
+
+    int fd = syscall(__NR_io_uring_setup, URING_SQ_ENTRIES, &params);
+    if (fd < 0) {
+        perror("io_uring_setup");
+        exit(1);
+    }
+    ring.fd = fd;
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    char* sq_ptr;
+    char* cq_ptr;
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_ptr = map_ring(sq_size > cq_size ? sq_size : cq_size, IORING_OFF_SQ_RING);
+        cq_ptr = sq_ptr;
+    } else {
+        sq_ptr = map_ring(sq_size, IORING_OFF_SQ_RING);
+        cq_ptr = map_ring(cq_size, IORING_OFF_CQ_RING);
+    }
+
+    ring.sq_entries = params.sq_entries;
+    ring.sq_head = (unsigned*)(sq_ptr + params.sq_off.head);
+    ring.sq_tail = (unsigned*)(sq_ptr + params.sq_off.tail);
+    ring.sq_mask = (unsigned*)(sq_ptr + params.sq_off.ring_mask);
+    ring.sq_array = (unsigned*)(sq_ptr + params.sq_off.array);
+    ring.sq_local_tail = *ring.sq_tail;
+    ring.sqes = map_ring(params.sq_entries * sizeof(struct io_uring_sqe), IORING_OFF_SQES);
+
+    ring.cq_head = (unsigned*)(cq_ptr + params.cq_off.head);
+    ring.cq_tail = (unsigned*)(cq_ptr + params.cq_off.tail);
+    ring.cq_mask = (unsigned*)(cq_ptr + params.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe*)(cq_ptr + params.cq_off.cqes);
+
+    setup_buffer_ring();
+
+    ring.server_fd = -1;
+    ring.conns = NULL;
+    ring.conns_cap = 0;
+
+    uring_enabled = true;
+}
+
+static unsigned pending_submissions()
+{
+    return ring.sq_local_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+}
+
+static int submit(unsigned min_complete, unsigned flags)
+{
+    __atomic_store_n(ring.sq_tail, ring.sq_local_tail, __ATOMIC_RELEASE);
+    return sys_io_uring_enter(pending_submissions(), min_complete, flags);
+}
+
+static struct io_uring_sqe* get_sqe()
+{
+    // The submission queue is full, so hand what we have to the kernel before queueing more
+    if (pending_submissions() >= ring.sq_entries) {
+        if (submit(0, 0) < 0) {
+            perror("io_uring_enter");
+        }
+    }
+
+    unsigned index = ring.sq_local_tail & *ring.sq_mask;
+    struct io_uring_sqe* sqe = &ring.sqes[index];
+    bzero(sqe, sizeof(struct io_uring_sqe));
+    ring.sq_array[index] = index;
+    ring.sq_local_tail++;
+    return sqe;
+}
+
+static uring_conn_t* get_conn(int fd)
+{
+    if ((size_t)fd >= ring.conns_cap) {
+        size_t new_cap = ring.conns_cap ? ring.conns_cap : 1024;
+        while (new_cap <= (size_t)fd) {
+            new_cap *= 2;
+        }
+
+        ring.conns = realloc(ring.conns, new_cap * sizeof(uring_conn_t));
+        bzero(ring.conns + ring.conns_cap, (new_cap - ring.conns_cap) * sizeof(uring_conn_t));
+        ring.conns_cap = new_cap;
+    }
+
+    return &ring.conns[fd];
+}
+
+static void arm_accept()
+{
+    struct io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = ring.server_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    // Non-blocking like the sockets of the other modes, since not everything we send goes through
+    // the ring: a `sendfile` that would block has to say so instead of holding up the loop
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = pack_user_data(URING_OP_ACCEPT, 0, ring.server_fd);
+}
+
+static void arm_recv(int fd, uring_conn_t* conn)
+{
+    struct io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = conn->recv_single ? 0 : IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->user_data = pack_user_data(URING_OP_RECV, conn->generation, fd);
+    conn->recv_armed = true;
+}
+
+// Stops the multishot recv. Whatever it completes with before the cancellation catches up still
+// lands in the inbox.
+static void cancel_recv(int fd, uring_conn_t* conn)
+{
+    if (!conn->recv_armed || conn->recv_cancelling) {
+        return;
+    }
+
+    struct io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = pack_user_data(URING_OP_RECV, conn->generation, fd);
+    sqe->user_data = pack_user_data(URING_OP_CANCEL, conn->generation, fd);
+    conn->recv_cancelling = true;
+}
+
+void uring_listen(int server_fd)
+{
+    ring.server_fd = server_fd;
+    arm_accept();
+}
+
+void uring_unlisten()
+{
+    if (ring.server_fd < 0) {
+        return;
+    }
+
+    // The cancellation looks the fd up when it is submitted, which has to happen before the
+    // caller closes it
+    struct io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = ring.server_fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = pack_user_data(URING_OP_CLOSE, 0, ring.server_fd);
+    ring.server_fd = -1;
+    submit(0, 0);
+}
+
+void uring_open_conn(int fd)
+{
+    uring_conn_t* conn = get_conn(fd);
+    uint32_t generation = conn->generation;
+    *conn = (uring_conn_t) {
+        .generation = generation,
+        .open = true,
+        .inbox_head = -1,
+        .inbox_tail = -1,
+    };
+    arm_recv(fd, conn);
+}
+
+void uring_suspend_recv(int fd)
+{
+    uring_conn_t* conn = get_conn(fd);
+    if (conn->recv_suspended) {
+        return;
+    }
+    conn->recv_suspended = true;
+    cancel_recv(fd, conn);
+}
+
+void uring_resume_recv(int fd)
+{
+    uring_conn_t* conn = get_conn(fd);
+    if (!conn->open || !conn->recv_suspended) {
+        return;
+    }
+
+    conn->recv_suspended = false;
+    // Input the connection already has is read first, and reading it all re-arms the recv (see
+    // `uring_read`). If the cancelled recv hasn't completed yet, its completion re-arms it.
+    if (!conn->recv_armed && conn->inbox_head == -1 && !conn->eof && !conn->recv_error) {
+        arm_recv(fd, conn);
+    }
+}
+
+void uring_close_conn(int fd)
+{
+    uring_conn_t* conn = get_conn(fd);
+
+    // Give back any buffers the handler never got around to reading
+    while (conn->inbox_head != -1) {
+        int bid = conn->inbox_head;
+        conn->inbox_head = ring.buf_next[bid];
+        recycle_buffer(bid);
+    }
+
+    uint32_t generation = conn->generation;
+    conn->open = false;
+    conn->generation++;
+
+    // A pending multishot recv holds its own reference to the socket, so closing the fd alone
+    // would leave the connection open. Cancel everything for the fd first; the hard link makes sure
+    // the close still runs when there was nothing to cancel.
+    struct io_uring_sqe* cancel = get_sqe();
+    cancel->opcode = IORING_OP_ASYNC_CANCEL;
+    cancel->fd = fd;
+    cancel->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    cancel->flags = IOSQE_IO_HARDLINK;
+    cancel->user_data = pack_user_data(URING_OP_CLOSE, generation, fd);
+
+    struct io_uring_sqe* close_sqe = get_sqe();
+    close_sqe->opcode = IORING_OP_CLOSE;
+    close_sqe->fd = fd;
+    close_sqe->user_data = pack_user_data(URING_OP_CLOSE, generation, fd);
+}
+
+int uring_wait(int timeout_ms)
+{
+    // Don't block if there are still completions we haven't reaped
+    bool have_completions = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE) != *ring.cq_head;
+    unsigned min_complete = have_completions ? 0 : 1;
+
+    if (min_complete > 0 && timeout_ms >= 0) {
+        ring.timeout = (struct __kernel_timespec) {
+            .tv_sec = timeout_ms / 1000,
+            .tv_nsec = (long long)(timeout_ms % 1000) * 1000000,
+        };
+        struct io_uring_sqe* sqe = get_sqe();
+        sqe->opcode = IORING_OP_TIMEOUT;
+        sqe->addr = (uintptr_t)&ring.timeout;
+        sqe->len = 1;
+        // Also complete as soon as any other completion arrives, so that the timeouts of earlier
+        // waits don't linger in the ring
+        sqe->off = 1;
+        sqe->user_data = pack_user_data(URING_OP_TIMEOUT, 0, 0);
+    }
+
+    if (submit(min_complete, IORING_ENTER_GETEVENTS) < 0) {
+        if (errno != EINTR) {
+            perror("io_uring_enter");
+        }
+        return -1;
+    }
+
+    return __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE) - *ring.cq_head;
+}
+
+static void push_inbox(uring_conn_t* conn, int bid, uint32_t len)
+{
+    ring.buf_len[bid] = len;
+    ring.buf_next[bid] = -1;
+    conn->inbox_count++;
+    if (conn->inbox_tail == -1) {
+        conn->inbox_head = bid;
+    } else {
+        ring.buf_next[conn->inbox_tail] = bid;
+    }
+    conn->inbox_tail = bid;
+}
+
+// Applies a completion to our state. Returns true if the event loop needs to hear about it.
+static bool handle_completion(struct io_uring_cqe* cqe, uring_event_t* event)
+{
+    uring_op_t op = user_data_op(cqe->user_data);
+    int fd = user_data_fd(cqe->user_data);
+    bool more = cqe->flags & IORING_CQE_F_MORE;
+
+    if (op == URING_OP_ACCEPT) {
+        if (!more && ring.server_fd >= 0) {
+            arm_accept();
+        }
+        if (cqe->res < 0) {
+            if (cqe->res != -ECANCELED) {
+                println("accept failed: %s", strerror(-cqe->res));
+            }
+            return false;
+        }
+        println("accepted connection from client_fd: %d", cqe->res);
+        *event = (uring_event_t) { .kind = URING_EVENT_ACCEPT, .fd = cqe->res };
+        return true;
+    }
+
+    if (op == URING_OP_CLOSE || op == URING_OP_TIMEOUT || op == URING_OP_CANCEL) {
+        return false;
+    }
+
+    uring_conn_t* conn = get_conn(fd);
+    bool stale = !conn->open || (conn->generation & 0xffffff) != user_data_gen(cqe->user_data);
+
+    if (op == URING_OP_RECV) {
+        bool has_buffer = cqe->flags & IORING_CQE_F_BUFFER;
+        int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (stale) {
+            if (has_buffer) {
+                recycle_buffer(bid);
+            }
+            return false;
+        }
+
+        if (!more) {
+            conn->recv_armed = false;
+            conn->recv_cancelling = false;
+        }
+
+        if (cqe->res > 0 && has_buffer) {
+            push_inbox(conn, bid, cqe->res);
+            // A buffer that wasn't filled up means the socket has been drained
+            if (cqe->res < URING_BUF_SIZE) {
+                conn->recv_single = false;
+            }
+            // The multishot recv can terminate on its own (e.g. when the buffer ring runs dry for
+            // a moment), so re-arm it as long as the peer is still sending. A full inbox is
+            // re-armed once the handler has read it all, see `uring_read`.
+            if (conn->inbox_count >= URING_INBOX_MAX) {
+                conn->recv_single = true;
+                cancel_recv(fd, conn);
+            } else if (!more && !conn->recv_suspended) {
+                arm_recv(fd, conn);
+            }
+        } else if (cqe->res == -ECANCELED) {
+            // The handler may have read the inbox while the cancellation was in flight, and
+            // `uring_resume_recv` may have been called, in which case nobody else re-arms it.
+            // There is nothing new for the handler either way.
+            if (!conn->recv_suspended && conn->inbox_head == -1) {
+                arm_recv(fd, conn);
+            }
+            return false;
+        } else if (cqe->res == 0) {
+            conn->eof = true;
+        } else if (cqe->res == -ENOBUFS) {
+            // Every provided buffer is sitting in some connection's inbox. The recv is re-armed
+            // when this connection's handler next finds its own inbox empty.
+        } else if (cqe->res < 0) {
+            conn->recv_error = -cqe->res;
+        }
+
+        *event = (uring_event_t) { .kind = URING_EVENT_READY, .fd = fd };
+        return true;
+    }
+
+    if (op == URING_OP_POLL) {
+        if (stale) {
+            return false;
+        }
+        conn->poll_armed = false;
+        *event = (uring_event_t) { .kind = URING_EVENT_READY, .fd = fd };
+        return true;
+    }
+
+    if (op == URING_OP_SEND) {
+        if (stale) {
+            return false;
+        }
+
+        conn->sends_in_flight--;
+        if (cqe->res > 0) {
+            conn->sent += cqe->res;
+        } else if (cqe->res < 0 && cqe->res != -ECANCELED) {
+            conn->send_error = -cqe->res;
+        }
+
+        // Only wake the handler once the whole chain has settled
+        if (conn->sends_in_flight > 0) {
+            return false;
+        }
+
+        *event = (uring_event_t) { .kind = URING_EVENT_READY, .fd = fd };
+        return true;
+    }
+
+    return false;
+}
+
+bool uring_next_event(uring_event_t* event)
+{
+    unsigned head = *ring.cq_head;
+    while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe cqe = ring.cqes[head & *ring.cq_mask];
+        head++;
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+        if (handle_completion(&cqe, event)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool uring_has_input(int fd)
+{
+    uring_conn_t* conn = get_conn(fd);
+    return conn->inbox_head != -1;
+}
+
+ssize_t uring_read(int fd, void* buf, size_t len)
+{
+    uring_conn_t* conn = get_conn(fd);
+    size_t copied = 0;
+
+    while (copied < len && conn->inbox_head != -1) {
+        int bid = conn->inbox_head;
+        size_t available = ring.buf_len[bid] - conn->inbox_offset;
+        size_t n = available < len - copied ? available : len - copied;
+
+        char* data = ring.buf_base + (size_t)bid * URING_BUF_SIZE + conn->inbox_offset;
+        memcpy((char*)buf + copied, data, n);
+        copied += n;
+        conn->inbox_offset += n;
+
+        if (conn->inbox_offset == ring.buf_len[bid]) {
+            conn->inbox_head = ring.buf_next[bid];
+            if (conn->inbox_head == -1) {
+                conn->inbox_tail = -1;
+            }
+            conn->inbox_offset = 0;
+            conn->inbox_count--;
+            recycle_buffer(bid);
+        }
+    }
+
+    if (copied > 0) {
+        return copied;
+    }
+
+    if (conn->recv_error) {
+        errno = conn->recv_error;
+        return -1;
+    }
+
+    if (conn->eof) {
+        return 0;
+    }
+
+    if (!conn->recv_armed && !conn->recv_suspended) {
+        arm_recv(fd, conn);
+    }
+
+    errno = EAGAIN;
+    return -1;
+}
+
+ssize_t uring_writev(int fd, const struct iovec* iov, int count, bool more)
+{
+    uring_conn_t* conn = get_conn(fd);
+
+    if (conn->send_error) {
+        errno = conn->send_error;
+        conn->send_error = 0;
+        return -1;
+    }
+
+    // Report whatever the last chain managed to send. If the chain was cut short the caller will
+    // come back with the rest of the buffers and we'll submit a new one.
+    if (conn->sent > 0) {
+        size_t sent = conn->sent;
+        conn->sent = 0;
+        return sent;
+    }
+
+    if (conn->sends_in_flight == 0) {
+        // Submit all of the buffers at once as a chain of linked sends, so the kernel writes the
+        // chunks in order without coming back to us in between. A chain that is split across two
+        // submissions turns into two independent chains that may run concurrently, so it has to
+        // fit into the submission queue along with whatever is already queued. Anything beyond
+        // that goes out in the next chain, once the caller comes back with the rest.
+        unsigned chunks = 0;
+        int buffers = 0;
+        for (; buffers < count && chunks < ring.sq_entries; buffers++) {
+            chunks += (iov[buffers].iov_len + URING_SEND_CHUNK - 1) / URING_SEND_CHUNK;
+        }
+        if (chunks > ring.sq_entries) {
+            chunks = ring.sq_entries;
+        }
+        if (pending_submissions() + chunks > ring.sq_entries && submit(0, 0) < 0) {
+            perror("io_uring_enter");
+        }
+
+        struct io_uring_sqe* last = NULL;
+        for (int i = 0; i < buffers && conn->sends_in_flight < (int)chunks; i++) {
+            const char* buf = iov[i].iov_base;
+            size_t len = iov[i].iov_len;
+            for (size_t offset = 0; offset < len && conn->sends_in_flight < (int)chunks;) {
+                size_t chunk = len - offset < URING_SEND_CHUNK ? len - offset : URING_SEND_CHUNK;
+                if (last) {
+                    last->flags = IOSQE_IO_LINK;
+                    // Corks the small sends (like the headers in front of a body) into the ones
+                    // after them, rather than sending them in packets of their own
+                    last->msg_flags |= MSG_MORE;
+                }
+                struct io_uring_sqe* sqe = get_sqe();
+                sqe->opcode = IORING_OP_SEND;
+                sqe->fd = fd;
+                sqe->addr = (uintptr_t)buf + offset;
+                sqe->len = chunk;
+                sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+                sqe->user_data = pack_user_data(URING_OP_SEND, conn->generation, fd);
+                offset += chunk;
+                conn->sends_in_flight++;
+                last = sqe;
+            }
+        }
+        if (last && more) {
+            last->msg_flags |= MSG_MORE;
+        }
+    }
+
+    errno = EAGAIN;
+    return -1;
+}
+
+ssize_t uring_write(int fd, const void* buf, size_t len)
+{
+    struct iovec iov = { .iov_base = (void*)buf, .iov_len = len };
+    return uring_writev(fd, &iov, 1, false);
+}
+
+void uring_poll_writable(int fd)
+{
+    uring_conn_t* conn = get_conn(fd);
+    if (conn->poll_armed) {
+        return;
+    }
+
+    struct io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLOUT;
+    sqe->user_data = pack_user_data(URING_OP_POLL, conn->generation, fd);
+    conn->poll_armed = true;
+}
+
+/**
+ ***************************************************************************************************
+ * Tests
+ ***************************************************************************************************
+ */
+#define LOG_IN_TEST_SUITE 0
+#define test_log(fmt, ...)                                                                         \
+    do {                                                                                           \
+        if (LOG_IN_TEST_SUITE) {                                                                   \
+            printf(fmt, ##__VA_ARGS__);                                                            \
+        }                                                                                          \
+    } while (0)
+
+#define assert(cond, msg)                                                                          \
+    do {                                                                                           \
+        if (!(cond)) {                                                                             \
+            printf("Assertion failed: %s\n", msg);                                                 \
+            return -1;                                                                             \
+        }                                                                                          \
+    } while (0)
+
+// Waits for the next event the loop would act on, submitting as needed.
+static bool wait_for_event(uring_event_t* event)
+{
+    for (int i = 0; i < 100; i++) {
+        if (uring_next_event(event)) {
+            return true;
+        }
+        if (uring_wait(-1) < 0) {
+            return false;
+        }
+    }
+    return false;
+}
+
+static int test_uring_recv_and_send()
+{
+    uring_init();
+
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        perror("socketpair");
+        return -1;
+    }
+    // Connections are non-blocking, like the ones the ring accepts
+    int conn_fd = fds[0];
+    fcntl(conn_fd, F_SETFL, fcntl(conn_fd, F_GETFL, 0) | O_NONBLOCK);
+    int peer_fd = fds[1];
+
+    uring_open_conn(conn_fd);
+
+    char buffer[64];
+    assert(uring_read(conn_fd, buffer, sizeof(buffer)) == -1 && errno == EAGAIN,
+        "uring_read should return EAGAIN before anything has been received");
+
+    const char* message = "Hello, world!";
+    if (write(peer_fd, message, strlen(message)) < 0) {
+        perror("write");
+        return -1;
+    }
+
+    uring_event_t event;
+    assert(wait_for_event(&event), "expected a completion for the recv");
+    assert(event.kind == URING_EVENT_READY && event.fd == conn_fd, "expected a ready event");
+    assert(uring_has_input(conn_fd), "expected received bytes in the inbox");
+
+    ssize_t n = uring_read(conn_fd, buffer, sizeof(buffer));
+    assert(n == (ssize_t)strlen(message), "uring_read should return the whole message");
+    buffer[n] = '\0';
+    test_log("read message: %s\n", buffer);
+    assert(strcmp(buffer, message) == 0, "message read from the ring does not match");
+
+    // A reply larger than a single send, so it goes out as a linked chain. It's small enough to fit
+    // in the socket buffer, so the peer doesn't have to read concurrently.
+    size_t reply_len = URING_SEND_CHUNK + 100;
+    char* reply = malloc(reply_len);
+    for (size_t i = 0; i < reply_len; i++) {
+        reply[i] = 'a' + i % 26;
+    }
+
+    assert(uring_write(conn_fd, reply, reply_len) == -1 && errno == EAGAIN,
+        "uring_write should return EAGAIN while the chain is in flight");
+
+    size_t written = 0;
+    while (written < reply_len) {
+        assert(wait_for_event(&event), "expected a completion for the send chain");
+        ssize_t w = uring_write(conn_fd, reply + written, reply_len - written);
+        if (w > 0) {
+            written += w;
+        }
+    }
+
+    char* received = malloc(reply_len);
+    size_t received_len = 0;
+    while (received_len < reply_len) {
+        ssize_t r = read(peer_fd, received + received_len, reply_len - received_len);
+        assert(r > 0, "peer read failed");
+        received_len += r;
+    }
+    assert(memcmp(received, reply, reply_len) == 0, "peer should receive the reply in order");
+
+    uring_close_conn(conn_fd);
+    uring_wait(-1);
+    assert(!uring_next_event(&event) || event.kind != URING_EVENT_READY,
+        "closed connections should not produce events");
+
+    close(peer_fd);
+    free(reply);
+    free(received);
+    return 0;
+}
+
+static int test_uring_suspend_recv()
+{
+    uring_init();
+
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        perror("socketpair");
+        return -1;
+    }
+    int conn_fd = fds[0];
+    fcntl(conn_fd, F_SETFL, fcntl(conn_fd, F_GETFL, 0) | O_NONBLOCK);
+    int peer_fd = fds[1];
+
+    uring_open_conn(conn_fd);
+    uring_suspend_recv(conn_fd);
+    // Lets the cancellation go through, which nobody hears about
+    uring_event_t event;
+    uring_wait(10);
+    assert(!uring_next_event(&event), "the cancelled recv should not wake anyone up");
+
+    if (write(peer_fd, "ping", 4) < 0) {
+        perror("write");
+        return -1;
+    }
+    uring_wait(10);
+    assert(!uring_next_event(&event) && !uring_has_input(conn_fd),
+        "a suspended connection should not receive anything");
+
+    char buffer[8];
+    assert(uring_read(conn_fd, buffer, sizeof(buffer)) == -1 && errno == EAGAIN,
+        "reading should not re-arm a suspended recv");
+    uring_wait(10);
+    assert(!uring_next_event(&event), "the recv should still be suspended");
+
+    uring_resume_recv(conn_fd);
+    assert(wait_for_event(&event) && event.fd == conn_fd, "expected the data once resumed");
+    assert(uring_read(conn_fd, buffer, sizeof(buffer)) == 4 && memcmp(buffer, "ping", 4) == 0,
+        "expected the data that arrived while suspended");
+
+    uring_close_conn(conn_fd);
+    uring_wait(0);
+    close(peer_fd);
+    return 0;
+}
+
+int uring_test_suite()
+{
+    int r = 0;
+    if (test_uring_recv_and_send() < 0) {
+        r = -1;
+        printf("\t❌ test_uring_recv_and_send\n");
+    } else {
+        printf("\t✅ test_uring_recv_and_send\n");
+    }
+    if (test_uring_suspend_recv() < 0) {
+        r = -1;
+        printf("\t❌ test_uring_suspend_recv\n");
+    } else {
+        printf("\t✅ test_uring_suspend_recv\n");
+    }
+    return r;
+}
@@ -0,0 +1,262 @@
+/**
+ * Optional io_uring execution mode (Linux only).
+ *
+ * In this mode the listener is driven by a single multishot accept, every connection has a
+ * multishot recv that fills buffers from a kernel-provided buffer ring, and responses go out as
+ * chains of linked sends. Submissions and completions for a whole loop iteration share a single
+ * `io_uring_enter` call.
+ *
+ * Handler and response futures don't talk to io_uring directly: they go through the `io_*`
+ * helpers at the bottom of this file, which fall back to plain read/write and the kqueue.h
+ * registrations when io_uring is not enabled.
+ */
+
+#pragma once
+
+#include "common.h"
+#include "kqueue.h"
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+// Not every platform can tell the socket that more is coming right away
+#ifndef MSG_MORE
+#define MSG_MORE 0
+#endif
+
+#ifdef __linux__
+
+// Set by `uring_init`. When false none of the other functions in this file may be called. Like the
+// ring itself this is thread-local, so every event loop thread sets up its own.
+extern _Thread_local bool uring_enabled;
+
+/**
+ * Sets up the ring and registers the provided buffer ring that connections receive into.
+ */
+void uring_init();
+
+/**
+ * Arms a multishot accept on the listening socket.
+ */
+void uring_listen(int server_fd);
+
+/**
+ * Cancels the multishot accept armed by `uring_listen`. The cancellation is submitted right away,
+ * so the listening socket may be closed as soon as this returns.
+ */
+void uring_unlisten();
+
+/**
+ * Starts tracking a freshly accepted client and arms its multishot recv.
+ */
+void uring_open_conn(int fd);
+
+/**
+ * Cancels the client's multishot recv and keeps it from being re-armed until `uring_resume_recv`,
+ * so that a connection that can't take any more input for now doesn't keep filling up the provided
+ * buffers every other connection receives into. Bytes received before the cancellation stay in the
+ * inbox.
+ */
+void uring_suspend_recv(int fd);
+
+/**
+ * Re-arms the recv after `uring_suspend_recv`.
+ */
+void uring_resume_recv(int fd);
+
+/**
+ * Cancels everything in flight for the client and closes it through the ring.
+ */
+void uring_close_conn(int fd);
+
+/**
+ * Submits everything queued so far and blocks until at least one completion is available, or until
+ * `timeout_ms` milliseconds have passed (-1 waits forever).
+ */
+int uring_wait(int timeout_ms);
+
+typedef enum {
+    // `fd` is a newly accepted client
+    URING_EVENT_ACCEPT,
+    // `fd` has received data, finished a send, or hit an error, and should be polled again
+    URING_EVENT_READY,
+} uring_event_kind_t;
+
+typedef struct uring_event_t {
+    uring_event_kind_t kind;
+    int fd;
+} uring_event_t;
+
+/**
+ * Reaps the next completion that the event loop needs to act on. Completions that only update
+ * internal state (e.g. a send in the middle of a chain) are consumed silently. Returns false once
+ * the completion queue is empty.
+ */
+bool uring_next_event(uring_event_t* event);
+
+/**
+ * Whether there are received bytes for the fd that haven't been consumed by `uring_read` yet.
+ */
+bool uring_has_input(int fd);
+
+/**
+ * Copies received bytes for the fd into `buf`. Behaves like a non-blocking `read`: returns -1 with
+ * errno set to EAGAIN when nothing has arrived yet, and 0 once the peer has closed.
+ */
+ssize_t uring_read(int fd, void* buf, size_t len);
+
+/**
+ * Behaves like a non-blocking `write`, except that the bytes are handed to the kernel as a chain of
+ * linked sends and the call returns EAGAIN until they complete. `buf` must stay valid until a later
+ * call reports the bytes as written.
+ */
+ssize_t uring_write(int fd, const void* buf, size_t len);
+
+/**
+ * Like `uring_write`, for the `count` buffers in `iov`, which go out one after the other in a
+ * single chain. `more` says that more is coming right after them.
+ */
+ssize_t uring_writev(int fd, const struct iovec* iov, int count, bool more);
+
+/**
+ * Wakes the connection up once its socket is writable, for the writes that don't go through the
+ * ring (see `io_sendfile`).
+ */
+void uring_poll_writable(int fd);
+
+int uring_test_suite();
+
+#else
+#define uring_enabled false
+#define uring_has_input(fd) false
+#define uring_read(fd, buf, len) read(fd, buf, len)
+#define uring_write(fd, buf, len) write(fd, buf, len)
+#define uring_writev(fd, iov, count, more) writev(fd, iov, count)
+#define uring_poll_writable(fd)
+#define uring_suspend_recv(fd)
+#define uring_resume_recv(fd)
+#endif
+
+// Reads from a client connection, through the ring if it is enabled.
+static inline ssize_t io_read(int fd, void* buf, size_t len)
+{
+    if (uring_enabled) {
+        return uring_read(fd, buf, len);
+    }
+
+    // In edge-triggered mode we know when the socket has been drained, and can skip the read that
+    // would only come back with EAGAIN.
+    if (is_edge_triggered() && !is_readable(fd)) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    ssize_t n = read(fd, buf, len);
+    // A short read means the socket buffer is empty, so in edge-triggered mode there is no point in
+    // reading again before the next edge.
+    if (n >= 0 && (size_t)n < len) {
+        mark_read_drained(fd);
+    }
+    return n;
+}
+
+// Writes the `count` buffers in `iov` to a client connection, in order, like `writev`. Through the
+// ring if it is enabled. `more` says that more is coming right after them, which keeps the last of
+// them from going out in a small packet of its own.
+static inline ssize_t io_writev(int fd, const struct iovec* iov, int count, bool more)
+{
+    if (uring_enabled) {
+        return uring_writev(fd, iov, count, more);
+    }
+    if (more && MSG_MORE) {
+        struct msghdr msg = { .msg_iov = (struct iovec*)iov, .msg_iovlen = count };
+        return sendmsg(fd, &msg, MSG_MORE);
+    }
+    return writev(fd, iov, count);
+}
+
+// Sends `len` bytes of the file `file_fd` from `*offset` to a client connection, like `sendfile`,
+// and moves `*offset` past what was sent. The bytes go from the page cache to the socket without
+// passing through our memory. This doesn't go through the ring, so with io_uring a send that would
+// block asks the ring to wake us up once the socket is writable, like a send through the ring does.
+static inline ssize_t io_sendfile(int fd, int file_fd, off_t* offset, size_t len)
+{
+#if defined(__linux__)
+    ssize_t sent = sendfile(fd, file_fd, offset, len);
+#elif defined(__APPLE__)
+    // Reports what it sent even when it stops short with EAGAIN
+    off_t len_sent = len;
+    int r = sendfile(file_fd, fd, *offset, &len_sent, NULL, 0);
+    *offset += len_sent;
+    ssize_t sent = len_sent > 0 ? len_sent : r;
+#else
+    // Everywhere else the file goes through a buffer of ours
+    char buf[16 * 1024];
+    ssize_t sent = pread(file_fd, buf, len < sizeof(buf) ? len : sizeof(buf), *offset);
+    if (sent > 0) {
+        sent = write(fd, buf, sent);
+        if (sent > 0) {
+            *offset += sent;
+        }
+    }
+#endif
+    if (sent < 0 && errno == EAGAIN && uring_enabled) {
+        uring_poll_writable(fd);
+    }
+    return sent;
+}
+
+// Whether bytes may already be waiting for the connection that no further event is going to tell us
+// about: either in the io_uring inbox, or in a socket whose edge we've already consumed.
+static inline bool io_has_input(int fd)
+{
+    return uring_enabled ? uring_has_input(fd) : is_readable(fd);
+}
+
+// Asks to be polled again once the connection is readable. With io_uring the multishot recv is
+// always armed, so there is nothing to do.
+static inline void io_wait_readable(int fd)
+{
+    if (!uring_enabled) {
+        register_read_event(fd);
+    }
+}
+
+// Stops polling the connection for input while its handler waits on the worker pool, whose
+// completion wakes it up instead (see `io_resume_reading`). It couldn't read anything until then,
+// and the input would only keep the level-triggered modes reporting the connection on every
+// iteration, or take up buffers in the ring that the other connections need.
+static inline void io_suspend_reading(int fd)
+{
+    if (uring_enabled) {
+        uring_suspend_recv(fd);
+    } else {
+        suspend_events(fd);
+    }
+}
+
+// Takes back `io_suspend_reading`, for the event loop to call when the work the connection has been
+// waiting on comes back. Unlike `io_wait_readable` this doesn't say the fd has been drained, since
+// in edge-triggered mode there may still be input from an edge that was reported in the meantime.
+static inline void io_resume_reading(int fd)
+{
+    if (uring_enabled) {
+        uring_resume_recv(fd);
+    } else if (!is_edge_triggered()) {
+        register_read_event(fd);
+    }
+}
+
+// Asks to be polled again once the connection is writable. With io_uring the send that returned
+// EAGAIN is already in flight and its completion will wake us up.
+static inline void io_wait_writable(int fd)
+{
+    if (!uring_enabled) {
+        register_write_event(fd);
+    }
+}
@@ -0,0 +1,219 @@
+#include "workers.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+// Work that has been submitted but not picked up by a worker yet. Shared by all event loops.
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t available;
+    work_item_t* head;
+    work_item_t* tail;
+    int thread_count;
+} pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .available = PTHREAD_COND_INITIALIZER,
+};
+
+// The completion queue of the event loop running on this thread, if any
+static _Thread_local completion_queue_t* current_queue = NULL;
+
+static void complete(work_item_t* item)
+{
+    completion_queue_t* queue = item->completions;
+
+    pthread_mutex_lock(&queue->lock);
+    item->next = NULL;
+    if (queue->tail) {
+        queue->tail->next = item;
+    } else {
+        queue->head = item;
+    }
+    queue->tail = item;
+    pthread_mutex_unlock(&queue->lock);
+
+    // If the loop is already awake and about to take the queue, this only causes a spurious wakeup.
+    // And if the socket buffer is full there are plenty of wakeups pending already, so a failed
+    // write can be ignored.
+    ssize_t r = write(queue->notify_fd, "", 1);
+    (void)r;
+}
+
+static void* worker_main(void* arg)
+{
+    (void)arg;
+
+    while (1) {
+        pthread_mutex_lock(&pool.lock);
+        while (pool.head == NULL) {
+            pthread_cond_wait(&pool.available, &pool.lock);
+        }
+
+        work_item_t* item = pool.head;
+        pool.head = item->next;
+        if (pool.head == NULL) {
+            pool.tail = NULL;
+        }
+        pthread_mutex_unlock(&pool.lock);
+
+        item->run(item);
+        complete(item);
+    }
+
+    return NULL;
+}
+
+void workers_start(int thread_count)
+{
+    for (int i = 0; i < thread_count; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, worker_main, NULL) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+        // Workers live as long as the process, nobody ever joins them
+        pthread_detach(thread);
+    }
+
+    pool.thread_count += thread_count;
+}
+
+void completion_queue_init(completion_queue_t* self, int notify_fd)
+{
+    pthread_mutex_init(&self->lock, NULL);
+    self->head = NULL;
+    self->tail = NULL;
+    self->notify_fd = notify_fd;
+    current_queue = self;
+}
+
+void workers_submit(work_item_t* item)
+{
+    item->done = false;
+    item->next = NULL;
+
+    if (pool.thread_count == 0 || current_queue == NULL) {
+        item->run(item);
+        item->done = true;
+        return;
+    }
+
+    item->completions = current_queue;
+
+    pthread_mutex_lock(&pool.lock);
+    if (pool.tail) {
+        pool.tail->next = item;
+    } else {
+        pool.head = item;
+    }
+    pool.tail = item;
+    pthread_cond_signal(&pool.available);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+work_item_t* completion_queue_take(completion_queue_t* self)
+{
+    pthread_mutex_lock(&self->lock);
+    work_item_t* items = self->head;
+    self->head = NULL;
+    self->tail = NULL;
+    pthread_mutex_unlock(&self->lock);
+
+    for (work_item_t* item = items; item; item = item->next) {
+        item->done = true;
+    }
+
+    return items;
+}
+
+/**
+ ***************************************************************************************************
+ * Tests
+ ***************************************************************************************************
+ */
+#define test_assert(cond, msg)                                                                     \
+    do {                                                                                           \
+        if (!(cond)) {                                                                             \
+            printf("Assertion failed: %s\n", msg);                                                 \
+            return -1;                                                                             \
+        }                                                                                          \
+    } while (0)
+
+typedef struct test_item_t {
+    work_item_t work;
+    pthread_t ran_on;
+} test_item_t;
+
+static void record_thread(work_item_t* item) { ((test_item_t*)item)->ran_on = pthread_self(); }
+
+static int test_inline_without_queue()
+{
+    // This thread has no completion queue, so the work has nowhere to come back to and has to run
+    // right away
+    test_item_t item = { .work = { .run = record_thread, .fd = 3 } };
+    workers_submit(&item.work);
+
+    test_assert(item.work.done, "expected work to be done immediately");
+    test_assert(pthread_equal(item.ran_on, pthread_self()), "expected work to run inline");
+    return 0;
+}
+
+static int test_completion_round_trip()
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        perror("socketpair");
+        return -1;
+    }
+    fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL, 0) | O_NONBLOCK);
+
+    completion_queue_t queue;
+    completion_queue_init(&queue, fds[1]);
+    workers_start(2);
+
+    test_item_t items[4];
+    for (int i = 0; i < 4; i++) {
+        items[i] = (test_item_t) { .work = { .run = record_thread, .fd = 10 + i } };
+        workers_submit(&items[i].work);
+    }
+
+    int completed = 0;
+    while (completed < 4) {
+        struct pollfd pfd = { .fd = fds[0], .events = POLLIN };
+        test_assert(poll(&pfd, 1, 5000) == 1, "timed out waiting for a completion");
+
+        char buf[16];
+        test_assert(read(fds[0], buf, sizeof(buf)) > 0, "expected a byte on the notify fd");
+
+        for (work_item_t* item = completion_queue_take(&queue); item; item = item->next) {
+            test_assert(item->done, "expected taken items to be marked done");
+            test_assert(item->fd >= 10 && item->fd < 14, "unexpected item on the queue");
+            test_assert(!pthread_equal(((test_item_t*)item)->ran_on, pthread_self()),
+                "expected work to run on a worker thread");
+            completed++;
+        }
+    }
+
+    current_queue = NULL;
+    close(fds[0]);
+    close(fds[1]);
+    return 0;
+}
+
+int workers_test_suite()
+{
+    int r = 0;
+    if (test_inline_without_queue() < 0) {
+        r = -1;
+        printf("\t❌ test_inline_without_queue\n");
+    } else {
+        printf("\t✅ test_inline_without_queue\n");
+    }
+    if (test_completion_round_trip() < 0) {
+        r = -1;
+        printf("\t❌ test_completion_round_trip\n");
+    } else {
+        printf("\t✅ test_completion_round_trip\n");
+    }
+    return r;
+}
@@ -0,0 +1,64 @@
+/**
+ * A pool of threads for blocking work (like reading files) that must not run on an event loop.
+ *
+ * Every event loop owns a completion queue. Work that a loop submits runs on one of the worker
+ * threads and is then pushed onto the completion queue of that same loop, after which a byte is
+ * written to the queue's notify fd. The loop watches the other end of that fd like it watches any
+ * client, takes the finished items off its queue, and polls the connections that were waiting for
+ * them.
+ */
+
+#pragma once
+
+#include "common.h"
+#include <pthread.h>
+
+typedef struct completion_queue_t completion_queue_t;
+
+typedef struct work_item_t {
+    // Does the actual work. Called on a worker thread.
+    void (*run)(struct work_item_t* self);
+    // The connection waiting on the work, which the event loop should poll again once it's done
+    int fd;
+    // Set once the item has come back to the loop that submitted it. Only ever accessed from that
+    // loop's thread, so until then the item belongs to the worker pool and must not be freed.
+    bool done;
+    // The queue the item is pushed onto when it is finished
+    completion_queue_t* completions;
+    // Link in the pool's pending list, and later in the completion queue
+    struct work_item_t* next;
+} work_item_t;
+
+struct completion_queue_t {
+    pthread_mutex_t lock;
+    work_item_t* head;
+    work_item_t* tail;
+    // Non-blocking fd that a byte is written to whenever an item is pushed onto the queue
+    int notify_fd;
+};
+
+/**
+ * Starts `thread_count` worker threads. With zero threads (or before this is called) submitted work
+ * runs right away on the submitting thread instead.
+ */
+void workers_start(int thread_count);
+
+/**
+ * Initializes the completion queue for the event loop running on the calling thread. Work submitted
+ * from this thread will come back through it.
+ */
+void completion_queue_init(completion_queue_t* self, int notify_fd);
+
+/**
+ * Hands the item to the worker pool. Check `done` to find out whether it has finished: that is
+ * already the case when this returns if there are no worker threads.
+ */
+void workers_submit(work_item_t* item);
+
+/**
+ * Takes every finished item off the queue, marks them as done, and returns them as a list linked
+ * through `next`. Must be called on the thread that owns the queue.
+ */
+work_item_t* completion_queue_take(completion_queue_t* self);
+
+int workers_test_suite();